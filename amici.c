@@ -4,80 +4,663 @@
 // @author Ryan Nowak rcn8263
 //
 
+#define _GNU_SOURCE  // strtok_r, open_memstream
+
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
+#include "amici.h"
+#include "arena.h"
+#include "bloom.h"
+#include "cdc.h"
+#include "diag.h"
+#include "graph.h"
 #include "hash.h"
+#include "metrics.h"
+#include "names.h"
+#include "server.h"
 #include "table.h"
+#include "writer.h"
+
+/// One partition of the network. A user belongs to the shard its handle
+/// hashes to, and each shard has its own table, counters and lock, so
+/// changes to different shards run in parallel.
+typedef struct shard_s {
+    Table t;                    ///< the shard's users, by handle
+    int people;                 ///< number of users in the shard
+    size_t user_bytes;          ///< bytes held by them and their strings
+    int friendships;            ///< friendships whose lower shard this is
+    arena_t people_arena;       ///< the person records of the shard's users
+    arena_t string_pool;        ///< their names, and handles kept out of line
+    bloom_t handles;            ///< filter of the handles, with --bloom
+    bloom_t edges;              ///< filter of the friendships counted here
+    names_t names;              ///< the shard's users by name, once built
+    atomic_bool names_built;    ///< names holds every user of the shard
+    pthread_mutex_t names_lock; ///< serializes building names
+    struct person_s *sample[DIAG_SAMPLE]; ///< a uniform sample of the users
+    uint64_t sample_state;      ///< generator choosing the sample
+    pthread_rwlock_t lock;      ///< guards everything else in the shard
+} shard_t;
+
+shard_t shards[MAX_SHARDS];
+
+/// A set of shards, holding bit i for the shard with index i.
+typedef uint64_t shard_set_t;
+
+#define SHARD_BIT(i) ((shard_set_t)1 << (i))
+#define ALL_SHARDS (~(shard_set_t)0)
+
+/// Number of shards in use, a power of two no larger than MAX_SHARDS.
+int shard_count = DEFAULT_SHARDS;
+
+/// Counts the changes made to the network. Each add, friend and unfriend
+/// advances it, and everything the change creates is stamped with the new
+/// value, so a snapshot taken at epoch E sees exactly the changes <= E.
+_Atomic uint64_t network_epoch;
+
+/// What print writes for one version of a user's friends.
+typedef struct profile_s {
+    size_t length;                  ///< bytes of text
+    char text[];                    ///< the output, not NUL terminated
+} profile_t;
 
-// The maximum length of any single input command line is 1024 characters, 
-// including the trailing newline and NUL characters.
-#define BUFFER_SIZE 1024
+/// Users with at least this many friends have what print writes for them
+/// kept with the version of their friends it was made from.
+#define PROFILE_CACHE_MIN 16
 
-Table t;
-int people;
-int friendships;
+/// One version of a user's friends. A published version never changes:
+/// friend and unfriend publish a new version with the old one linked
+/// behind it, so snapshot readers can go on using older versions while
+/// the network moves on. Since the version never changes, neither does
+/// its profile, which a new version starts without.
+typedef struct adjacency_s {
+    uint64_t epoch;                 ///< network epoch the version was made in
+    struct adjacency_s *older;      ///< the version this one replaced
+    _Atomic(profile_t *) profile;   ///< print output, once a print made it
+    size_t count;                   ///< current number of friends
+    struct person_s *friends[];     ///< the friends, oldest friendship first
+} adjacency_t;
+
+/// Handles up to this long are kept in the person record itself; longer
+/// ones go to the shard's string pool.
+#define SHORT_HANDLE 23
 
 typedef struct person_s {
+    char *handle;               ///< handle of the person, the table's key
+    char short_handle[SHORT_HANDLE + 1]; ///< the handle, if short enough
     char *firstName;            ///< first name of the person
     char *lastName;             ///< last name of the person
-    char *handle;               ///< handle of the person
-    struct person_s **friends;  ///< dynamic collection of friends
-    size_t friend_count;        ///< current number of friends 
-    size_t max_friends;         ///< current limit on friends
+    _Atomic(adjacency_t *) friends; ///< newest version of friends, or NULL
+    uint64_t born;              ///< network epoch the person was added in
+    struct person_s *next;      ///< person added before this one
+    int shard;                  ///< index of the shard holding the person
+    uint32_t number;            ///< how many people were added before
 } person_t;
 
+/// Number of people added since the network was last emptied.
+_Atomic uint32_t people_added;
+
+/// Counts the times init has emptied the network, so what was worked out
+/// about the network before is not taken for what is there now.
+_Atomic uint64_t network_resets;
+
+/// Bytes held by every version of every user's friends.
+_Atomic size_t friend_list_bytes;
+
+/// Every person in the network, most recently added first. A person is
+/// only ever pushed on the front, so snapshot readers walk it unlocked.
+_Atomic(person_t *) all_people;
+
+/// Open snapshots, identified by their index. Each holds the epoch it sees.
+/// Commands that read the network unlocked, like export, hold a snapshot
+/// of their own while they run, which clients cannot see. A query against
+/// a snapshot pins it as a reader, so a release meanwhile neither frees
+/// the versions it reads nor lets the slot be taken again until it ends.
+typedef struct snapshot_s {
+    bool open;                  ///< the slot holds an open snapshot
+    bool internal;              ///< the snapshot is held by a command
+    int readers;                ///< queries reading the snapshot now
+    uint64_t epoch;             ///< network epoch the snapshot sees
+} snapshot_t;
+
+snapshot_t snapshots[MAX_SNAPSHOTS];
+pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Filter handles and friendships through Bloom filters (--bloom).
+bool bloom_enabled;
+
+/// Keep the files of export and load inside export_dir. Socket clients may
+/// name any file the server can reach, so server mode always does.
+bool files_confined;
+
+/// The directory confined files are named in (--export-dir), or NULL to
+/// refuse them all.
+const char *export_dir;
+
+/// Return the index of the shard of a handle with the given hash. The shard
+/// comes from the high bits of a remixed hash: the table indexes with the
+/// low bits of the same hash, and every key in a shard would otherwise
+/// share them.
+///
+/// @param hash str_hash of the handle
+int shard_of(size_t hash) {
+    uint64_t mixed = (uint64_t)hash * 0x9E3779B97F4A7C15ull;
+    return (int)(mixed >> 32) & (shard_count - 1);
+}
+
+/// Return the index of the shard a handle belongs to.
+///
+/// @param handle unique identifier of user
+int shard_index(const char *handle) {
+    return shard_of(str_hash(handle));
+}
+
+/// Report whether a shard holds a handle, asking its Bloom filter first
+/// when it has one. The caller holds the shard's lock.
+///
+/// @param shard the handle's shard
+/// @param handle unique identifier of user
+/// @param hash str_hash of the handle
+bool has_handle(shard_t *shard, const char *handle, size_t hash) {
+    bool filtered = shard->handles.blocks != NULL;
+    if (filtered && !bloom_may_contain(&shard->handles, hash)) {
+        metrics_bloom(BLOOM_HANDLES, false, false);
+        return false;
+    }
+    metrics_table_ops(1);
+    bool present = ht_has(shard->t, handle);
+    if (filtered) {
+        metrics_bloom(BLOOM_HANDLES, true, present);
+    }
+    return present;
+}
+
+/// Look up the user with the given handle. The caller holds the lock of
+/// the handle's shard. Table has no lookup that may miss, so a known
+/// handle costs ht_has and then ht_get; the Bloom filter spares the
+/// unknown ones both.
+///
+/// @param handle unique identifier of user
+/// @return the user, or NULL if the handle is not known
+person_t *find_person(const char *handle) {
+    size_t hash = str_hash(handle);
+    shard_t *shard = &shards[shard_of(hash)];
+    diag_sample_key(handle);
+    if (!has_handle(shard, handle, hash)) {
+        return NULL;
+    }
+    metrics_table_ops(1);
+    return (person_t *)ht_get(shard->t, (const void*)handle);
+}
+
+/// Take the locks of a set of shards. They are always taken in index
+/// order, so commands holding overlapping sets never deadlock.
+///
+/// @param set the shards
+/// @param exclusive whether the holder changes the shards
+void lock_shards(shard_set_t set, bool exclusive) {
+    for (int i = 0; i < shard_count; i++) {
+        if (set & SHARD_BIT(i)) {
+            if (exclusive) {
+                pthread_rwlock_wrlock(&shards[i].lock);
+            }
+            else {
+                pthread_rwlock_rdlock(&shards[i].lock);
+            }
+        }
+    }
+}
+
+/// Release the locks of a set of shards.
+///
+/// @param set the shards
+void unlock_shards(shard_set_t set) {
+    for (int i = shard_count - 1; i >= 0; i--) {
+        if (set & SHARD_BIT(i)) {
+            pthread_rwlock_unlock(&shards[i].lock);
+        }
+    }
+}
+
+/// Look up several users at once. The Bloom filter blocks of all the
+/// handles are loaded together before any is looked up, and each user
+/// found is prefetched before the caller touches any of them, so those
+/// misses overlap. The table probes themselves cannot: Table looks up one
+/// key at a time.
+///
+/// @param handles unique identifiers of the users
+/// @param count number of handles
+/// @param found receives each user, or NULL where a handle is not known
+void find_people(char **handles, size_t count, person_t **found) {
+    for (size_t i = 0; i < count; i++) {
+        size_t hash = str_hash(handles[i]);
+        bloom_prefetch(&shards[shard_of(hash)].handles, hash);
+    }
+    for (size_t i = 0; i < count; i++) {
+        found[i] = find_person(handles[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (found[i] != NULL) {
+            __builtin_prefetch(found[i]);
+        }
+    }
+}
+
+/// Return the bytes held by a version of a user's friends.
+///
+/// @param friends the version
+size_t adjacency_size(const adjacency_t *friends) {
+    return sizeof(adjacency_t) + friends->count * sizeof(person_t *);
+}
+
+/// Return the bytes held by a person and the person's strings in the
+/// shard's string pool.
+///
+/// @param person pointer to an instance of struct person_s
+size_t person_size(const person_t *person) {
+    size_t bytes = sizeof(person_t) + strlen(person->firstName) + 
+        strlen(person->lastName) + 2;
+    if (person->handle != person->short_handle) {
+        bytes += strlen(person->handle) + 1;
+    }
+    return bytes;
+}
+
+/// Return the number of friends in a version of a user's friends.
+///
+/// @param friends the version, or NULL for none
+size_t count_friends(const adjacency_t *friends) {
+    return friends == NULL ? 0 : friends->count;
+}
+
+/// Find the version of a user's friends that a reader at the given epoch
+/// sees: the newest one made at or before it.
+///
+/// @param person pointer to an instance of struct person_s
+/// @param epoch the reader's network epoch
+/// @return the version, or NULL if the user had no friends yet
+adjacency_t *friends_at(person_t *person, uint64_t epoch) {
+    adjacency_t *friends = atomic_load_explicit(&person->friends,
+        memory_order_acquire);
+    while (friends != NULL && friends->epoch > epoch) {
+        friends = friends->older;
+    }
+    return friends;
+}
+
+/// A position in a walk over every user of the network as it was at an
+/// epoch. The walk needs no memory beyond the cursor and no lock, and may
+/// be left and picked up again at any time, as long as the epoch's
+/// versions stay pinned by a snapshot.
+typedef struct cursor_s {
+    uint64_t epoch;             ///< epoch whose users are walked
+    person_t *next;             ///< where the walk goes on, or NULL
+} cursor_t;
+
+/// Start a walk over the users of the network at an epoch.
+///
+/// @param cursor receives the start of the walk
+/// @param epoch the epoch
+void cursor_open(cursor_t *cursor, uint64_t epoch) {
+    cursor->epoch = epoch;
+    cursor->next = atomic_load_explicit(&all_people, memory_order_acquire);
+}
+
+/// Step to the next user of the walk, most recently added first.
+///
+/// @param cursor the walk
+/// @return the user, or NULL at the end of the walk
+person_t *cursor_next(cursor_t *cursor) {
+    // users added after the epoch are all in front of the ones it sees
+    while (cursor->next != NULL && cursor->next->born > cursor->epoch) {
+        cursor->next = cursor->next->next;
+    }
+    person_t *person = cursor->next;
+    if (person != NULL) {
+        cursor->next = person->next;
+    }
+    return person;
+}
+
+/// Return the epoch seen by the oldest snapshot that is open or still
+/// being read.
+///
+/// @return the epoch, or UINT64_MAX if no snapshot is open or read
+uint64_t oldest_snapshot(void) {
+    uint64_t oldest = UINT64_MAX;
+    pthread_mutex_lock(&snapshot_lock);
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if ((snapshots[i].open || snapshots[i].readers > 0) &&
+            snapshots[i].epoch < oldest) {
+            oldest = snapshots[i].epoch;
+        }
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return oldest;
+}
+
+/// Free a version of a user's friends, and its profile.
+///
+/// @param friends the version
+void free_friends(adjacency_t *friends) {
+    profile_t *profile = atomic_load_explicit(&friends->profile,
+        memory_order_relaxed);
+    if (profile != NULL) {
+        metrics_freed(sizeof(profile_t) + profile->length, 1);
+        free(profile);
+    }
+    metrics_freed(adjacency_size(friends), 1);
+    atomic_fetch_sub_explicit(&friend_list_bytes, adjacency_size(friends),
+        memory_order_relaxed);
+    free(friends);
+}
+
+/// Free every version of a user's friends older than the ones still seen
+/// by the newest reader and by the oldest open snapshot.
+///
+/// @param person pointer to an instance of struct person_s
+/// @param oldest epoch of the oldest open snapshot
+void prune_friends(person_t *person, uint64_t oldest) {
+    adjacency_t *keep = atomic_load_explicit(&person->friends,
+        memory_order_relaxed);
+    while (keep->older != NULL && keep->epoch > oldest) {
+        keep = keep->older;
+    }
+    // snapshot readers stop at keep, so never follow the link cut here
+    adjacency_t *old = keep->older;
+    if (old != NULL) {
+        keep->older = NULL;
+    }
+    while (old != NULL) {
+        adjacency_t *older = old->older;
+        free_friends(old);
+        old = older;
+    }
+}
+
+/// Make a new version of a user's friends: a copy of the current version
+/// with added appended or removed taken out. It is not seen by anyone
+/// until change_friends publishes it, and until then it is released with
+/// free. The caller holds the lock of the person's shard exclusively.
+///
+/// @pre removed, if given, is one of the person's friends
+/// @param person pointer to an instance of struct person_s
+/// @param added person to add to the friends, or NULL
+/// @param removed person to take out of the friends, or NULL
+/// @return the version, or NULL if there is no memory for it
+adjacency_t *copy_friends(person_t *person, person_t *added,
+    person_t *removed) {
+    adjacency_t *current = atomic_load_explicit(&person->friends,
+        memory_order_relaxed);
+    size_t count = count_friends(current);
+    size_t slots = count + (added != NULL) - (removed != NULL);
+    adjacency_t *next = malloc(sizeof(adjacency_t) +
+        slots * sizeof(person_t *));
+    if (next == NULL) {
+        return NULL;
+    }
+    metrics_scan(count);
+    next->older = current;
+    atomic_init(&next->profile, NULL);
+    next->count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (current->friends[i] != removed) {
+            next->friends[next->count++] = current->friends[i];
+        }
+    }
+    if (added != NULL) {
+        next->friends[next->count++] = added;
+    }
+    return next;
+}
+
+/// Publish a version of a user's friends made by copy_friends. The caller
+/// holds the lock of the person's shard exclusively.
+///
+/// @param person pointer to an instance of struct person_s
+/// @param next the version, made from the person's current one
+/// @param epoch the network epoch of the change
+/// @param oldest epoch of the oldest open snapshot
+void change_friends(person_t *person, adjacency_t *next, uint64_t epoch,
+    uint64_t oldest) {
+    next->epoch = epoch;
+    metrics_allocated(adjacency_size(next), 1);
+    atomic_fetch_add_explicit(&friend_list_bytes, adjacency_size(next),
+        memory_order_relaxed);
+    atomic_store_explicit(&person->friends, next, memory_order_release);
+    prune_friends(person, oldest);
+}
+
+/// Get the name of a user, for the name index.
+///
+/// @param value pointer to an instance of struct person_s
+/// @param name receives the user's names and handle
+void name_of(const void *value, name_t *name) {
+    const person_t *person = value;
+    name->last = person->lastName;
+    name->first = person->firstName;
+    name->handle = person->handle;
+}
+
+/// Size a shard's filters for a number of users, emptying them. Without
+/// --bloom, or without memory for them, the shard has no filters and
+/// every lookup goes to the table.
+///
+/// @param shard the shard
+/// @param users number of users to size them for
+void reset_filters(shard_t *shard, size_t users) {
+    bloom_free(&shard->handles);
+    bloom_free(&shard->edges);
+    if (bloom_enabled && (!bloom_init(&shard->handles, users, false) ||
+        !bloom_init(&shard->edges, users, true))) {
+        bloom_free(&shard->handles);
+    }
+}
+
+/// Rebuild a shard's handle filter twice as big, once it holds more
+/// handles than it was sized for. The caller holds the shard exclusively.
+///
+/// @param shard the shard
+void rebuild_handles(shard_t *shard) {
+    bloom_t filter;
+    person_t **people = (person_t **)ht_values(shard->t);
+    if (people == NULL || !bloom_init(&filter, 2 * shard->people, false)) {
+        // keep the old filter; it is only less selective
+        free(people);
+        return;
+    }
+    for (int i = 0; i < shard->people; i++) {
+        bloom_add(&filter, str_hash(people[i]->handle));
+    }
+    free(people);
+    bloom_free(&shard->handles);
+    shard->handles = filter;
+}
+
+/// Offer a user just added to a shard to its sample of users, which stays
+/// a uniform sample of them all (reservoir sampling, Vitter's algorithm R).
+/// The caller holds the shard exclusively, before counting the user.
+///
+/// @param shard the shard
+/// @param person the user
+void sample_person(shard_t *shard, person_t *person) {
+    size_t seen = shard->people;
+    if (seen < DIAG_SAMPLE) {
+        shard->sample[seen] = person;
+        return;
+    }
+    // xorshift64*; the handle's own hash would favour some home slots
+    shard->sample_state ^= shard->sample_state >> 12;
+    shard->sample_state ^= shard->sample_state << 25;
+    shard->sample_state ^= shard->sample_state >> 27;
+    uint64_t slot = shard->sample_state * 0x2545F4914F6CDD1DULL % (seen + 1);
+    if (slot < DIAG_SAMPLE) {
+        shard->sample[slot] = person;
+    }
+}
+
 /// Add the specified user having the indicated first and last names to the 
 /// database with the specified handle. Handles must be unique; names, 
 /// however, may be duplicated
 ///
 /// @pre names and handle are non-null and non-empty
+/// @param err stream receiving error messages
 /// @param firstName value in struct person_s that represents first name of user
 /// @param lastName value in struct person_s that represents last name of user
 /// @param handle unique identifier of user
-void add(char *firstName, char *lastName, char *handle) {
+/// @return AMICI_OK, AMICI_ETAKEN if the handle is in use, or AMICI_ENOMEM
+///    if there is no memory for the user
+status_t add(FILE *err, char *firstName, char *lastName, char *handle) {
+    size_t hash = str_hash(handle);
+    shard_t *shard = &shards[shard_of(hash)];
+    
     //handle already exists in table
-    if (ht_has(t, handle)) {
-        fprintf(stderr, "error: handle '%s' is already taken. Try another handle.\n", 
+    if (has_handle(shard, handle, hash)) {
+        fprintf(err, "error: handle '%s' is already taken. Try another handle.\n", 
             handle);
+        return AMICI_ETAKEN;
     }
     else {
-        person_t *person = (person_t *) malloc(sizeof(person_t));
-        //person_t *person = malloc(sizeof(person_t));
-        
-        person->firstName = malloc(strlen(firstName) + 1);
-        strcpy(person->firstName, firstName);
-        
-        person->lastName = malloc(strlen(lastName) + 1);
-        strcpy(person->lastName, lastName);
+        person_t *person = arena_alloc(&shard->people_arena, sizeof(person_t));
+        if (person == NULL) {
+            fprintf(err, "error: out of memory for '%s'\n", handle);
+            return AMICI_ENOMEM;
+        }
         
-        person->handle = malloc(strlen(handle) + 1) ;
-        strcpy(person->handle, handle);
+        // a short handle lives in the record, so comparing it against a
+        // looked up handle reads the line the record is on, not another
+        person->handle = person->short_handle;
+        if (strlen(handle) <= SHORT_HANDLE) {
+            strcpy(person->short_handle, handle);
+        }
+        else {
+            person->handle = arena_strdup(&shard->string_pool, handle);
+        }
+        person->firstName = arena_strdup(&shard->string_pool, firstName);
+        person->lastName = arena_strdup(&shard->string_pool, lastName);
+        if (person->handle == NULL || person->firstName == NULL || 
+            person->lastName == NULL) {
+            // the record and any strings taken stay unused in the arenas
+            fprintf(err, "error: out of memory for '%s'\n", handle);
+            return AMICI_ENOMEM;
+        }
+        if (atomic_load_explicit(&shard->names_built, memory_order_relaxed) &&
+            !names_insert(&shard->names, person)) {
+            // the index is as it was, and nothing else knows of the user
+            fprintf(err, "error: out of memory for '%s'\n", handle);
+            return AMICI_ENOMEM;
+        }
         
-        person->friend_count = 0;
-        person->max_friends = 10;
-        person->friends = calloc(person->max_friends, 
-            sizeof(char *) * person->max_friends);
-        ht_put(t, (const void*)person->handle, (const void*)person);
+        atomic_init(&person->friends, NULL);
+        person->shard = shard - shards;
+        person->number = atomic_fetch_add(&people_added, 1);
+        person->born = atomic_fetch_add(&network_epoch, 1) + 1;
+        person->next = atomic_load_explicit(&all_people, 
+            memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&all_people, 
+            &person->next, person, memory_order_release, 
+            memory_order_relaxed)) {
+        }
+        ht_put(shard->t, (const void*)person->handle, (const void*)person);
+        metrics_table_ops(1);
+        cdc_record(CDC_USER_ADDED, 3, 
+            (const char *[]){ handle, firstName, lastName });
         
-        people += 1;
+        sample_person(shard, person);
+        shard->people += 1;
+        shard->user_bytes += person_size(person);
+        if (shard->handles.blocks != NULL) {
+            bloom_add(&shard->handles, hash);
+            if (bloom_full(&shard->handles)) {
+                rebuild_handles(shard);
+            }
+        }
     }
+    return AMICI_OK;
 }
 
-/// Checks if there exists a friendship between person1 and person2
+/// Return the shard a friendship between two people is counted in: the
+/// lower of their two shards, both of which a change to it holds.
 ///
 /// @param person1 pointer to an instance of struct person_s
 /// @param person2 pointer to an instance of struct person_s
-bool has_friendship(person_t *person1, person_t *person2) {
-    int i = 0;
-    while (person1->friends[i] != 0) {
-        if (!strcmp(person1->friends[i]->handle, person2->handle)) {
-            return true;
+int lower_shard(person_t *person1, person_t *person2) {
+    return person1->shard < person2->shard ? person1->shard : person2->shard;
+}
+
+/// Return the key of the friendship between two people in the friendship
+/// filters: the same whichever way round they are given.
+///
+/// @param person1 pointer to an instance of struct person_s
+/// @param person2 pointer to an instance of struct person_s
+uint64_t edge_key(person_t *person1, person_t *person2) {
+    uint64_t low = person1->born < person2->born ? person1->born : person2->born;
+    uint64_t high = person1->born ^ person2->born ^ low;
+    return low * 0x9E3779B97F4A7C15ull + high;
+}
+
+/// Rebuild a shard's friendship filter twice as big, once it holds more
+/// friendships than it was sized for. A friendship is in the filter of the
+/// lower of its users' shards, so its users in this shard have all of
+/// them. The caller holds the shard exclusively.
+///
+/// @param shard the shard
+void rebuild_edges(shard_t *shard) {
+    bloom_t filter;
+    person_t **people = (person_t **)ht_values(shard->t);
+    if (people == NULL || !bloom_init(&filter, 2 * shard->friendships, true)) {
+        free(people);
+        return;
+    }
+    int index = shard - shards;
+    for (int i = 0; i < shard->people; i++) {
+        person_t *person = people[i];
+        adjacency_t *friends = atomic_load_explicit(&person->friends,
+            memory_order_relaxed);
+        for (size_t f = 0; f < count_friends(friends); f++) {
+            person_t *other = friends->friends[f];
+            // a friendship within the shard is seen from both ends
+            if (lower_shard(person, other) == index &&
+                (other->shard != index || person->born < other->born)) {
+                bloom_add(&filter, edge_key(person, other));
+            }
         }
-        i++;
     }
-    return false;
+    free(people);
+    bloom_free(&shard->edges);
+    shard->edges = filter;
+}
+
+/// Checks if there exists a friendship between person1 and person2, asking
+/// the friendship filter first when there is one. The caller holds the
+/// shards of both.
+///
+/// @param person1 pointer to an instance of struct person_s
+/// @param person2 pointer to an instance of struct person_s
+bool has_friendship(person_t *person1, person_t *person2) {
+    bloom_t *edges = &shards[lower_shard(person1, person2)].edges;
+    bool filtered = edges->blocks != NULL;
+    if (filtered && !bloom_may_contain(edges, edge_key(person1, person2))) {
+        metrics_bloom(BLOOM_EDGES, false, false);
+        return false;
+    }
+    adjacency_t *friends = atomic_load_explicit(&person1->friends,
+        memory_order_acquire);
+    bool found = false;
+    size_t i = 0;
+    for (; !found && i < count_friends(friends); i++) {
+        found = friends->friends[i] == person2;
+    }
+    metrics_scan(i);
+    if (filtered) {
+        metrics_bloom(BLOOM_EDGES, true, found);
+    }
+    return found;
 }
 
 /// Create a friendship between the two users identified by the indicated 
@@ -86,139 +669,258 @@ bool has_friendship(person_t *person1, person_t *person2) {
 /// between these users.
 ///
 /// @pre both handles are non-null and non-empty
+/// @param out stream receiving the command's output
+/// @param err stream receiving error messages
 /// @param handle1 unique identifier of user 1 
 /// @param handle2 unique identifier of user 2
-void add_friend(char *handle1, char *handle2) {
+/// @return AMICI_OK, AMICI_EUNKNOWN, AMICI_EUSAGE, AMICI_EFRIENDS or
+///    AMICI_ENOMEM
+status_t add_friend(FILE *out, FILE *err, char *handle1, char *handle2) {
+    char *handles[2] = { handle1, handle2 };
+    person_t *found[2];
+    find_people(handles, 2, found);
+    
     //check if given handles exist in table
-    if (!ht_has(t, handle1)) {
-        fprintf(stderr, "error: '%s' is not a known handle\n", handle1);
+    if (found[0] == NULL) {
+        fprintf(err, "error: '%s' is not a known handle\n", handle1);
+        return AMICI_EUNKNOWN;
+    }
+    else if (found[1] == NULL) {
+        fprintf(err, "error: '%s' is not a known handle\n", handle2);
+        return AMICI_EUNKNOWN;
     }
-    else if (!ht_has(t, handle2)) {
-        fprintf(stderr, "error: '%s' is not a known handle\n", handle2);
+    else if (found[0] == found[1]) {
+        fprintf(err, "error: '%s' can't be their own friend\n", handle1);
+        return AMICI_EUSAGE;
     }
     else {
-        person_t *person1;
-        person_t *person2;
-        
-        person1 = (person_t *)ht_get(t, (const void*)handle1);
-        person2 = (person_t *)ht_get(t, (const void*)handle2);
+        person_t *person1 = found[0];
+        person_t *person2 = found[1];
         
         if (!has_friendship(person1, person2)) {
-            person1->friends[person1->friend_count] = person2;
-            person1->friend_count += 1;
-            person2->friends[person2->friend_count] = person1;
-            person2->friend_count += 1;
+            // both versions are made before either is published, so no
+            // one ever sees half of the friendship
+            adjacency_t *next1 = copy_friends(person1, person2, NULL);
+            adjacency_t *next2 = copy_friends(person2, person1, NULL);
+            if (next1 == NULL || next2 == NULL) {
+                free(next1);
+                free(next2);
+                fprintf(err, "error: out of memory for '%s' and '%s'\n",
+                    person1->handle, person2->handle);
+                return AMICI_ENOMEM;
+            }
+            uint64_t epoch = atomic_fetch_add(&network_epoch, 1) + 1;
+            uint64_t oldest = oldest_snapshot();
+            change_friends(person1, next1, epoch, oldest);
+            change_friends(person2, next2, epoch, oldest);
             
-            friendships += 1;
-            printf("%s and %s are now friends\n", 
+            shard_t *shard = &shards[lower_shard(person1, person2)];
+            shard->friendships += 1;
+            if (shard->edges.blocks != NULL) {
+                bloom_add(&shard->edges, edge_key(person1, person2));
+                if (bloom_full(&shard->edges)) {
+                    rebuild_edges(shard);
+                }
+            }
+            cdc_record(CDC_FRIENDED, 2, 
+                (const char *[]){ person1->handle, person2->handle });
+            fprintf(out, "%s and %s are now friends\n", 
                 person1->handle, person2->handle);
         }
         else {
-            fprintf(stderr, "error: '%s' and '%s' are already friends.\n", 
+            fprintf(err, "error: '%s' and '%s' are already friends.\n", 
                 person1->handle, person2->handle);
+            return AMICI_EFRIENDS;
         }
     }
-}
-
-/// Removes the friendship that person1 has to person2. Must be called again
-/// with the same people in the opposite order to remove the friendship between
-/// them.
-/// 
-/// @param person1 pointer to an instance of struct person_s
-/// @param person2 pointer to an instance of struct person_s
-void remove_friend(person_t *person1, person_t *person2) {
-    int i = 0;
-    //char *temp;
-    bool tmp = false; 
-    while (person1->friends[i] != 0) {
-        if (tmp) {
-            person1->friends[i] = person1->friends[i+1];
-        }
-        if (!strcmp(person1->friends[i]->handle, person2->handle)) {
-            person1->friends[i] = person1->friends[i+1];
-            tmp = true;
-        } 
-        i++;
-    }
-    person1->friends[i-1] = 0;
-    person1->friend_count -= 1;
+    return AMICI_OK;
 }
 
 /// Dissolve the friendship that exists between the specified users. The two 
 /// handles must exist, and there must be a friendship between the users.
 /// 
 /// @pre both handles are non-null and non-empty
+/// @param out stream receiving the command's output
+/// @param err stream receiving error messages
 /// @param handle1 unique identifier of user 1
 /// @param handle2 unique identifier of user 2
-void unfriend(char *handle1, char *handle2) {
+/// @return AMICI_OK, AMICI_EUNKNOWN, AMICI_ENOTFRIENDS or AMICI_ENOMEM
+status_t unfriend(FILE *out, FILE *err, char *handle1, char *handle2) {
+    char *handles[2] = { handle1, handle2 };
+    person_t *found[2];
+    find_people(handles, 2, found);
+    
     //check if given handles exist in table
-    if (!ht_has(t, handle1)) {
-        fprintf(stderr, "error: '%s' is not a known handle\n", handle1);
+    if (found[0] == NULL) {
+        fprintf(err, "error: '%s' is not a known handle\n", handle1);
+        return AMICI_EUNKNOWN;
     }
-    else if (!ht_has(t, handle2)) {
-        fprintf(stderr, "error: '%s' is not a known handle\n", handle2);
+    else if (found[1] == NULL) {
+        fprintf(err, "error: '%s' is not a known handle\n", handle2);
+        return AMICI_EUNKNOWN;
     }
     else {
-        person_t *person1;
-        person_t *person2;
-        
-        person1 = (person_t *)ht_get(t, (const void*)handle1);
-        person2 = (person_t *)ht_get(t, (const void*)handle2);
+        person_t *person1 = found[0];
+        person_t *person2 = found[1];
     
         if (has_friendship(person1, person2)) {
-            //Remove friendship from person 1
-            remove_friend(person1, person2);
-            //Remove friendship from person 2
-            remove_friend(person2, person1);
+            //Remove each from the other's friends, as one change
+            adjacency_t *next1 = copy_friends(person1, NULL, person2);
+            adjacency_t *next2 = copy_friends(person2, NULL, person1);
+            if (next1 == NULL || next2 == NULL) {
+                free(next1);
+                free(next2);
+                fprintf(err, "error: out of memory for '%s' and '%s'\n",
+                    person1->handle, person2->handle);
+                return AMICI_ENOMEM;
+            }
+            uint64_t epoch = atomic_fetch_add(&network_epoch, 1) + 1;
+            uint64_t oldest = oldest_snapshot();
+            change_friends(person1, next1, epoch, oldest);
+            change_friends(person2, next2, epoch, oldest);
             
-            friendships -= 1;
-            printf("%s and %s are no longer friends\n", 
+            shard_t *shard = &shards[lower_shard(person1, person2)];
+            shard->friendships -= 1;
+            if (shard->edges.blocks != NULL) {
+                bloom_remove(&shard->edges, edge_key(person1, person2));
+            }
+            cdc_record(CDC_UNFRIENDED, 2, 
+                (const char *[]){ person1->handle, person2->handle });
+            fprintf(out, "%s and %s are no longer friends\n", 
                 person1->handle, person2->handle);
         }
         else {
-            fprintf(stderr, "error: '%s' and '%s' are were not friends.\n", 
+            fprintf(err, "error: '%s' and '%s' are were not friends.\n", 
                 person1->handle, person2->handle);
+            return AMICI_ENOTFRIENDS;
         }
     }
+    return AMICI_OK;
 }
 
 /// prints out the data of the user in the format
 /// firstName lastName ('handle')
 /// 
-/// @param handle unique identifier of user
-void print_user(char *handle) {
-    person_t *person;
-    person = (person_t *)ht_get(t, (const void*)handle);
-    
-    printf("%s %s ('%s')", person->firstName, person->lastName, person->handle);
+/// @param out stream receiving the output
+/// @param person pointer to an instance of struct person_s
+void print_user(FILE *out, person_t *person) {
+    fprintf(out, "%s %s ('%s')", person->firstName, person->lastName, person->handle);
+}
+
+/// Report the number of friends of a user, as seen in one version of the
+/// user's friends.
+///
+/// @param out stream receiving the report
+/// @param person pointer to an instance of struct person_s
+/// @param friends the version of the person's friends
+void print_size(FILE *out, person_t *person, adjacency_t *friends) {
+    size_t friend_count = count_friends(friends);
+    fprintf(out, "User ");
+    print_user(out, person);
+    if (friend_count == 0) {
+        fprintf(out, " has no friends\n");
+    }
+    else if (friend_count == 1) {
+        fprintf(out, " has 1 friend\n");
+    }
+    else {
+        fprintf(out, " has %ld friends\n", friend_count);
+    }
+}
+
+/// Report a user and each of the user's friends, as seen in one version of
+/// the user's friends.
+///
+/// @param out stream receiving the report
+/// @param person pointer to an instance of struct person_s
+/// @param friends the version of the person's friends
+void print_friends(FILE *out, person_t *person, adjacency_t *friends) {
+    print_size(out, person, friends);
+    for (size_t i = 0; i < count_friends(friends); i++) {
+        fprintf(out, "\t");
+        print_user(out, friends->friends[i]);
+        fprintf(out, "\n");
+    }
+}
+
+/// Format what print writes for a version of a user's friends.
+///
+/// @param person pointer to an instance of struct person_s
+/// @param friends the version
+/// @return the profile, or NULL if there is no memory for it
+profile_t *make_profile(person_t *person, adjacency_t *friends) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE *f = open_memstream(&text, &length);
+    if (f == NULL) {
+        return NULL;
+    }
+    print_friends(f, person, friends);
+    if (fclose(f) != 0) {
+        free(text);
+        return NULL;
+    }
+    profile_t *profile = malloc(sizeof(profile_t) + length);
+    if (profile != NULL) {
+        profile->length = length;
+        memcpy(profile->text, text, length);
+        metrics_allocated(sizeof(profile_t) + length, 1);
+    }
+    free(text);
+    return profile;
+}
+
+/// Write what print writes for a user, as seen in one version of the
+/// user's friends. For a user with many friends it is formatted once per
+/// version, by the first print to need it, and then written whole.
+///
+/// @param out stream receiving the report
+/// @param person pointer to an instance of struct person_s
+/// @param friends the version of the person's friends
+void write_profile(FILE *out, person_t *person, adjacency_t *friends) {
+    if (count_friends(friends) < PROFILE_CACHE_MIN) {
+        print_friends(out, person, friends);
+        return;
+    }
+    profile_t *profile = atomic_load_explicit(&friends->profile,
+        memory_order_acquire);
+    if (profile == NULL) {
+        profile = make_profile(person, friends);
+        if (profile == NULL) {
+            print_friends(out, person, friends);
+            return;
+        }
+        // readers share the version; the first profile installed is kept
+        profile_t *installed = NULL;
+        if (!atomic_compare_exchange_strong_explicit(&friends->profile,
+            &installed, profile, memory_order_acq_rel,
+            memory_order_acquire)) {
+            metrics_freed(sizeof(profile_t) + profile->length, 1);
+            free(profile);
+            profile = installed;
+        }
+    }
+    fwrite(profile->text, 1, profile->length, out);
 }
 
 /// Count the number of existing friendships for the specified user, and 
 /// report that. The specified handle must be in the system.
 ///
 /// @pre handle is non-null and non-empty
+/// @param out stream receiving the command's output
+/// @param err stream receiving error messages
 /// @param handle unique identifier of user
-void size(char *handle) {
+/// @return AMICI_OK, or AMICI_EUNKNOWN if the handle is not known
+status_t size(FILE *out, FILE *err, char *handle) {
+    person_t *person = find_person(handle);
+    
     //check if given handles exist in table
-    if (!ht_has(t, handle)) {
-        fprintf(stderr, "error: '%s' is not a known handle\n", handle);
-    }
-    else {
-        person_t *person;
-        person = (person_t *)ht_get(t, (const void*)handle);
-        
-        printf("User ");
-        print_user(handle);
-        if (person->friend_count == 0) {
-            printf(" has no friends\n");
-        }
-        else if (person->friend_count == 1) {
-            printf(" has 1 friend\n");
-        }
-        else {
-            printf(" has %ld friends\n", person->friend_count);
-        }
+    if (person == NULL) {
+        fprintf(err, "error: '%s' is not a known handle\n", handle);
+        return AMICI_EUNKNOWN;
     }
+    print_size(out, person, atomic_load(&person->friends));
+    return AMICI_OK;
 }
 
 /// Find the entry for the specified user, and print the user's name and 
@@ -226,209 +928,1826 @@ void size(char *handle) {
 /// handle must be in the system.
 ///
 /// @pre handle is non-null and non-empty
+/// @param out stream receiving the command's output
+/// @param err stream receiving error messages
 /// @param handle unique identifier of user
-void print(char *handle) {
+/// @return AMICI_OK, or AMICI_EUNKNOWN if the handle is not known
+status_t print(FILE *out, FILE *err, char *handle) {
+    person_t *person = find_person(handle);
+    
     //check if given handles exist in table
-    if (!ht_has(t, handle)) {
-        fprintf(stderr, "error: '%s' is not a known handle\n", handle);
+    if (person == NULL) {
+        fprintf(err, "error: '%s' is not a known handle\n", handle);
+        return AMICI_EUNKNOWN;
+    }
+    write_profile(out, person, atomic_load(&person->friends));
+    return AMICI_OK;
+}
+
+/// Build a shard's name index, the first time it is searched; from then on
+/// add keeps it up to date. Until then adding users costs nothing extra.
+/// The caller holds the shard shared, so searches of it may build it at
+/// once, and the shard's names_lock makes them take turns.
+///
+/// @param shard the shard
+/// @return false if there is no memory for it
+bool build_names(shard_t *shard) {
+    if (atomic_load_explicit(&shard->names_built, memory_order_acquire)) {
+        return true;
+    }
+    pthread_mutex_lock(&shard->names_lock);
+    bool built = atomic_load_explicit(&shard->names_built, 
+        memory_order_relaxed);
+    if (!built) {
+        void **people = ht_values(shard->t);
+        built = (people != NULL || shard->people == 0) &&
+            names_build(&shard->names, people, shard->people);
+        free(people);
+        atomic_store_explicit(&shard->names_built, built, 
+            memory_order_release);
+    }
+    pthread_mutex_unlock(&shard->names_lock);
+    return built;
+}
+
+/// Step a cursor over a name index to the next user whose last name is,
+/// or starts with, the given name. Such users are together in the index,
+/// so the first that does not match ends them.
+///
+/// @param cursor a position in a name index
+/// @param name the last name, or its start
+/// @param prefix match the users whose last names start with name
+/// @return the user, or NULL if there are no more that match
+person_t *next_match(names_cursor_t *cursor, const char *name, bool prefix) {
+    person_t *person = names_next(cursor);
+    if (person != NULL && (prefix ? 
+        strncmp(person->lastName, name, strlen(name)) : 
+        strcmp(person->lastName, name))) {
+        return NULL;
+    }
+    return person;
+}
+
+/// List the users whose last name is, or starts with, the given name, in
+/// order of last name, first name and handle, NAME_PAGE at a time. Each
+/// shard's users come from its name index, and the shards' lists are
+/// merged. When more users match than are listed, the last line says
+/// which handle to ask for the next page after. The caller holds the
+/// lock of every shard.
+///
+/// @param out stream receiving the list
+/// @param err stream receiving error messages
+/// @param name the last name, or its start
+/// @param prefix list the users whose last names start with name
+/// @param after handle of the user to list the users after, or NULL
+/// @return AMICI_OK, AMICI_EUNKNOWN if the handle after is not known, or
+///    AMICI_ENOMEM if there is no memory for the name index
+status_t find_names(FILE *out, FILE *err, const char *name, bool prefix,
+    const char *after) {
+    name_t from = { name, "", "" };
+    bool past = false;
+    if (after != NULL) {
+        person_t *person = find_person(after);
+        if (person == NULL) {
+            fprintf(err, "error: '%s' is not a known handle\n", after);
+            return AMICI_EUNKNOWN;
+        }
+        // a user before the matches starts the list at the beginning
+        name_t mark;
+        name_of(person, &mark);
+        if (names_compare(&mark, &from) > 0) {
+            from = mark;
+            past = true;
+        }
+    }
+    
+    for (int i = 0; i < shard_count; i++) {
+        if (!build_names(&shards[i])) {
+            fprintf(err, "error: out of memory for the name index\n");
+            return AMICI_ENOMEM;
+        }
+    }
+    names_cursor_t cursors[MAX_SHARDS];
+    person_t *heads[MAX_SHARDS];
+    for (int i = 0; i < shard_count; i++) {
+        names_seek(&shards[i].names, &from, past, &cursors[i]);
+        heads[i] = next_match(&cursors[i], name, prefix);
+    }
+    
+    if (prefix) {
+        fprintf(out, "Users whose last name starts with '%s':\n", name);
     }
     else {
-        size(handle);
-        
-        person_t *person;
-          person = (person_t *)ht_get(t, (const void*)handle);
-        
-        int i = 0;
-        while (person->friends[i] != 0) {
-            printf("\t");
-            print_user(person->friends[i]->handle);
-            printf("\n");
-            i++;
+        fprintf(out, "Users with the last name '%s':\n", name);
+    }
+    int listed = 0;
+    person_t *last = NULL;
+    for (;;) {
+        int next = -1;
+        name_t least;
+        for (int i = 0; i < shard_count; i++) {
+            name_t head;
+            if (heads[i] == NULL) {
+                continue;
+            }
+            name_of(heads[i], &head);
+            if (next < 0 || names_compare(&head, &least) < 0) {
+                next = i;
+                least = head;
+            }
+        }
+        if (next < 0) {
+            break;
         }
+        if (listed == NAME_PAGE) {
+            fprintf(out, "\tmore after '%s'\n", last->handle);
+            break;
+        }
+        last = heads[next];
+        fprintf(out, "\t");
+        print_user(out, last);
+        fprintf(out, "\n");
+        listed++;
+        heads[next] = next_match(&cursors[next], name, prefix);
     }
+    if (listed == 0) {
+        fprintf(out, "\tnone\n");
+    }
+    return AMICI_OK;
 }
 
-/// Report on the current contents of the network by printing the number of 
-/// users in the system and the number of unique friendships
-void stats() {
-    printf("Statistics: ");
+/// Print the statistics line for the given counts.
+///
+/// @param out stream receiving the report
+/// @param people number of users
+/// @param friendships number of unique friendships
+void print_stats(FILE *out, size_t people, size_t friendships) {
+    fprintf(out, "Statistics: ");
     if (people == 1) {
-        printf("%d person, ", people);
+        fprintf(out, "%zu person, ", people);
     }
     else {
-        printf("%d people, ", people);
+        fprintf(out, "%zu people, ", people);
     }
     if (friendships == 1) {
-        printf("%d friendship\n", friendships);
+        fprintf(out, "%zu friendship\n", friendships);
     }
     else {
-        printf("%d friendships\n", friendships);
+        fprintf(out, "%zu friendships\n", friendships);
     }
 }
 
-
-/// helper function used by Table t that will delete the given user and free all
-/// of its data
-/// 
-/// @param key in the table represented by handle
-/// @param value is the person_t that is associated with the given key
-void delete_1_ptr_str(void *key, void *value) {
-    person_t *person;
-    person = (person_t *) value;
-    free(person->firstName);
-    free(person->lastName);
-    free(key);
-    free(person->friends);
-    free(person);
+/// Report on the current contents of the network by printing the number of 
+/// users in the system and the number of unique friendships. The caller
+/// holds the lock of every shard.
+///
+/// @param out stream receiving the report
+void stats(FILE *out) {
+    size_t people = 0;
+    size_t friendships = 0;
+    for (int i = 0; i < shard_count; i++) {
+        people += shards[i].people;
+        friendships += shards[i].friendships;
+    }
+    print_stats(out, people, friendships);
 }
 
-/// creates a new hash table that the users will be stored in
-void init_table(void) {
-	t = ht_create(str_hash, str_equals, str_long_print, delete_1_ptr_str);
-	people = 0;
-	friendships = 0;
+/// Take a snapshot slot for the network as it is now, pinning every
+/// version the snapshot sees until it is released.
+///
+/// @param internal the snapshot is held by a command, not a client
+/// @param epoch receives the epoch the snapshot sees; a client may release
+///    the slot as soon as it is taken, so it is not read back from there
+/// @return the snapshot's id, or MAX_SNAPSHOTS if every slot is in use
+int take_snapshot(bool internal, uint64_t *epoch) {
+    // holding every shard shared orders the snapshot against every change,
+    // so it sees each change whole and none prunes versions it is to see
+    lock_shards(ALL_SHARDS, false);
+    pthread_mutex_lock(&snapshot_lock);
+    int id = 0;
+    while (id < MAX_SNAPSHOTS &&
+        (snapshots[id].open || snapshots[id].readers > 0)) {
+        id++;
+    }
+    if (id < MAX_SNAPSHOTS) {
+        snapshots[id].open = true;
+        snapshots[id].internal = internal;
+        snapshots[id].epoch = atomic_load(&network_epoch);
+        *epoch = snapshots[id].epoch;
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    unlock_shards(ALL_SHARDS);
+    return id;
 }
 
-/// deletes the current table. Also goes through each user in the table and 
+/// Release a snapshot held by a command.
+///
+/// @param id the snapshot's id
+void end_snapshot(int id) {
+    pthread_mutex_lock(&snapshot_lock);
+    snapshots[id].open = false;
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+/// Open a snapshot of the network as it is now. Changes made after it
+/// are invisible to its queries, and no change ever waits for it.
+///
+/// @param out stream receiving the snapshot's id
+/// @param err stream receiving error messages
+/// @return AMICI_OK, or AMICI_EBUSY if every snapshot slot is in use
+status_t open_snapshot(FILE *out, FILE *err) {
+    uint64_t epoch;
+    int id = take_snapshot(false, &epoch);
+    if (id == MAX_SNAPSHOTS) {
+        fprintf(err, "error: all %d snapshots are open\n", MAX_SNAPSHOTS);
+        return AMICI_EBUSY;
+    }
+    fprintf(out, "snapshot %d opened at epoch %lu\n", id, 
+        (unsigned long)epoch);
+    return AMICI_OK;
+}
+
+/// Close a snapshot, letting the versions only it was seeing be freed once
+/// the queries still reading it end.
+///
+/// @param out stream receiving the confirmation
+/// @param err stream receiving error messages
+/// @param id the snapshot's id
+/// @return AMICI_OK, or AMICI_EUNKNOWN if no such snapshot is open
+status_t release_snapshot(FILE *out, FILE *err, const char *id) {
+    char *end;
+    long i = strtol(id, &end, 10);
+    status_t status = AMICI_EUNKNOWN;
+    pthread_mutex_lock(&snapshot_lock);
+    if (*end == '\0' && i >= 0 && i < MAX_SNAPSHOTS && snapshots[i].open &&
+        !snapshots[i].internal) {
+        snapshots[i].open = false;
+        status = AMICI_OK;
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    
+    if (status != AMICI_OK) {
+        fprintf(err, "error: '%s' is not an open snapshot\n", id);
+        return status;
+    }
+    fprintf(out, "snapshot %ld released\n", i);
+    return AMICI_OK;
+}
+
+/// Answer a query at a snapshot's epoch, which the caller keeps pinned.
+///
+/// @param out stream receiving the command's output
+/// @param err stream receiving error messages
+/// @param cmd the words of the command, after the snapshot's id
+/// @param numArgs number of words in cmd
+/// @param epoch the snapshot's epoch
+/// @return the status of the query
+status_t read_snapshot(FILE *out, FILE *err, char **cmd, int numArgs,
+    uint64_t epoch) {
+    if (numArgs == 1 && !strcmp(cmd[0], "stats")) {
+        size_t count = 0;
+        size_t degrees = 0;
+        person_t *person = atomic_load_explicit(&all_people,
+            memory_order_acquire);
+        for (; person != NULL; person = person->next) {
+            if (person->born <= epoch) {
+                count++;
+                degrees += count_friends(friends_at(person, epoch));
+            }
+        }
+        print_stats(out, count, degrees / 2);
+        return AMICI_OK;
+    }
+    if (numArgs == 2 && 
+        (!strcmp(cmd[0], "print") || !strcmp(cmd[0], "size"))) {
+        pthread_rwlock_t *lock = &shards[shard_index(cmd[1])].lock;
+        pthread_rwlock_rdlock(lock);
+        person_t *person = find_person(cmd[1]);
+        pthread_rwlock_unlock(lock);
+        if (person == NULL || person->born > epoch) {
+            fprintf(err, "error: '%s' is not a known handle\n", cmd[1]);
+            return AMICI_EUNKNOWN;
+        }
+        if (!strcmp(cmd[0], "print")) {
+            write_profile(out, person, friends_at(person, epoch));
+        }
+        else {
+            print_size(out, person, friends_at(person, epoch));
+        }
+        return AMICI_OK;
+    }
+    fprintf(err, "error: snapshot command usage: "
+        "[id print handle | id size handle | id stats]\n");
+    return AMICI_EUSAGE;
+}
+
+/// Answer a query against an open snapshot: print or size of a handle,
+/// or stats of the whole network. Only the handle lookup holds a shard
+/// lock; everything else reads versions the snapshot pins, and the query
+/// holds it as a reader throughout, so a release meanwhile frees none of
+/// them.
+///
+/// @param out stream receiving the command's output
+/// @param err stream receiving error messages
+/// @param cmd the words of the command, after the word snapshot
+/// @param numArgs number of words in cmd
+/// @return the status of the query
+status_t query_snapshot(FILE *out, FILE *err, char **cmd, int numArgs) {
+    char *end;
+    long i = strtol(cmd[0], &end, 10);
+    bool open = false;
+    uint64_t epoch = 0;
+    pthread_mutex_lock(&snapshot_lock);
+    if (*end == '\0' && i >= 0 && i < MAX_SNAPSHOTS && snapshots[i].open &&
+        !snapshots[i].internal) {
+        open = true;
+        epoch = snapshots[i].epoch;
+        snapshots[i].readers++;
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    if (!open) {
+        fprintf(err, "error: '%s' is not an open snapshot\n", cmd[0]);
+        return AMICI_EUNKNOWN;
+    }
+    
+    status_t status = read_snapshot(out, err, &cmd[1], numArgs - 1, epoch);
+    pthread_mutex_lock(&snapshot_lock);
+    snapshots[i].readers--;
+    pthread_mutex_unlock(&snapshot_lock);
+    return status;
+}
+
+/// The formats the network is exported in.
+typedef enum {
+    EXPORT_CSV,                 ///< a row of names and friends per user
+    EXPORT_EDGELIST,            ///< a line of two handles per friendship
+    EXPORT_BINARY,              ///< length prefixed records per user
+} export_format_t;
+
+/// Names of the export formats, by export_format_t.
+static const char *export_names[] = { "csv", "edgelist", "binary" };
+
+/// Magic number a binary export starts with.
+#define EXPORT_MAGIC "AMICIBN1"
+
+/// Write a CSV field, quoted if it holds a comma, quote or line break.
+///
+/// @param writer the export file
+/// @param s the field
+void write_csv_field(writer_t *writer, const char *s) {
+    if (strpbrk(s, ",\"\r\n") == NULL) {
+        writer_string(writer, s);
+        return;
+    }
+    writer_write(writer, "\"", 1);
+    for (const char *quote; (quote = strchr(s, '"')) != NULL; s = quote + 1) {
+        writer_write(writer, s, quote + 1 - s);
+        writer_write(writer, "\"", 1);
+    }
+    writer_string(writer, s);
+    writer_write(writer, "\"", 1);
+}
+
+/// Write a little-endian unsigned integer of the given number of bytes.
+///
+/// @param writer the export file
+/// @param value the integer
+/// @param bytes its size in the file
+void write_binary_int(writer_t *writer, uint32_t value, int bytes) {
+    unsigned char le[4];
+    for (int i = 0; i < bytes; i++) {
+        le[i] = value >> (8 * i);
+    }
+    writer_write(writer, le, bytes);
+}
+
+/// Write a string as its 16-bit length and its bytes. No string amici
+/// holds can be longer than a command line.
+///
+/// @param writer the export file
+/// @param s the string
+void write_binary_string(writer_t *writer, const char *s) {
+    size_t length = strlen(s);
+    write_binary_int(writer, length, 2);
+    writer_write(writer, s, length);
+}
+
+/// Write one user and the user's friends as they were at an epoch.
+///
+/// csv: handle,first_name,last_name,friends with the friends' handles
+///    separated by spaces, which handles never hold.
+/// edgelist: a line "handle1 handle2" for each friendship, written with
+///    the one of the two users added last.
+/// binary: the handle, first and last name as strings, a 32-bit count of
+///    friends and their handles as strings.
+///
+/// @param writer the export file
+/// @param format the format
+/// @param person pointer to an instance of struct person_s
+/// @param friends the person's friends at the epoch, or NULL for none
+void export_user(writer_t *writer, export_format_t format, person_t *person,
+    adjacency_t *friends) {
+    size_t count = count_friends(friends);
+    switch (format) {
+    case EXPORT_CSV:
+        write_csv_field(writer, person->handle);
+        writer_write(writer, ",", 1);
+        write_csv_field(writer, person->firstName);
+        writer_write(writer, ",", 1);
+        write_csv_field(writer, person->lastName);
+        writer_write(writer, ",", 1);
+        for (size_t i = 0; i < count; i++) {
+            if (i > 0) {
+                writer_write(writer, " ", 1);
+            }
+            write_csv_field(writer, friends->friends[i]->handle);
+        }
+        writer_write(writer, "\n", 1);
+        break;
+    case EXPORT_EDGELIST:
+        for (size_t i = 0; i < count; i++) {
+            if (friends->friends[i]->born < person->born) {
+                writer_string(writer, friends->friends[i]->handle);
+                writer_write(writer, " ", 1);
+                writer_string(writer, person->handle);
+                writer_write(writer, "\n", 1);
+            }
+        }
+        break;
+    case EXPORT_BINARY:
+        write_binary_string(writer, person->handle);
+        write_binary_string(writer, person->firstName);
+        write_binary_string(writer, person->lastName);
+        write_binary_int(writer, count, 4);
+        for (size_t i = 0; i < count; i++) {
+            write_binary_string(writer, friends->friends[i]->handle);
+        }
+        break;
+    }
+    metrics_scan(count);
+}
+
+/// Write the whole network, as it is when the command starts, to a file.
+/// The network is read through a snapshot of its own, with no lock held,
+/// and streamed out through one fixed-size buffer, so no change waits for
+/// the export and its memory does not grow with the network.
+///
+/// A binary export starts with EXPORT_MAGIC and ends with an empty handle.
+///
+/// @param out stream receiving the size of the export
+/// @param err stream receiving error messages
+/// @param path the file
+/// @param name the format's name, or NULL for csv
+/// @return AMICI_OK, AMICI_EUSAGE for an unknown format, AMICI_EBUSY if
+///    every snapshot slot is in use, or AMICI_EIO if the file cannot be
+///    written
+status_t export_network(FILE *out, FILE *err, const char *path, 
+    const char *name) {
+    export_format_t format = EXPORT_CSV;
+    while (name != NULL && strcmp(name, export_names[format])) {
+        if (format == EXPORT_BINARY) {
+            fprintf(err, "error: export format must be csv, edgelist or "
+                "binary\n");
+            return AMICI_EUSAGE;
+        }
+        format++;
+    }
+    // the snapshot first, so an export refused for want of one leaves the
+    // file as it was
+    uint64_t epoch;
+    int id = take_snapshot(true, &epoch);
+    if (id == MAX_SNAPSHOTS) {
+        fprintf(err, "error: all %d snapshots are open\n", MAX_SNAPSHOTS);
+        return AMICI_EBUSY;
+    }
+    writer_t *writer = writer_open(path);
+    if (writer == NULL) {
+        fprintf(err, "error: cannot write '%s': %s\n", path, strerror(errno));
+        end_snapshot(id);
+        return AMICI_EIO;
+    }
+    
+    if (format == EXPORT_CSV) {
+        writer_string(writer, "handle,first_name,last_name,friends\n");
+    }
+    else if (format == EXPORT_BINARY) {
+        writer_string(writer, EXPORT_MAGIC);
+    }
+    cursor_t cursor;
+    cursor_open(&cursor, epoch);
+    size_t users = 0;
+    size_t degrees = 0;
+    for (person_t *person; (person = cursor_next(&cursor)) != NULL; ) {
+        adjacency_t *friends = friends_at(person, cursor.epoch);
+        export_user(writer, format, person, friends);
+        users++;
+        degrees += count_friends(friends);
+    }
+    if (format == EXPORT_BINARY) {
+        write_binary_int(writer, 0, 2);
+    }
+    
+    end_snapshot(id);
+    uint64_t length = writer_length(writer);
+    if (!writer_close(writer)) {
+        fprintf(err, "error: cannot write '%s': %s\n", path, strerror(errno));
+        return AMICI_EIO;
+    }
+    fprintf(out, "exported %zu user%s and %zu friendship%s to '%s' "
+        "(%s, %llu bytes)\n", users, users == 1 ? "" : "s", degrees / 2,
+        degrees == 2 ? "" : "s", path, export_names[format],
+        (unsigned long long)length);
+    return AMICI_OK;
+}
+
+/// The most users distances searches from.
+#define MAX_SAMPLES 4096
+
+/// Users distances searches from unless told otherwise.
+#define DEFAULT_SAMPLES 32
+
+/// The network as it was at an epoch, copied into a compact graph for
+/// reach and distances, with what has been worked out about it. It is kept
+/// until the network changes, so asking again about a network that has
+/// not is a lookup, and its arrays are kept for the next copy after that.
+typedef struct analysis_s {
+    pthread_mutex_t lock;       ///< guards everything else
+    bool copied;                ///< graph holds the network at epoch
+    uint64_t epoch;             ///< epoch the network was copied at
+    uint64_t resets;            ///< network_resets when it was copied
+    graph_t graph;              ///< node i is the person with number i
+    person_t **people;          ///< the person of each node, or NULL
+    uint32_t users;             ///< nodes that have a person
+    uint32_t people_capacity;   ///< room in people
+} analysis_t;
+
+analysis_t analysis = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/// Copy the network at an epoch into the analysis graph, unless it holds
+/// that already. The caller holds the analysis lock, and a snapshot at the
+/// epoch.
+///
+/// @param epoch the epoch
+/// @return false if there is no memory for the copy
+bool copy_network(uint64_t epoch) {
+    uint64_t resets = atomic_load(&network_resets);
+    if (analysis.copied && analysis.epoch == epoch && 
+        analysis.resets == resets) {
+        return true;
+    }
+    analysis.copied = false;
+    uint32_t nodes = 0;
+    uint64_t edges = 0;
+    cursor_t cursor;
+    cursor_open(&cursor, epoch);
+    for (person_t *person; (person = cursor_next(&cursor)) != NULL; ) {
+        if (person->number >= nodes) {
+            nodes = person->number + 1;
+        }
+        edges += count_friends(friends_at(person, epoch));
+    }
+    if (nodes > analysis.people_capacity || analysis.people == NULL) {
+        if (analysis.people != NULL) {
+            metrics_freed(analysis.people_capacity * sizeof(person_t *), 1);
+            free(analysis.people);
+        }
+        uint32_t capacity = nodes > 0 ? nodes : 1;
+        analysis.people_capacity = 0;
+        analysis.people = malloc(capacity * sizeof(person_t *));
+        if (analysis.people == NULL) {
+            return false;
+        }
+        metrics_allocated(capacity * sizeof(person_t *), 1);
+        analysis.people_capacity = capacity;
+    }
+    if (!graph_reserve(&analysis.graph, nodes, edges)) {
+        return false;
+    }
+    
+    // people added at once may be numbered in another order than they
+    // were added in, so a few numbers may have no person at the epoch
+    person_t **people = analysis.people;
+    memset(people, 0, nodes * sizeof(person_t *));
+    analysis.users = 0;
+    cursor_open(&cursor, epoch);
+    for (person_t *person; (person = cursor_next(&cursor)) != NULL; ) {
+        people[person->number] = person;
+        analysis.users++;
+    }
+    uint64_t *start = analysis.graph.start;
+    uint32_t *neighbours = analysis.graph.edges;
+    uint64_t e = 0;
+    for (uint32_t i = 0; i < nodes; i++) {
+        start[i] = e;
+        if (people[i] != NULL) {
+            adjacency_t *friends = friends_at(people[i], epoch);
+            for (size_t j = 0; j < count_friends(friends); j++) {
+                neighbours[e++] = friends->friends[j]->number;
+            }
+        }
+    }
+    start[nodes] = e;
+    analysis.epoch = epoch;
+    analysis.resets = resets;
+    analysis.copied = true;
+    return true;
+}
+
+/// HyperANF's estimates for every user at an epoch, which reach answers
+/// from. They are worked out by a refresh thread, from the analysis graph,
+/// and copied here when done, so that while the network changes reach
+/// answers at once from the last estimates made, and the newer ones are
+/// worked out in the background, one refresh at a time.
+typedef struct estimates_s {
+    pthread_mutex_t lock;       ///< guards everything else
+    pthread_cond_t done;        ///< signalled when a refresh ends
+    bool refreshing;            ///< a refresh is under way
+    status_t failure;           ///< AMICI_OK, or why the last refresh failed
+    bool started;               ///< refresher is still to be joined
+    pthread_t refresher;        ///< the thread of the last refresh
+    uint64_t epoch;             ///< epoch the estimates are for
+    uint64_t resets;            ///< network_resets when they were made
+    uint32_t nodes;             ///< nodes they are for, or 0 if none
+    uint32_t capacity;          ///< nodes balls has room for
+    float *balls;               ///< as graph_t's balls
+} estimates_t;
+
+estimates_t estimates = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+/// Work out HyperANF's estimates for the network as it is now, and keep
+/// them in estimates. Run on a thread of its own, by start_refresh.
+///
+/// @param arg unused
+/// @return NULL
+void *refresh_estimates(void *arg) {
+    (void)arg;
+    uint64_t epoch;
+    uint64_t resets = atomic_load(&network_resets);
+    int id = take_snapshot(true, &epoch);
+    bool ready = id != MAX_SNAPSHOTS;
+    pthread_mutex_lock(&analysis.lock);
+    ready = ready && copy_network(epoch) && 
+        (analysis.graph.hops > 0 || graph_anf(&analysis.graph));
+    uint32_t nodes = analysis.graph.nodes;
+    pthread_mutex_lock(&estimates.lock);
+    if (ready && nodes > estimates.capacity) {
+        size_t bytes = (size_t)nodes * GRAPH_MAX_HOPS * sizeof(float);
+        float *balls = malloc(bytes);
+        ready = balls != NULL;
+        if (ready) {
+            if (estimates.balls != NULL) {
+                metrics_freed((size_t)estimates.capacity * GRAPH_MAX_HOPS *
+                    sizeof(float), 1);
+                free(estimates.balls);
+            }
+            metrics_allocated(bytes, 1);
+            estimates.balls = balls;
+            estimates.capacity = nodes;
+        }
+    }
+    if (ready) {
+        memcpy(estimates.balls, analysis.graph.balls,
+            (size_t)nodes * GRAPH_MAX_HOPS * sizeof(float));
+        estimates.epoch = epoch;
+        estimates.resets = resets;
+        estimates.nodes = nodes;
+    }
+    estimates.failure = ready ? AMICI_OK :
+        id == MAX_SNAPSHOTS ? AMICI_EBUSY : AMICI_ENOMEM;
+    estimates.refreshing = false;
+    pthread_cond_broadcast(&estimates.done);
+    pthread_mutex_unlock(&estimates.lock);
+    pthread_mutex_unlock(&analysis.lock);
+    if (id != MAX_SNAPSHOTS) {
+        end_snapshot(id);
+    }
+    return NULL;
+}
+
+/// Start a refresh of the estimates. The caller holds the estimates lock,
+/// and no refresh is under way.
+///
+/// @return false if no thread could be started for it
+bool start_refresh(void) {
+    if (estimates.started) {
+        pthread_join(estimates.refresher, NULL);
+        estimates.started = false;
+    }
+    estimates.refreshing = pthread_create(&estimates.refresher, NULL,
+        refresh_estimates, NULL) == 0;
+    estimates.started = estimates.refreshing;
+    return estimates.refreshing;
+}
+
+/// Wait for a refresh of the estimates under way to end, so that it holds
+/// no snapshot.
+void await_refresh(void) {
+    pthread_mutex_lock(&estimates.lock);
+    while (estimates.refreshing) {
+        pthread_cond_wait(&estimates.done, &estimates.lock);
+    }
+    if (estimates.started) {
+        pthread_join(estimates.refresher, NULL);
+        estimates.started = false;
+    }
+    pthread_mutex_unlock(&estimates.lock);
+}
+
+/// Estimate how many users are within a number of hops of a user. HyperANF
+/// estimates the count for every user and number of hops at once, in
+/// parallel, and reach answers from the last estimates made: if the
+/// network has changed since, they are refreshed in the background, and
+/// the answer says which epoch it is for. Only when the user is newer than
+/// the estimates, or there are none, does reach wait for the refresh.
+/// Within one hop the count is exact.
+///
+/// @param out stream receiving the estimate
+/// @param err stream receiving error messages
+/// @param handle unique identifier of user
+/// @param hops from 1 to GRAPH_MAX_HOPS
+/// @return AMICI_OK, AMICI_EUNKNOWN if the handle is not known,
+///    AMICI_EBUSY if every snapshot is open, or AMICI_ENOMEM if there is no
+///    memory
+status_t reach(FILE *out, FILE *err, const char *handle, int hops) {
+    uint64_t epoch;
+    int id = take_snapshot(true, &epoch);
+    if (id == MAX_SNAPSHOTS) {
+        fprintf(err, "error: all %d snapshots are open\n", MAX_SNAPSHOTS);
+        return AMICI_EBUSY;
+    }
+    pthread_rwlock_t *lock = &shards[shard_index(handle)].lock;
+    pthread_rwlock_rdlock(lock);
+    person_t *person = find_person(handle);
+    pthread_rwlock_unlock(lock);
+    if (person == NULL || person->born > epoch) {
+        end_snapshot(id);
+        fprintf(err, "error: '%s' is not a known handle\n", handle);
+        return AMICI_EUNKNOWN;
+    }
+    
+    double friends = count_friends(friends_at(person, epoch));
+    double within = friends;
+    uint64_t as_of = epoch;
+    bool ready = hops == 1;
+    status_t failure = AMICI_ENOMEM;
+    uint64_t resets = atomic_load(&network_resets);
+    pthread_mutex_lock(&estimates.lock);
+    for (bool waited = false; !ready; waited = true) {
+        bool stale = estimates.nodes == 0 || estimates.resets != resets ||
+            estimates.epoch < epoch;
+        if (stale && !estimates.refreshing && waited &&
+            estimates.failure != AMICI_OK) {
+            failure = estimates.failure;
+            break;
+        }
+        if (stale && !estimates.refreshing && !start_refresh()) {
+            break;
+        }
+        ready = !stale || (estimates.nodes > 0 && 
+            estimates.resets == resets && person->born <= estimates.epoch);
+        if (ready) {
+            // the ball counts the user too; it is never less than the
+            // friends the user has now
+            as_of = estimates.epoch < epoch ? estimates.epoch : epoch;
+            within = estimates.balls[(size_t)person->number * 
+                GRAPH_MAX_HOPS + hops - 1] - 1;
+            within = within < friends ? friends : within;
+        }
+        else {
+            pthread_cond_wait(&estimates.done, &estimates.lock);
+        }
+    }
+    pthread_mutex_unlock(&estimates.lock);
+    end_snapshot(id);
+    if (!ready && failure == AMICI_EBUSY) {
+        fprintf(err, "error: all %d snapshots are open\n", MAX_SNAPSHOTS);
+        return AMICI_EBUSY;
+    }
+    if (!ready) {
+        fprintf(err, "error: out of memory for reach\n");
+        return AMICI_ENOMEM;
+    }
+    long count = (long)(within + 0.5);
+    fprintf(out, "%s%ld %s within %d hop%s of ", hops == 1 ? "" : "about ",
+        count, count == 1 ? (as_of < epoch ? "user was" : "user is") :
+        (as_of < epoch ? "users were" : "users are"), hops,
+        hops == 1 ? "" : "s");
+    print_user(out, person);
+    if (as_of < epoch) {
+        fprintf(out, " at epoch %lu", (unsigned long)as_of);
+    }
+    fprintf(out, "\n");
+    return AMICI_OK;
+}
+
+/// Report the average distance between users, and the diameter of the
+/// network, by breadth-first search from a sample of users, or from every
+/// user if there are no more than the sample. The sample is the same for
+/// the same network, so repeated reports agree.
+///
+/// @param out stream receiving the report
+/// @param err stream receiving error messages
+/// @param samples number of users to search from
+/// @return AMICI_OK, AMICI_EBUSY if every snapshot is open, or
+///    AMICI_ENOMEM if there is no memory
+status_t distances(FILE *out, FILE *err, uint32_t samples) {
+    uint64_t epoch;
+    int id = take_snapshot(true, &epoch);
+    if (id == MAX_SNAPSHOTS) {
+        fprintf(err, "error: all %d snapshots are open\n", MAX_SNAPSHOTS);
+        return AMICI_EBUSY;
+    }
+    distances_t found;
+    uint32_t users = 0;
+    uint32_t *sources = NULL;
+    pthread_mutex_lock(&analysis.lock);
+    bool ready = copy_network(epoch);
+    memset(&found, 0, sizeof(distances_t));
+    if (ready) {
+        users = analysis.users;
+        samples = samples < users ? samples : users;
+    }
+    if (ready && users > 0) {
+        sources = malloc(users * sizeof(uint32_t));
+        ready = sources != NULL;
+    }
+    if (ready && users > 0) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < analysis.graph.nodes; i++) {
+            if (analysis.people[i] != NULL) {
+                sources[n++] = i;
+            }
+        }
+        // the first samples of a shuffle from a fixed seed
+        uint64_t seed = 0x2545F4914F6CDD1Dull;
+        for (uint32_t i = 0; i < samples; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            uint32_t j = i + seed % (users - i);
+            uint32_t source = sources[j];
+            sources[j] = sources[i];
+            sources[i] = source;
+        }
+        ready = graph_distances(&analysis.graph, sources, samples, &found);
+    }
+    pthread_mutex_unlock(&analysis.lock);
+    end_snapshot(id);
+    free(sources);
+    if (!ready) {
+        fprintf(err, "error: out of memory for distances\n");
+        return AMICI_ENOMEM;
+    }
+    
+    if (samples == users) {
+        fprintf(out, "Distances between all %u user%s: ", users,
+            users == 1 ? "" : "s");
+    }
+    else {
+        fprintf(out, "Distances from %u of %u users: ", samples, users);
+    }
+    if (found.pairs == 0) {
+        fprintf(out, "no users are connected\n");
+        return AMICI_OK;
+    }
+    fprintf(out, "average %.2f hops over %llu connected pairs, diameter %s%u\n",
+        (double)found.total / found.pairs, (unsigned long long)found.pairs,
+        samples == users ? "" : "at least ", found.longest);
+    return AMICI_OK;
+}
+
+/// helper function used by Table t that will delete the given user and free all
+/// of its data, except for the person record and its strings, which are freed
+/// with the shard's arenas
+/// 
+/// @param key in the table represented by handle
+/// @param value is the person_t that is associated with the given key
+void delete_1_ptr_str(void *key, void *value) {
+    person_t *person;
+    person = (person_t *) value;
+    (void)key;
+    adjacency_t *friends = atomic_load(&person->friends);
+    while (friends != NULL) {
+        adjacency_t *older = friends->older;
+        free_friends(friends);
+        friends = older;
+    }
+}
+
+/// creates a new hash table for each shard that the users will be stored in
+void init_table(void) {
+    for (int i = 0; i < shard_count; i++) {
+        shards[i].t = ht_create(str_hash, str_equals, str_long_print, 
+            delete_1_ptr_str);
+        shards[i].people = 0;
+        shards[i].user_bytes = 0;
+        shards[i].sample_state = 0x9E3779B97F4A7C15ULL * (i + 1);
+        shards[i].friendships = 0;
+        reset_filters(&shards[i], 0);
+        names_init(&shards[i].names, name_of);
+        atomic_init(&shards[i].names_built, false);
+        pthread_mutex_init(&shards[i].names_lock, NULL);
+        pthread_rwlock_init(&shards[i].lock, NULL);
+    }
+    atomic_store(&all_people, NULL);
+}
+
+/// deletes the current tables. Also goes through each user in the tables and 
 /// frees the data associated with them using the function delete_1_ptr_str.
 void delete_table(void) {
-    ht_destroy(t);
-    people = 0;
-    friendships = 0;
+    for (int i = 0; i < shard_count; i++) {
+        ht_destroy(shards[i].t);
+        arena_release(&shards[i].people_arena);
+        arena_release(&shards[i].string_pool);
+        bloom_free(&shards[i].handles);
+        bloom_free(&shards[i].edges);
+        names_free(&shards[i].names);
+        atomic_store(&shards[i].names_built, false);
+        shards[i].people = 0;
+        shards[i].user_bytes = 0;
+        shards[i].friendships = 0;
+    }
+    atomic_store(&all_people, NULL);
+}
+
+/// Make room in a shard's arena for the records of users about to be added,
+/// so they are allocated together. The caller holds the shard exclusively.
+///
+/// @param shard the shard
+/// @param count number of users
+void reserve_people(shard_t *shard, size_t count) {
+    // if this fails, each add finds out for itself
+    arena_reserve(&shard->people_arena, count, sizeof(person_t));
 }
 
 /// Delete the current collection of people and friendships in the network, 
-/// returning it to an empty state.
-void init() {
+/// returning it to an empty state. The caller holds every shard exclusively.
+/// Open snapshots still use the people, so
+/// the network is only re-initialized once they are all released; a
+/// refresh of reach's estimates, which holds one, is waited for first.
+/// When the number of users to come is known, room for them is reserved.
+///
+/// @param out stream receiving the confirmation
+/// @param err stream receiving error messages
+/// @param expected number of users expected, or 0 if not known
+/// @return AMICI_OK, or AMICI_EBUSY if a snapshot is open
+status_t init(FILE *out, FILE *err, size_t expected) {
+    await_refresh();
+    if (oldest_snapshot() != UINT64_MAX) {
+        fprintf(err, "error: release all snapshots before init\n");
+        return AMICI_EBUSY;
+    }
     delete_table();
-    init_table();
-    printf("system re-initialized");
+    for (int i = 0; i < shard_count; i++) {
+        shards[i].t = ht_create(str_hash, str_equals, str_long_print, 
+            delete_1_ptr_str);
+    }
+    diag_reset_hot_keys();
+    cdc_record(CDC_RESET, 0, NULL);
+    atomic_store(&people_added, 0);
+    atomic_fetch_add(&network_resets, 1);
+    // handles spread evenly over the shards, give or take an eighth
+    size_t per_shard = expected / shard_count;
+    per_shard += expected > 0 ? per_shard / 8 + 1 : 0;
+    for (int i = 0; i < shard_count; i++) {
+        reset_filters(&shards[i], per_shard);
+        if (per_shard > 0) {
+            reserve_people(&shards[i], per_shard);
+        }
+    }
+    fprintf(out, "system re-initialized");
+    return AMICI_OK;
 }
 
 /// Delete the current collection of people and friendships in the network, 
 /// and exit from the program.
-void quit() {
+void quit(void) {
+    await_refresh();
     delete_table();
+    graph_free(&analysis.graph);
+    if (analysis.people != NULL) {
+        metrics_freed(analysis.people_capacity * sizeof(person_t *), 1);
+        free(analysis.people);
+        analysis.people = NULL;
+        analysis.people_capacity = 0;
+    }
+    analysis.copied = false;
+    if (estimates.balls != NULL) {
+        metrics_freed((size_t)estimates.capacity * GRAPH_MAX_HOPS *
+            sizeof(float), 1);
+        free(estimates.balls);
+        estimates.balls = NULL;
+        estimates.capacity = 0;
+        estimates.nodes = 0;
+    }
 }
 
-/// prints out the contents of the current table
+/// prints out the contents of the current tables
 void print_table() {
-    ht_dump(t, true);
+    for (int i = 0; i < shard_count; i++) {
+        ht_dump(shards[i].t, true);
+    }
 }
 
-int main(void) {
+/// Report the layout of every shard's table, the memory held by the
+/// tables and the users, and the handles looked up most, as one line of
+/// JSON. Each shard is locked shared only while its users are read and
+/// their handles hashed, so the network is never stopped as a whole. The
+/// slots of a table are taken to hold a key and a value pointer each.
+///
+/// The byte counts are kept as users and friends change, and the layout is
+/// modeled from each shard's sample of at most DIAG_SAMPLE users, so a
+/// report costs the same however big the network grows.
+///
+/// @param out stream receiving the report
+/// @param err stream receiving error messages
+/// @return AMICI_OK, or AMICI_ENOMEM if there is no memory for the report
+status_t diagnose(FILE *out, FILE *err) {
+    table_diag_t shard_diag[MAX_SHARDS];
+    table_diag_t total;
+    size_t user_bytes = 0;
+    size_t friend_bytes = atomic_load_explicit(&friend_list_bytes,
+        memory_order_relaxed);
+    memset(&total, 0, sizeof(total));
     
-    char in[BUFFER_SIZE];
+    size_t hashes[DIAG_SAMPLE];
+    for (int i = 0; i < shard_count; i++) {
+        pthread_rwlock_rdlock(&shards[i].lock);
+        size_t people = shards[i].people;
+        size_t sampled = people < DIAG_SAMPLE ? people : DIAG_SAMPLE;
+        for (size_t p = 0; p < sampled; p++) {
+            hashes[p] = str_hash(shards[i].sample[p]->handle);
+        }
+        user_bytes += shards[i].user_bytes;
+        pthread_rwlock_unlock(&shards[i].lock);
+        if (!diag_table(hashes, sampled, people, &shard_diag[i])) {
+            fprintf(err, "error: out of memory for diagnostics\n");
+            return AMICI_ENOMEM;
+        }
+        diag_add(&total, &shard_diag[i]);
+    }
+    
+    fprintf(out, "{\"shards\": %d, \"table\": {", shard_count);
+    diag_write_json(out, &total);
+    fprintf(out, "}, \"memory\": {\"slot_bytes\": %zu, "
+        "\"user_bytes\": %zu, \"friend_list_bytes\": %zu}, ",
+        total.capacity * 2 * sizeof(void *), user_bytes, friend_bytes);
+    
+    hot_key_t hot[HOT_KEYS];
+    int hot_count = diag_hot_keys(hot);
+    fprintf(out, "\"hot_keys\": {\"sampled\": \"1/%d\", \"keys\": [", 
+        HOT_KEY_SAMPLE);
+    for (int i = 0; i < hot_count; i++) {
+        fprintf(out, "%s{\"key\": ", i ? ", " : "");
+        json_string(out, hot[i].key);
+        fprintf(out, ", \"count\": %zu, \"error\": %zu}", hot[i].count, 
+            hot[i].error);
+    }
+    fprintf(out, "]}, \"per_shard\": [");
+    for (int i = 0; i < shard_count; i++) {
+        fprintf(out, "%s{", i ? ", " : "");
+        diag_write_json(out, &shard_diag[i]);
+        fprintf(out, "}");
+    }
+    fprintf(out, "]}\n");
+    return AMICI_OK;
+}
+
+
+/// Most words of a command line that are kept. Longer lines are still
+/// counted, so that they get their command's usage error.
+#define MAX_ARGS 8
+
+/// A command line split into words.
+typedef struct command_s {
+    char *cmd[MAX_ARGS];        ///< the first words of the line
+    int numArgs;                ///< number of words on the line
+} command_t;
+
+/// Split a command line into its words. The line is modified.
+///
+/// @param line the command line, as read by fgets
+/// @param command receives the words
+void parse_command(char *line, command_t *command) {
     const char *delim = " \n";
     char *token;
+    char *save;
     
-    init_table();
-    
-    do {
-        printf("amici> ");
-        if(fgets(in, BUFFER_SIZE, stdin) == NULL) {
+    command->numArgs = 0;
+    token = strtok_r(line, delim, &save);
+    while (token != NULL) {
+        if (command->numArgs < MAX_ARGS) {
+            command->cmd[command->numArgs] = token;
+        }
+        command->numArgs++;
+        token = strtok_r(NULL, delim, &save);
+    }
+}
+
+/// One user read by load, waiting to be added.
+typedef struct load_entry_s {
+    char *firstName;            ///< first name of the user
+    char *lastName;             ///< last name of the user
+    char *handle;               ///< handle of the user
+    int shard;                  ///< index of the shard the user goes to
+    size_t number;              ///< index of the user in the file
+} load_entry_t;
+
+/// Order users to load by shard, then by their place in the file, for
+/// qsort.
+int compare_load(const void *a, const void *b) {
+    const load_entry_t *x = a;
+    const load_entry_t *y = b;
+    if (x->shard != y->shard) {
+        return x->shard - y->shard;
+    }
+    return (x->number > y->number) - (x->number < y->number);
+}
+
+/// Read a whole file into a C-string.
+///
+/// @param path the file
+/// @return the contents, to be freed by the caller, or NULL if the file
+///    cannot be read, whole, or there is no memory for it
+char *read_file(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return NULL;
+    }
+    char *text = NULL;
+    size_t length = 0;
+    size_t capacity = BUFFER_SIZE;
+    while (true) {
+        char *more = realloc(text, capacity + 1);
+        if (more == NULL) {
+            break;
+        }
+        text = more;
+        length += fread(text + length, 1, capacity - length, in);
+        if (ferror(in)) {
             break;
         }
-        if (!strcmp(in, "\n")) {
+        if (length < capacity) {
+            text[length] = '\0';
+            fclose(in);
+            return text;
+        }
+        capacity *= 2;
+    }
+    free(text);
+    fclose(in);
+    return NULL;
+}
+
+/// Add every user of a file of add commands, as written for amici's input.
+/// The file is read and sorted by shard before any shard is locked: users
+/// are added a shard at a time, under one hold of its lock, with room for
+/// all of their records reserved up front. Other lines are skipped. A
+/// taken handle is reported as add reports it, and the first user in the
+/// file with a handle is the one added.
+///
+/// @param out stream receiving the number of users added
+/// @param err stream receiving error messages
+/// @param path the file
+/// @return AMICI_OK, AMICI_EIO if the file cannot be read, or
+///    AMICI_ENOMEM if there is no memory for it
+status_t load(FILE *out, FILE *err, const char *path) {
+    char *text = read_file(path);
+    if (text == NULL) {
+        fprintf(err, "error: cannot read '%s'\n", path);
+        return AMICI_EIO;
+    }
+    load_entry_t *entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t skipped = 0;
+    char *save;
+    for (char *line = strtok_r(text, "\n", &save); line != NULL;
+        line = strtok_r(NULL, "\n", &save)) {
+        command_t command;
+        parse_command(line, &command);
+        if (command.numArgs != 4 || strcmp(command.cmd[0], "add")) {
+            skipped += command.numArgs > 0;
             continue;
         }
-        
-        //parses input into a char array of strings
-        char *cmd[BUFFER_SIZE] = {NULL};
-        int numArgs = 0;
-        token = strtok(in, delim);
-        while (token != NULL) {
-            cmd[numArgs] = token;
-            numArgs++;
-            token = strtok(NULL, delim);
-        }
-
-        // goes through and performs the given command
-        //add
-        if (!strcmp(cmd[0], "add")) {
-            if (numArgs == 4) {
-                add(cmd[1], cmd[2], cmd[3]);
-            }
-            else {
-                fprintf(stderr, 
-                    "error: add command usage: first-name last-name handle\n");
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            load_entry_t *more = realloc(entries, 
+                capacity * sizeof(load_entry_t));
+            if (more == NULL) {
+                free(entries);
+                free(text);
+                fprintf(err, "error: out of memory loading '%s'\n", path);
+                return AMICI_ENOMEM;
             }
+            entries = more;
         }
-        //friend
-        else if (!strcmp("friend", cmd[0])) {
-            if (numArgs == 3) {
-                add_friend(cmd[1], cmd[2]);
-            }
-            else {
-                fprintf(stderr, 
-                    "error: friend command usage: handle1 handle2\n");
-            }
+        load_entry_t *entry = &entries[count];
+        entry->firstName = command.cmd[1];
+        entry->lastName = command.cmd[2];
+        entry->handle = command.cmd[3];
+        entry->shard = shard_index(entry->handle);
+        entry->number = count++;
+    }
+    qsort(entries, count, sizeof(load_entry_t), compare_load);
+    
+    size_t added = 0;
+    size_t next = 0;
+    while (next < count) {
+        shard_t *shard = &shards[entries[next].shard];
+        size_t end = next;
+        while (end < count && entries[end].shard == entries[next].shard) {
+            end++;
         }
-        //unfriend
-        else if (!strcmp("unfriend", cmd[0])) {
-            if (numArgs == 3) {
-                unfriend(cmd[1], cmd[2]);
-            }
-            else {
-                fprintf(stderr, 
-                    "error: unfriend command usage: handle1 handle2\n");
-            }
+        pthread_rwlock_wrlock(&shard->lock);
+        reserve_people(shard, end - next);
+        for (; next < end; next++) {
+            load_entry_t *entry = &entries[next];
+            added += add(err, entry->firstName, entry->lastName, 
+                entry->handle) == AMICI_OK;
         }
-        //print
-        else if (!strcmp("print", cmd[0])) {
-            if (numArgs == 2) {
-                print(cmd[1]);
-            }
-            else {
-                fprintf(stderr, 
-                    "error: print command usage: handle\n");
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    free(entries);
+    free(text);
+    fprintf(out, "loaded %zu users from '%s'", added, path);
+    if (skipped > 0) {
+        fprintf(out, ", skipping %zu other line%s", skipped, 
+            skipped == 1 ? "" : "s");
+    }
+    fprintf(out, "\n");
+    return AMICI_OK;
+}
+
+/// Report whether the command changes the network, and so must hold the
+/// locks of its shards exclusively.
+///
+/// @param command the parsed command
+bool is_mutation(const command_t *command) {
+    if (command->numArgs == 0) {
+        return false;
+    }
+    const char *name = command->cmd[0];
+    return !strcmp(name, "add") || !strcmp(name, "friend") ||
+        !strcmp(name, "unfriend") || !strcmp(name, "init");
+}
+
+/// Report whether the command runs without the caller holding any shard
+/// lock: it needs no access to the network, or it is a snapshot command
+/// that takes locks only for as long as it must.
+///
+/// @param command the parsed command
+bool is_lock_free(const command_t *command) {
+    if (command->numArgs == 0) {
+        return true;
+    }
+    const char *name = command->cmd[0];
+    return !strcmp(name, "quit") || !strcmp(name, "snapshot") ||
+        !strcmp(name, "release") || !strcmp(name, "metrics") ||
+        !strcmp(name, "diag") || !strcmp(name, "load") ||
+        !strcmp(name, "export") || !strcmp(name, "reach") ||
+        !strcmp(name, "distances");
+}
+
+/// Find the file export or load is to use. Unless files are confined the
+/// name is the path. Confined, the name must be a relative path none of
+/// whose parts is "..", and is taken inside export_dir.
+///
+/// @param err stream receiving error messages
+/// @param name the file the command names
+/// @param path receives the path of the file
+/// @param size bytes path has room for
+/// @return true if the file may be used
+bool file_path(FILE *err, const char *name, char *path, size_t size) {
+    if (!files_confined) {
+        snprintf(path, size, "%s", name);
+        return true;
+    }
+    if (export_dir == NULL) {
+        fprintf(err, "error: files need --export-dir in server mode\n");
+        return false;
+    }
+    bool escapes = name[0] == '/';
+    for (const char *part = name; !escapes && part != NULL; ) {
+        const char *slash = strchr(part, '/');
+        size_t length = slash != NULL ? (size_t)(slash - part) : strlen(part);
+        escapes = length == 2 && part[0] == '.' && part[1] == '.';
+        part = slash != NULL ? slash + 1 : NULL;
+    }
+    if (escapes) {
+        fprintf(err, "error: '%s' is not a path inside the export "
+            "directory\n", name);
+        return false;
+    }
+    if ((size_t)snprintf(path, size, "%s/%s", export_dir, name) >= size) {
+        fprintf(err, "error: '%s' is too long a path\n", name);
+        return false;
+    }
+    return true;
+}
+
+/// Perform a parsed command. Unless the command is lock free, the caller
+/// holds the locks of its shards, exclusively if it is a mutation.
+///
+/// @param command the parsed command
+/// @param out stream receiving the command's output
+/// @param err stream receiving error messages
+/// @return the command's status
+status_t run_command(command_t *command, FILE *out, FILE *err) {
+    char **cmd = command->cmd;
+    int numArgs = command->numArgs;
+    
+    if (numArgs == 0) {
+        return AMICI_OK;
+    }
+    
+    // goes through and performs the given command
+    //add
+    if (!strcmp(cmd[0], "add")) {
+        if (numArgs == 4) {
+            return add(err, cmd[1], cmd[2], cmd[3]);
+        }
+        fprintf(err, 
+            "error: add command usage: first-name last-name handle\n");
+    }
+    //friend
+    else if (!strcmp("friend", cmd[0])) {
+        if (numArgs == 3) {
+            return add_friend(out, err, cmd[1], cmd[2]);
+        }
+        fprintf(err, 
+            "error: friend command usage: handle1 handle2\n");
+    }
+    //unfriend
+    else if (!strcmp("unfriend", cmd[0])) {
+        if (numArgs == 3) {
+            return unfriend(out, err, cmd[1], cmd[2]);
+        }
+        fprintf(err, 
+            "error: unfriend command usage: handle1 handle2\n");
+    }
+    //print
+    else if (!strcmp("print", cmd[0])) {
+        if (numArgs == 2) {
+            return print(out, err, cmd[1]);
+        }
+        fprintf(err, 
+            "error: print command usage: handle\n");
+    }
+    //size
+    else if (!strcmp("size", cmd[0])) {
+        if (numArgs == 2) {
+            return size(out, err, cmd[1]);
+        }
+        fprintf(err, 
+            "error: size command usage: handle\n");
+    }
+    //find
+    else if (!strcmp("find", cmd[0])) {
+        if (numArgs == 2 || numArgs == 3) {
+            return find_names(out, err, cmd[1], true, 
+                numArgs == 3 ? cmd[2] : NULL);
+        }
+        fprintf(err, 
+            "error: find command usage: last-name-prefix [after-handle]\n");
+    }
+    //lastname
+    else if (!strcmp("lastname", cmd[0])) {
+        if (numArgs == 2 || numArgs == 3) {
+            return find_names(out, err, cmd[1], false, 
+                numArgs == 3 ? cmd[2] : NULL);
+        }
+        fprintf(err, 
+            "error: lastname command usage: last-name [after-handle]\n");
+    }
+    //stats
+    else if (!strcmp("stats", cmd[0])) {
+        if (numArgs == 1) {
+            stats(out);
+            return AMICI_OK;
+        }
+        fprintf(err, 
+            "error: stats command usage: No arguments must be given\n");
+    }
+    //init
+    else if (!strcmp("init", cmd[0])) {
+        char *end = NULL;
+        long expected = numArgs == 2 ? strtol(cmd[1], &end, 10) : 0;
+        if (numArgs == 1 || (numArgs == 2 && *end == '\0' && expected > 0)) {
+            return init(out, err, expected);
+        }
+        fprintf(err, 
+            "error: init command usage: [expected-users]\n");
+    }
+    //export
+    else if (!strcmp("export", cmd[0])) {
+        if (numArgs == 2 || numArgs == 3) {
+            char path[2 * BUFFER_SIZE];
+            if (!file_path(err, cmd[1], path, sizeof(path))) {
+                return AMICI_EUSAGE;
             }
+            return export_network(out, err, path, 
+                numArgs == 3 ? cmd[2] : NULL);
+        }
+        fprintf(err, 
+            "error: export command usage: file [csv | edgelist | binary]\n");
+    }
+    //reach
+    else if (!strcmp("reach", cmd[0])) {
+        char *end = NULL;
+        long hops = numArgs == 3 ? strtol(cmd[2], &end, 10) : 0;
+        if (numArgs == 3 && *end == '\0' && hops >= 1 && 
+            hops <= GRAPH_MAX_HOPS) {
+            return reach(out, err, cmd[1], hops);
         }
-        //size
-        else if (!strcmp("size", cmd[0])) {
-            if (numArgs == 2) {
-                size(cmd[1]);
+        fprintf(err, 
+            "error: reach command usage: handle hops (1 to %d)\n", 
+            GRAPH_MAX_HOPS);
+    }
+    //distances
+    else if (!strcmp("distances", cmd[0])) {
+        char *end = NULL;
+        long samples = numArgs == 2 ? strtol(cmd[1], &end, 10) : 
+            DEFAULT_SAMPLES;
+        if (numArgs == 1 || (numArgs == 2 && *end == '\0' && samples >= 1 &&
+            samples <= MAX_SAMPLES)) {
+            return distances(out, err, samples);
+        }
+        fprintf(err, 
+            "error: distances command usage: [samples (1 to %d)]\n", 
+            MAX_SAMPLES);
+    }
+    //load
+    else if (!strcmp("load", cmd[0])) {
+        if (numArgs == 2) {
+            char path[2 * BUFFER_SIZE];
+            if (!file_path(err, cmd[1], path, sizeof(path))) {
+                return AMICI_EUSAGE;
             }
-            else {
-                fprintf(stderr, 
-                    "error: size command usage: handle\n");
+            return load(out, err, path);
+        }
+        fprintf(err, 
+            "error: load command usage: file\n");
+    }
+    //snapshot
+    else if (!strcmp("snapshot", cmd[0])) {
+        if (numArgs == 1) {
+            return open_snapshot(out, err);
+        }
+        return query_snapshot(out, err, &cmd[1], numArgs - 1);
+    }
+    //release
+    else if (!strcmp("release", cmd[0])) {
+        if (numArgs == 2) {
+            return release_snapshot(out, err, cmd[1]);
+        }
+        fprintf(err, 
+            "error: release command usage: snapshot-id\n");
+    }
+    //metrics
+    else if (!strcmp("metrics", cmd[0])) {
+        if (numArgs == 1) {
+            metrics_write(out);
+            return AMICI_OK;
+        }
+        fprintf(err, 
+            "error: metrics command usage: No arguments must be given\n");
+    }
+    //diag
+    else if (!strcmp("diag", cmd[0])) {
+        if (numArgs == 1) {
+            return diagnose(out, err);
+        }
+        fprintf(err, 
+            "error: diag command usage: No arguments must be given\n");
+    }
+    //batch; a well formed batch never reaches here
+    else if (!strcmp("batch", cmd[0])) {
+        fprintf(err, 
+            "error: batch command usage: count (1 to %d)\n", MAX_BATCH);
+    }
+    //quit is left to the caller, which owns the network's lifetime
+    else if (!strcmp("quit", cmd[0])) {
+        if (numArgs == 1) {
+            return AMICI_QUIT;
+        }
+        fprintf(err, 
+            "error: quit command usage: No arguments must be given\n");
+    }
+    //anything else is ignored
+    else {
+        return AMICI_ECOMMAND;
+    }
+    return AMICI_EUSAGE;
+}
+
+/// Make room for the users a stretch of commands adds, in each shard they
+/// go to, before any of them runs. The caller holds those shards
+/// exclusively.
+///
+/// @param command the commands about to run
+/// @param count number of commands
+void reserve_adds(command_t *command, int count) {
+    size_t adds[MAX_SHARDS] = { 0 };
+    for (int i = 0; i < count; i++) {
+        if (command[i].numArgs == 4 && !strcmp(command[i].cmd[0], "add")) {
+            adds[shard_index(command[i].cmd[3])]++;
+        }
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (adds[i] > 1) {
+            reserve_people(&shards[i], adds[i]);
+        }
+    }
+}
+
+/// Return the set of shards a command touches, whose locks it must hold.
+///
+/// @param command the parsed command
+shard_set_t command_shards(const command_t *command) {
+    char *const *cmd = command->cmd;
+    int numArgs = command->numArgs;
+    if (numArgs == 0) {
+        return 0;
+    }
+    if ((numArgs == 1 && !strcmp(cmd[0], "stats")) ||
+        (numArgs <= 2 && !strcmp(cmd[0], "init"))) {
+        return ALL_SHARDS;
+    }
+    if ((numArgs == 2 || numArgs == 3) &&
+        (!strcmp(cmd[0], "find") || !strcmp(cmd[0], "lastname"))) {
+        return ALL_SHARDS;
+    }
+    if (numArgs == 4 && !strcmp(cmd[0], "add")) {
+        return SHARD_BIT(shard_index(cmd[3]));
+    }
+    if (numArgs == 3 &&
+        (!strcmp(cmd[0], "friend") || !strcmp(cmd[0], "unfriend"))) {
+        return SHARD_BIT(shard_index(cmd[1])) | SHARD_BIT(shard_index(cmd[2]));
+    }
+    if (numArgs == 2 &&
+        (!strcmp(cmd[0], "print") || !strcmp(cmd[0], "size"))) {
+        return SHARD_BIT(shard_index(cmd[1]));
+    }
+    return 0;
+}
+
+/// Return the kind of a parsed command, for its metrics.
+///
+/// @param command the parsed command
+metric_command_t command_kind(const command_t *command) {
+    return metrics_command(command->cmd[0]);
+}
+
+status_t execute_command(char *line, FILE *out, FILE *err) {
+    command_t command;
+    status_t status;
+    parse_command(line, &command);
+    if (command.numArgs == 0) {
+        return AMICI_OK;
+    }
+    metric_command_t kind = command_kind(&command);
+    uint64_t start = metrics_start(kind);
+    if (is_lock_free(&command)) {
+        status = run_command(&command, out, err);
+    }
+    else {
+        shard_set_t set = command_shards(&command);
+        lock_shards(set, is_mutation(&command));
+        status = run_command(&command, out, err);
+        unlock_shards(set);
+    }
+    metrics_record(kind, status, start);
+    return status;
+}
+
+status_t execute_batch(char **lines, int count, FILE *out) {
+    if (count < 1) {
+        return AMICI_EUSAGE;
+    }
+    uint64_t batch_start = metrics_start(METRIC_BATCH);
+    // the commands, where each one's output starts, and their statuses, in
+    // one block off the stack; a batch may hold MAX_BATCH commands
+    command_t *command = malloc(count * sizeof(command_t) +
+        (count + 1) * sizeof(long) + count * sizeof(status_t));
+    long *start = (long *)(command + count);
+    status_t *status = (status_t *)(start + count + 1);
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *payload = command == NULL ? NULL : open_memstream(&buf, &len);
+    if (payload == NULL) {
+        free(command);
+        fprintf(out, "error: out of memory for batch\n");
+        return AMICI_ENOMEM;
+    }
+    
+    // parse everything first, so no parsing is done with the lock held
+    for (int i = 0; i < count; i++) {
+        parse_command(lines[i], &command[i]);
+    }
+    
+    // run each stretch of mutations, and each stretch of queries, under
+    // a single acquisition of the locks of every shard the stretch touches
+    bool quitting = false;
+    int i = 0;
+    while (i < count) {
+        bool exclusive = is_mutation(&command[i]);
+        bool locked = !quitting && !is_lock_free(&command[i]);
+        shard_set_t set = locked ? command_shards(&command[i]) : 0;
+        int end = i + 1;
+        while (locked && end < count && !is_lock_free(&command[end]) &&
+            is_mutation(&command[end]) == exclusive) {
+            set |= command_shards(&command[end]);
+            end++;
+        }
+        if (locked) {
+            lock_shards(set, exclusive);
+            if (exclusive) {
+                reserve_adds(&command[i], end - i);
             }
         }
-        //stats
-        else if (!strcmp("stats", cmd[0])) {
-            if (numArgs == 1) {
-                stats();
+        for (; i < end; i++) {
+            start[i] = ftell(payload);
+            if (quitting) {
+                status[i] = AMICI_QUIT;
+            }
+            else if (command[i].numArgs == 0) {
+                status[i] = AMICI_OK;
             }
             else {
-                fprintf(stderr, 
-                    "error: stats command usage: No arguments must be given\n");
+                metric_command_t kind = command_kind(&command[i]);
+                uint64_t command_start = metrics_start(kind);
+                status[i] = run_command(&command[i], payload, payload);
+                metrics_record(kind, status[i], command_start);
+                quitting = status[i] == AMICI_QUIT;
             }
         }
-        //init
-        else if (!strcmp("init", cmd[0])) {
-            if (numArgs == 1) {
-                init();
+        if (locked) {
+            unlock_shards(set);
+        }
+    }
+    start[count] = ftell(payload);
+    fclose(payload);
+    
+    for (i = 0; i < count; i++) {
+        fprintf(out, "%d %ld\n", status[i], start[i + 1] - start[i]);
+        fwrite(buf + start[i], 1, start[i + 1] - start[i], out);
+    }
+    free(buf);
+    free(command);
+    metrics_record(METRIC_BATCH, AMICI_OK, batch_start);
+    return quitting ? AMICI_QUIT : AMICI_OK;
+}
+
+#ifndef AMICI_NO_MAIN
+
+/// Print the command line usage of amici.
+///
+/// @param prog the name the program was run as
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--shards n] [--serve socket-path "
+        "[--threads n]] [--export-dir dir]\n"
+        "    [--metrics-file path [--metrics-interval seconds]]\n"
+        "    [--cdc-file path [--cdc-size megabytes]] [--bloom]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    
+    char in[BUFFER_SIZE];
+    
+    //options: amici [--shards n] [--serve socket-path [--threads n]]
+    //    [--export-dir dir]
+    //    [--metrics-file path [--metrics-interval seconds]]
+    //    [--cdc-file path [--cdc-size megabytes]] [--bloom]
+    const char *path = NULL;
+    int threads = 0;
+    const char *metrics_path = NULL;
+    int metrics_interval = DEFAULT_METRICS_INTERVAL;
+    const char *cdc_path = NULL;
+    int cdc_size = DEFAULT_CDC_SIZE;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--shards") && i + 1 < argc) {
+            shard_count = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--metrics-file") && i + 1 < argc) {
+            metrics_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--metrics-interval") && i + 1 < argc) {
+            metrics_interval = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--cdc-file") && i + 1 < argc) {
+            cdc_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--cdc-size") && i + 1 < argc) {
+            cdc_size = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--bloom")) {
+            bloom_enabled = true;
+        }
+        else if (!strcmp(argv[i], "--export-dir") && i + 1 < argc) {
+            export_dir = argv[++i];
+        }
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (threads < 0 || shard_count < 1 || shard_count > MAX_SHARDS ||
+        (shard_count & (shard_count - 1)) != 0) {
+        usage(argv[0]);
+        fprintf(stderr, "shards must be a power of two from 1 to %d\n", 
+            MAX_SHARDS);
+        return EXIT_FAILURE;
+    }
+    if (metrics_interval < 1) {
+        usage(argv[0]);
+        fprintf(stderr, "metrics interval must be at least 1 second\n");
+        return EXIT_FAILURE;
+    }
+    if (cdc_size < 1 || cdc_size > 4095) {
+        usage(argv[0]);
+        fprintf(stderr, "cdc size must be from 1 to 4095 megabytes\n");
+        return EXIT_FAILURE;
+    }
+    
+    files_confined = path != NULL || export_dir != NULL;
+    
+    init_table();
+    if (metrics_path != NULL && 
+        !metrics_start_dump(metrics_path, metrics_interval)) {
+        fprintf(stderr, "error: cannot start the metrics dump\n");
+        quit();
+        return EXIT_FAILURE;
+    }
+    if (cdc_path != NULL && !cdc_open(cdc_path, cdc_size)) {
+        fprintf(stderr, "error: cannot create the CDC file '%s'\n", cdc_path);
+        metrics_stop_dump();
+        quit();
+        return EXIT_FAILURE;
+    }
+    
+    //server mode
+    if (path != NULL) {
+        int status = serve(path, threads);
+        metrics_stop_dump();
+        cdc_close();
+        quit();
+        return status;
+    }
+    
+    do {
+        fputs(PROMPT, stdout);
+        if(fgets(in, BUFFER_SIZE, stdin) == NULL) {
+            break;
+        }
+        int count = batch_size(in);
+        if (count > 0) {
+            //reads the batch's command lines, then answers them together;
+            //the lines and pointers to them are one block off the stack
+            char **lines = malloc(count * (sizeof(char *) + BUFFER_SIZE));
+            char (*batch)[BUFFER_SIZE] = lines == NULL ? NULL :
+                (char (*)[BUFFER_SIZE])(lines + count);
+            int read = 0;
+            while (batch != NULL && read < count &&
+                fgets(batch[read], BUFFER_SIZE, stdin) != NULL) {
+                lines[read] = batch[read];
+                read++;
             }
-            else {
-                fprintf(stderr, 
-                    "error: init command usage: No arguments must be given\n");
+            status_t status = AMICI_QUIT;
+            if (batch == NULL) {
+                fprintf(stderr, "error: out of memory for batch\n");
             }
-        }
-        //quit
-        else if (!strcmp("quit", cmd[0])) {
-            if (numArgs == 1) {
-                quit();
-                return 0;
+            else if (read == 0) {
+                fprintf(stderr, "error: batch ended before its first "
+                    "command\n");
             }
             else {
-                fprintf(stderr, 
-                    "error: quit command usage: No arguments must be given\n");
+                status = execute_batch(lines, read, stdout);
+            }
+            free(lines);
+            if (status == AMICI_QUIT || read < count) {
+                break;
             }
         }
-        
+        else if (execute_command(in, stdout, stderr) == AMICI_QUIT) {
+            break;
+        }
     }
     while (1);
     
+    metrics_stop_dump();
+    cdc_close();
     quit();
     return 0;
 }
+
+#endif // AMICI_NO_MAIN
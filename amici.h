@@ -0,0 +1,99 @@
+/// @file amici.h
+/// @brief Command interface of the amici friend network, shared by the
+///    interactive front end in amici.c and the socket server in server.c.
+///
+/// @author Ryan Nowak rcn8263
+
+#ifndef AMICI_H
+#define AMICI_H
+
+#include <stdbool.h>    // bool
+#include <stdio.h>      // FILE
+
+/// The maximum length of any single input command line is 1024 characters,
+/// including the trailing newline and NUL characters.
+#define BUFFER_SIZE 1024
+
+/// The prompt written before each command is read.
+#define PROMPT "amici> "
+
+/// The most shards the network may be partitioned into.
+#define MAX_SHARDS 64
+
+/// Number of shards used unless --shards says otherwise.
+#define DEFAULT_SHARDS 16
+
+/// The most commands one batch may hold.
+#define MAX_BATCH 4096
+
+/// The most snapshots open at once.
+#define MAX_SNAPSHOTS 64
+
+/// Most users find and lastname list at once.
+#define NAME_PAGE 20
+
+/// The status of a command. Interactive clients see only the messages;
+/// batch clients receive the status with each response.
+typedef enum {
+    AMICI_OK = 0,               ///< the command succeeded
+    AMICI_EUSAGE = 1,           ///< wrong arguments for the command
+    AMICI_ECOMMAND = 2,         ///< not a command; it is ignored
+    AMICI_EUNKNOWN = 3,         ///< a handle is not known
+    AMICI_ETAKEN = 4,           ///< the handle is already taken
+    AMICI_EFRIENDS = 5,         ///< the users are already friends
+    AMICI_ENOTFRIENDS = 6,      ///< the users are not friends
+    AMICI_QUIT = 7,             ///< quit; the caller decides what that ends
+    AMICI_EBUSY = 8,            ///< snapshots prevent it, or none are free
+    AMICI_EIO = 9,              ///< a file could not be read or written
+    AMICI_ENOMEM = 10,          ///< there was no memory for it
+} status_t;
+
+/// Filter handles and friendships through Bloom filters (--bloom). It takes
+/// effect when the network is created, by init_table or init.
+extern bool bloom_enabled;
+
+/// Create the table the users of the network are stored in.
+void init_table(void);
+
+/// Delete the current collection of people and friendships in the network,
+/// and exit from the program.
+void quit(void);
+
+/// Parse one command line and perform it against the network. Normal output
+/// is written to out and error messages to err. The line is modified by the
+/// parser. This function is safe to call from several threads at once;
+/// each command locks just the shards it touches, shared for queries and
+/// exclusively for changes.
+///
+/// @param line the command line, as read by fgets
+/// @param out stream receiving the command's output
+/// @param err stream receiving the command's error messages
+/// @return the command's status
+status_t execute_command(char *line, FILE *out, FILE *err);
+
+/// Check whether a line begins a batch. A batch is the line "batch N"
+/// followed by N command lines, and is answered by N responses in order.
+/// Each response is a header line "status length" giving the command's
+/// status_t value and the number of bytes of output that follow it; the
+/// output holds the command's normal output or its error message.
+///
+/// @param line a command line
+/// @return N if the line is a valid batch header, 0 otherwise
+int batch_size(const char *line);
+
+/// Perform a batch of command lines and write their framed responses.
+/// Consecutive mutations share one exclusive hold of the network, and
+/// consecutive queries one shared hold. A quit ends the batch: it and the
+/// commands after it are answered with AMICI_QUIT, and those after it are
+/// not run. The lines are modified by the parser.
+///
+/// @param lines the command lines of the batch
+/// @param count number of lines, from 1 to MAX_BATCH; a batch cut short
+///    before its first line is the caller's to report
+/// @param out stream receiving the framed responses
+/// @return AMICI_QUIT if the batch held a quit, AMICI_EUSAGE with nothing
+///    written if count is less than 1, AMICI_ENOMEM with only an error
+///    message written if there is no memory for it, AMICI_OK otherwise
+status_t execute_batch(char **lines, int count, FILE *out);
+
+#endif // AMICI_H
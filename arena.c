@@ -0,0 +1,93 @@
+//
+// file: arena.c
+//
+// @author Ryan Nowak rcn8263
+//
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "metrics.h"
+
+/// Alignment of every block.
+#define ARENA_ALIGN alignof(max_align_t)
+
+struct arena_chunk_s {
+    arena_chunk_t *next;                        ///< chunk taken before it
+    size_t size;                                ///< bytes of data
+    alignas(ARENA_ALIGN) char data[];           ///< the blocks
+};
+
+/// Round a size up to a multiple of the alignment.
+static size_t aligned(size_t bytes) {
+    return (bytes + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+/// Make sure the next bytes of the arena are in one chunk.
+static bool reserve_bytes(arena_t *arena, size_t bytes) {
+    if ((size_t)(arena->end - arena->next) >= bytes) {
+        return true;
+    }
+    // what is left of the newest chunk is given up
+    size_t size = bytes > ARENA_CHUNK ? bytes : ARENA_CHUNK;
+    arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + size);
+    if (chunk == NULL) {
+        return false;
+    }
+    metrics_allocated(sizeof(arena_chunk_t) + size, 1);
+    chunk->next = arena->chunks;
+    chunk->size = size;
+    arena->chunks = chunk;
+    arena->next = chunk->data;
+    arena->end = chunk->data + size;
+    return true;
+}
+
+/// Round the first free byte up to the alignment, after strings.
+static void align_next(arena_t *arena) {
+    size_t used = arena->next - (char *)arena->chunks->data;
+    arena->next = (char *)arena->chunks->data + aligned(used);
+    if (arena->next > arena->end) {
+        arena->next = arena->end;
+    }
+}
+
+bool arena_reserve(arena_t *arena, size_t count, size_t bytes) {
+    if (arena->chunks != NULL) {
+        align_next(arena);
+    }
+    return reserve_bytes(arena, count * aligned(bytes));
+}
+
+void *arena_alloc(arena_t *arena, size_t bytes) {
+    if (!arena_reserve(arena, 1, bytes)) {
+        return NULL;
+    }
+    void *block = arena->next;
+    arena->next += aligned(bytes);
+    return block;
+}
+
+char *arena_strdup(arena_t *arena, const char *s) {
+    size_t bytes = strlen(s) + 1;
+    if (!reserve_bytes(arena, bytes)) {
+        return NULL;
+    }
+    char *copy = memcpy(arena->next, s, bytes);
+    arena->next += bytes;
+    return copy;
+}
+
+void arena_release(arena_t *arena) {
+    while (arena->chunks != NULL) {
+        arena_chunk_t *next = arena->chunks->next;
+        metrics_freed(sizeof(arena_chunk_t) + arena->chunks->size, 1);
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    arena->next = NULL;
+    arena->end = NULL;
+}
@@ -0,0 +1,56 @@
+/// @file arena.h
+/// @brief Bump allocation of records and strings that live until the whole
+///    network is deleted, from large chunks that are freed all at once.
+///
+/// @author Ryan Nowak rcn8263
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>    // bool
+#include <stddef.h>     // size_t
+
+/// Bytes of a chunk, unless a larger reservation asks for more.
+#define ARENA_CHUNK (64 * 1024)
+
+typedef struct arena_chunk_s arena_chunk_t;
+
+/// An arena. A zeroed arena is empty and ready for use. It is not
+/// thread safe; each arena is guarded by its owner's lock.
+typedef struct arena_s {
+    arena_chunk_t *chunks;      ///< every chunk, newest first
+    char *next;                 ///< first free byte of the newest chunk
+    char *end;                  ///< end of the newest chunk
+} arena_t;
+
+/// Make sure the next count allocations of a size come from one chunk,
+/// taking a new chunk big enough for all of them if need be.
+///
+/// @param arena the arena
+/// @param count number of blocks about to be allocated
+/// @param bytes size of each block
+/// @return false if there is no memory for them
+bool arena_reserve(arena_t *arena, size_t count, size_t bytes);
+
+/// Allocate a block, aligned for any type, that lasts until the arena is
+/// released.
+///
+/// @param arena the arena
+/// @param bytes size of the block
+/// @return the block, or NULL if there is no memory for it
+void *arena_alloc(arena_t *arena, size_t bytes);
+
+/// Copy a C-string into the arena, packed against the strings copied before
+/// it, with no alignment.
+///
+/// @param arena the arena
+/// @param s the C-string
+/// @return the copy, or NULL if there is no memory for it
+char *arena_strdup(arena_t *arena, const char *s);
+
+/// Free every block of the arena, leaving it empty.
+///
+/// @param arena the arena
+void arena_release(arena_t *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,301 @@
+/// \file bench_table.c
+/// \brief A benchmark program for the hash table.
+/// Times ht_put, ht_get, ht_has and ht_keys for long and C-string keys at
+/// table sizes from 1K up to a chosen maximum, with lookups drawn from
+/// uniform, Zipfian and sequential key distributions and with a range of
+/// hit ratios. Results are written as a JSON array, one object per
+/// measurement, so runs can be compared for regressions.
+///
+/// Usage: bench_table [-n max-size] [-s seed] [-o file]
+///
+/// @author Ryan Nowak rcn8263
+
+#define _DEFAULT_SOURCE  // getopt
+
+#include <math.h>    // pow
+#include <stdint.h>  // uint64_t
+#include <stdio.h>   // printf, fprintf, snprintf
+#include <stdlib.h>  // malloc, free, strtoul, EXIT_SUCCESS
+#include <string.h>  // strcmp
+#include <stdbool.h> // bool
+#include <time.h>    // clock_gettime
+#include <unistd.h>  // getopt
+#include "hash.h"    // long_hash, long_equals, long_long_print, str_hash,
+                     // str_equals, str_long_print
+#include "table.h"   // ht_create, ht_destroy, ht_get, ht_has, ht_keys, ht_put
+
+/// Fewest and most lookups timed for one measurement.
+#define MIN_LOOKUPS 1000000
+#define MAX_LOOKUPS 10000000
+
+/// Room for one generated C-string key, including its NUL.
+#define STR_KEY_SIZE 24
+
+/// Skew of the Zipfian distribution, the same as YCSB's default.
+#define ZIPF_THETA 0.99
+
+/// The key distributions lookups are drawn from.
+typedef enum { UNIFORM, ZIPFIAN, SEQUENTIAL } dist_t;
+
+static const char* dist_names[] = { "uniform", "zipfian", "sequential" };
+
+/// Where results go, and whether one has been written yet.
+static FILE* out;
+static bool first_result = true;
+
+/// Keeps the compiler from discarding lookups whose results are unused.
+static volatile size_t sink;
+
+/// State of the xorshift64* generator; fixed by the seed for repeatability.
+static uint64_t rng_state;
+
+/// next_random returns the next 64-bit value of the generator.
+static uint64_t next_random( void ) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/// now_ns returns the monotonic clock in nanoseconds.
+static double now_ns( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/// Zipfian generator over [0, n) after Gray et al., as used by YCSB. Only
+/// the setup is O(n); each draw is O(1) with no tables.
+typedef struct {
+    size_t n;
+    double alpha, zetan, eta;
+} zipf_t;
+
+/// zipf_init prepares a generator for n items.
+/// @param z the generator
+/// @param n number of items
+static void zipf_init( zipf_t* z, size_t n ) {
+    double zeta2 = 1.0 + pow( 0.5, ZIPF_THETA);
+    z->n = n;
+    z->zetan = 0;
+    for (size_t i=1; i<=n; ++i) {
+        z->zetan += 1.0 / pow( (double)i, ZIPF_THETA);
+    }
+    z->alpha = 1.0 / (1.0 - ZIPF_THETA);
+    z->eta = (1.0 - pow( 2.0 / n, 1.0 - ZIPF_THETA)) / (1.0 - zeta2 / z->zetan);
+}
+
+/// zipf_next draws an item; item 0 is the most frequent.
+/// @param z the generator
+static size_t zipf_next( const zipf_t* z ) {
+    double u = (next_random() >> 11) * (1.0 / 9007199254740992.0);
+    double uz = u * z->zetan;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow( 0.5, ZIPF_THETA)) return 1;
+    size_t i = (size_t)(z->n * pow( z->eta * u - z->eta + 1.0, z->alpha));
+    return i < z->n ? i : z->n - 1;
+}
+
+/// make_lookups fills order with count indexes into the n inserted keys,
+/// drawn from the distribution.
+/// @param order receives the indexes
+/// @param count number of indexes
+/// @param n number of keys
+/// @param dist the distribution
+static void make_lookups( size_t* order, size_t count, size_t n, dist_t dist ) {
+    zipf_t z;
+    if (dist == ZIPFIAN) zipf_init( &z, n);
+    for (size_t i=0; i<count; ++i) {
+        switch (dist) {
+        case UNIFORM:    order[i] = next_random() % n; break;
+        case ZIPFIAN:    order[i] = zipf_next( &z); break;
+        case SEQUENTIAL: order[i] = i % n; break;
+        }
+    }
+}
+
+/// report writes one measurement as a JSON object.
+/// @param key the key type, "long" or "string"
+/// @param size number of entries in the table
+/// @param op the operation timed
+/// @param dist the lookup distribution, or NULL when there is none
+/// @param hit_ratio fraction of lookups for keys in the table
+/// @param ops number of operations timed
+/// @param ns total nanoseconds they took
+static void report( const char* key, size_t size, const char* op,
+                    const char* dist, double hit_ratio, size_t ops, double ns ) {
+    fprintf( out, "%s\n  {\"key\": \"%s\", \"size\": %zu, \"op\": \"%s\", "
+        "\"dist\": \"%s\", \"hit_ratio\": %.2f, \"ops\": %zu, "
+        "\"ns_per_op\": %.2f, \"mops_per_s\": %.3f}"
+        , first_result ? "" : ",", key, size, op, dist ? dist : "none"
+        , hit_ratio, ops, ns / ops, ops / ns * 1e3);
+    first_result = false;
+    fflush( out);
+}
+
+/// The keys of one benchmark run, either as long values or as C-strings.
+/// The hit keys are inserted; the miss keys are never in the table.
+typedef struct {
+    bool strings;
+    size_t n;
+    void** hit;
+    void** miss;
+    char* text;      // storage for C-string keys
+} keyset_t;
+
+/// make_keys generates n distinct keys to insert and n keys that miss.
+/// Long keys are random values below 2^62.
+/// @param k receives the keys
+/// @param n number of keys of each kind
+/// @param strings true for C-string keys
+/// @return false if there is no memory for them
+static bool make_keys( keyset_t* k, size_t n, bool strings ) {
+    k->strings = strings;
+    k->n = n;
+    k->hit = malloc( n * sizeof( void*));
+    k->miss = malloc( n * sizeof( void*));
+    k->text = strings ? malloc( 2 * n * STR_KEY_SIZE) : NULL;
+    if (k->hit == NULL || k->miss == NULL || (strings && k->text == NULL)) {
+        return false;
+    }
+    for (size_t i=0; i<n; ++i) {
+        uint64_t r = next_random() >> 2;
+        if (strings) {
+            // the index keeps keys distinct; the random part varies them
+            char* h = k->text + 2 * i * STR_KEY_SIZE;
+            char* m = h + STR_KEY_SIZE;
+            snprintf( h, STR_KEY_SIZE, "u%zx_%04x", i, (unsigned)(r & 0xffff));
+            snprintf( m, STR_KEY_SIZE, "m%zx_%04x", i, (unsigned)(r & 0xffff));
+            k->hit[i] = h;
+            k->miss[i] = m;
+        } else {
+            // the low 32 bits are i for hits and n + i for misses, which
+            // keeps every key distinct; the high bits are random
+            uint64_t high = ~(uint64_t)0xffffffff;
+            k->hit[i] = (void*)(long)((r & high) | i);
+            k->miss[i] = (void*)(long)(((next_random() >> 2) & high) | (n + i));
+        }
+    }
+    return true;
+}
+
+/// free_keys releases the keys of a run.
+/// @param k the keys
+static void free_keys( keyset_t* k ) {
+    free( k->hit);
+    free( k->miss);
+    free( k->text);
+}
+
+/// bench_size runs every measurement for one key type at one table size.
+/// @param n number of entries to insert
+/// @param strings true for C-string keys
+static void bench_size( size_t n, bool strings ) {
+    const char* key = strings ? "string" : "long";
+    keyset_t k;
+    if (!make_keys( &k, n, strings)) {
+        fprintf( stderr, "ERROR: no memory for %zu %s keys.\n", n, key);
+        free_keys( &k);
+        return;
+    }
+    size_t lookups = n < MIN_LOOKUPS ? MIN_LOOKUPS
+                   : n > MAX_LOOKUPS ? MAX_LOOKUPS : n;
+    size_t* order = malloc( lookups * sizeof( size_t));
+    void** probe = malloc( lookups * sizeof( void*));
+    if (order == NULL || probe == NULL) {
+        fprintf( stderr, "ERROR: no memory for %zu lookups.\n", lookups);
+        free( order);
+        free( probe);
+        free_keys( &k);
+        return;
+    }
+
+    Table t = strings ? ht_create( str_hash, str_equals, str_long_print, NULL)
+                      : ht_create( long_hash, long_equals, long_long_print, NULL);
+
+    double start = now_ns();
+    for (size_t i=0; i<n; ++i) {
+        ht_put( t, k.hit[i], (void*)(long)(i + 1));
+    }
+    report( key, n, "put", NULL, 1.0, n, now_ns() - start);
+
+    for (dist_t d=UNIFORM; d<=SEQUENTIAL; ++d) {
+        make_lookups( order, lookups, n, d);
+        for (size_t i=0; i<lookups; ++i) probe[i] = k.hit[order[i]];
+
+        size_t total = 0;
+        start = now_ns();
+        for (size_t i=0; i<lookups; ++i) {
+            total += (size_t)ht_get( t, probe[i]);
+        }
+        report( key, n, "get", dist_names[d], 1.0, lookups, now_ns() - start);
+        sink = total;
+
+        // the same keys, with a share of them replaced by misses
+        const double ratios[] = { 1.0, 0.5, 0.0 };
+        for (size_t r=0; r<sizeof( ratios) / sizeof( ratios[0]); ++r) {
+            for (size_t i=0; i<lookups; ++i) {
+                bool hit = (next_random() >> 11) * (1.0 / 9007199254740992.0)
+                         < ratios[r];
+                probe[i] = hit ? k.hit[order[i]] : k.miss[order[i]];
+            }
+            total = 0;
+            start = now_ns();
+            for (size_t i=0; i<lookups; ++i) {
+                total += ht_has( t, probe[i]);
+            }
+            report( key, n, "has", dist_names[d], ratios[r], lookups
+                  , now_ns() - start);
+            sink = total;
+        }
+    }
+
+    start = now_ns();
+    void** all = ht_keys( t);
+    report( key, n, "keys", NULL, 1.0, n, now_ns() - start);
+    free( all);
+
+    ht_destroy( t);
+    free( order);
+    free( probe);
+    free_keys( &k);
+}
+
+/// The main function runs the benchmark for each size from 1K, growing by
+/// a factor of ten up to the maximum, for long and then C-string keys.
+/// @param argc command line argument count
+/// @param argv command line arguments
+/// @return EXIT_SUCCESS, or EXIT_FAILURE for bad arguments
+int main( int argc, char* argv[] ) {
+    size_t max = 1000000;
+    uint64_t seed = 1;
+    const char* path = NULL;
+    int opt;
+    while ((opt = getopt( argc, argv, "n:s:o:")) != -1) {
+        switch (opt) {
+        case 'n': max = strtoul( optarg, NULL, 10); break;
+        case 's': seed = strtoul( optarg, NULL, 10); break;
+        case 'o': path = optarg; break;
+        default:
+            fprintf( stderr, "usage: %s [-n max-size] [-s seed] [-o file]\n"
+                   , argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    out = path ? fopen( path, "w") : stdout;
+    if (out == NULL) {
+        fprintf( stderr, "ERROR: cannot write '%s'.\n", path);
+        return EXIT_FAILURE;
+    }
+    rng_state = seed ? seed : 1;
+
+    fprintf( out, "[");
+    for (int strings=0; strings<=1; ++strings) {
+        for (size_t n=1000; n<=max; n*=10) {
+            bench_size( n, strings);
+        }
+    }
+    fprintf( out, "\n]\n");
+    if (out != stdout) fclose( out);
+    return EXIT_SUCCESS;
+}
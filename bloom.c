@@ -0,0 +1,144 @@
+//
+// file: bloom.c
+//
+// Blocked Bloom filters. A key is mixed twice: the first mix picks its
+// block and the second gives the places of its probes within the block,
+// 9 bits apiece for the 512 bits of a plain block and 7 bits apiece for
+// the 128 counters of a counting one.
+//
+// @author Ryan Nowak rcn8263
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "metrics.h"
+
+/// Bytes of a block, and the alignment of the blocks.
+#define BLOCK_BYTES 64
+
+/// 64-bit words of a block.
+#define BLOCK_WORDS (BLOCK_BYTES / 8)
+
+/// Bits, or counters, of a block.
+#define BLOCK_BITS (BLOCK_BYTES * 8)
+#define BLOCK_COUNTERS (BLOCK_BITS / 4)
+
+/// A counter that reaches this stays there.
+#define COUNTER_MAX 15
+
+/// The splitmix64 finalizer.
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+/// Return the block of a key, and its probes within the block.
+static uint64_t *block_of(const bloom_t *filter, uint64_t key,
+    uint64_t *probes) {
+    uint64_t h = mix(key);
+    *probes = mix(h ^ 0x9E3779B97F4A7C15ull);
+    return filter->blocks + (h & (filter->block_count - 1)) * BLOCK_WORDS;
+}
+
+bool bloom_init(bloom_t *filter, size_t capacity, bool counting) {
+    if (capacity < BLOOM_MIN_KEYS) {
+        capacity = BLOOM_MIN_KEYS;
+    }
+    size_t per_block = counting ? BLOCK_COUNTERS : BLOCK_BITS;
+    size_t needed = (capacity * BLOOM_BITS_PER_KEY + per_block - 1) /
+        per_block;
+    size_t count = 1;
+    while (count < needed) {
+        count *= 2;
+    }
+    uint64_t *blocks = aligned_alloc(BLOCK_BYTES, count * BLOCK_BYTES);
+    if (blocks == NULL) {
+        return false;
+    }
+    memset(blocks, 0, count * BLOCK_BYTES);
+    metrics_allocated(count * BLOCK_BYTES, 1);
+    filter->blocks = blocks;
+    filter->block_count = count;
+    filter->keys = 0;
+    filter->capacity = capacity;
+    filter->counting = counting;
+    return true;
+}
+
+void bloom_free(bloom_t *filter) {
+    if (filter->blocks != NULL) {
+        metrics_freed(filter->block_count * BLOCK_BYTES, 1);
+        free(filter->blocks);
+        filter->blocks = NULL;
+    }
+}
+
+void bloom_add(bloom_t *filter, uint64_t key) {
+    uint64_t probes;
+    uint64_t *block = block_of(filter, key, &probes);
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        if (filter->counting) {
+            unsigned c = (probes >> (7 * i)) & (BLOCK_COUNTERS - 1);
+            unsigned shift = (c % 16) * 4;
+            if (((block[c / 16] >> shift) & 0xF) < COUNTER_MAX) {
+                block[c / 16] += (uint64_t)1 << shift;
+            }
+        }
+        else {
+            unsigned b = (probes >> (9 * i)) & (BLOCK_BITS - 1);
+            block[b / 64] |= (uint64_t)1 << (b % 64);
+        }
+    }
+    filter->keys++;
+}
+
+void bloom_remove(bloom_t *filter, uint64_t key) {
+    uint64_t probes;
+    uint64_t *block = block_of(filter, key, &probes);
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        unsigned c = (probes >> (7 * i)) & (BLOCK_COUNTERS - 1);
+        unsigned shift = (c % 16) * 4;
+        uint64_t counter = (block[c / 16] >> shift) & 0xF;
+        if (counter > 0 && counter < COUNTER_MAX) {
+            block[c / 16] -= (uint64_t)1 << shift;
+        }
+    }
+    filter->keys--;
+}
+
+bool bloom_may_contain(const bloom_t *filter, uint64_t key) {
+    uint64_t probes;
+    const uint64_t *block = block_of(filter, key, &probes);
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        if (filter->counting) {
+            unsigned c = (probes >> (7 * i)) & (BLOCK_COUNTERS - 1);
+            if (((block[c / 16] >> ((c % 16) * 4)) & 0xF) == 0) {
+                return false;
+            }
+        }
+        else {
+            unsigned b = (probes >> (9 * i)) & (BLOCK_BITS - 1);
+            if ((block[b / 64] & ((uint64_t)1 << (b % 64))) == 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void bloom_prefetch(const bloom_t *filter, uint64_t key) {
+    if (filter->blocks != NULL) {
+        uint64_t probes;
+        __builtin_prefetch(block_of(filter, key, &probes));
+    }
+}
+
+bool bloom_full(const bloom_t *filter) {
+    return filter->keys > filter->capacity;
+}
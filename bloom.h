@@ -0,0 +1,89 @@
+/// @file bloom.h
+/// @brief Blocked Bloom filters, to turn away lookups of keys that are not
+///    there without touching the structure that holds them.
+///
+/// Every key maps to one block of 64 bytes, a cache line, and sets
+/// BLOOM_PROBES bits or counters within it, so a check costs one cache
+/// miss however many probes it makes. A counting filter holds a 4-bit
+/// counter in place of each bit, so keys can be removed; a counter that
+/// reaches 15 stays there, never to be decremented, so removal can never
+/// cause a false negative.
+///
+/// A filter is sized for a number of keys; past that its false positive
+/// rate climbs, and the owner should rebuild it larger.
+///
+/// @author Ryan Nowak rcn8263
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdbool.h>    // bool
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+
+/// Bits given to each key of a plain filter: about a 1% false positive
+/// rate. A counting filter has as many counters, of four bits each.
+#define BLOOM_BITS_PER_KEY 10
+
+/// Bits or counters set by each key.
+#define BLOOM_PROBES 7
+
+/// Fewest keys a filter is sized for.
+#define BLOOM_MIN_KEYS 1024
+
+/// A blocked Bloom filter. A zeroed filter is not usable until
+/// bloom_init.
+typedef struct bloom_s {
+    uint64_t *blocks;           ///< the blocks, 8 words each
+    size_t block_count;         ///< number of blocks, a power of two
+    size_t keys;                ///< keys added and not removed
+    size_t capacity;            ///< keys the filter is sized for
+    bool counting;              ///< counters rather than bits
+} bloom_t;
+
+/// Make an empty filter sized for a number of keys.
+///
+/// @param filter the filter
+/// @param capacity keys it is sized for
+/// @param counting whether keys can be removed
+/// @return false if there is no memory for it
+bool bloom_init(bloom_t *filter, size_t capacity, bool counting);
+
+/// Free a filter's blocks.
+///
+/// @param filter the filter
+void bloom_free(bloom_t *filter);
+
+/// Add a key.
+///
+/// @param filter the filter
+/// @param key the key, or any 64-bit hash of it
+void bloom_add(bloom_t *filter, uint64_t key);
+
+/// Remove a key added before, from a counting filter.
+///
+/// @param filter the filter
+/// @param key the key
+void bloom_remove(bloom_t *filter, uint64_t key);
+
+/// Report whether a key may have been added: false means it certainly was
+/// not.
+///
+/// @param filter the filter
+/// @param key the key
+bool bloom_may_contain(const bloom_t *filter, uint64_t key);
+
+/// Start loading the block a key would be looked for in, so that looking
+/// up several keys one after another waits for their blocks only once. A
+/// filter without blocks is left alone.
+///
+/// @param filter the filter
+/// @param key the key
+void bloom_prefetch(const bloom_t *filter, uint64_t key);
+
+/// Report whether a filter holds more keys than it is sized for.
+///
+/// @param filter the filter
+bool bloom_full(const bloom_t *filter);
+
+#endif // BLOOM_H
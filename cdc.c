@@ -0,0 +1,161 @@
+//
+// file: cdc.c
+//
+// The change data capture writer. Records are appended under one lock,
+// which also hands out the sequence numbers, so the ring holds them in
+// sequence order. The ring is published like a seqlock: reserved is moved
+// past a record before any of its bytes are written, and head once they
+// all are.
+//
+// @author Ryan Nowak rcn8263
+//
+
+#define _DEFAULT_SOURCE  // ftruncate
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "amici.h"
+#include "cdc.h"
+
+/// Bytes of the longest record: its header and CDC_MAX_STRINGS strings
+/// from one command line, padded. A ring any smaller could be given a
+/// record it has no room for.
+#define CDC_MAX_RECORD ((sizeof(cdc_record_t) + \
+    CDC_MAX_STRINGS * BUFFER_SIZE + CDC_ALIGN - 1) & ~(size_t)(CDC_ALIGN - 1))
+
+/// The open CDC file, or NULL. It is only opened and closed while no
+/// command runs.
+static cdc_header_t *header;
+static char *ring;
+static size_t mapped;
+
+/// Sequence number of the last record, guarded by cdc_lock.
+static uint64_t seq;
+static pthread_mutex_t cdc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool cdc_open(const char *path, unsigned megabytes) {
+    uint64_t capacity = (uint64_t)megabytes * 1024 * 1024;
+    if (capacity < CDC_MAX_RECORD) {
+        return false;
+    }
+    // build the file beside its place and rename it in, so a consumer
+    // never maps one half made
+    size_t length = strlen(path) + sizeof(".tmp");
+    char *temp = malloc(length);
+    if (temp == NULL) {
+        return false;
+    }
+    snprintf(temp, length, "%s.tmp", path);
+    int fd = open(temp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(temp);
+        return false;
+    }
+    mapped = sizeof(cdc_header_t) + capacity;
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, mapped) == 0) {
+        map = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(temp);
+        free(temp);
+        return false;
+    }
+    header = map;
+    ring = (char *)map + sizeof(cdc_header_t);
+    memcpy(header->magic, CDC_MAGIC, sizeof(header->magic));
+    header->version = CDC_VERSION;
+    header->header_size = sizeof(cdc_header_t);
+    header->capacity = capacity;
+    atomic_init(&header->head, 0);
+    atomic_init(&header->reserved, 0);
+    atomic_init(&header->tail, 0);
+    seq = 0;
+    bool renamed = rename(temp, path) == 0;
+    if (!renamed) {
+        unlink(temp);
+        cdc_close();
+    }
+    free(temp);
+    return renamed;
+}
+
+void cdc_close(void) {
+    if (header != NULL) {
+        munmap(header, mapped);
+        header = NULL;
+        ring = NULL;
+    }
+}
+
+/// Move reserved to the end of a record about to be written at head,
+/// first moving tail past every record the new one overwrites. The caller
+/// holds cdc_lock.
+///
+/// @param head where the record starts
+/// @param length bytes of the record
+static void reserve(uint64_t head, uint32_t length) {
+    uint64_t end = head + length;
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    while (end - tail > header->capacity) {
+        const cdc_record_t *oldest =
+            (const cdc_record_t *)(ring + tail % header->capacity);
+        tail += oldest->length;
+    }
+    atomic_store_explicit(&header->tail, tail, memory_order_relaxed);
+    atomic_store_explicit(&header->reserved, end, memory_order_relaxed);
+    // a reader who sees any byte of the record sees reserved past it
+    atomic_thread_fence(memory_order_release);
+}
+
+void cdc_record(cdc_type_t type, int count, const char **strings) {
+    if (header == NULL) {
+        return;
+    }
+    size_t length = sizeof(cdc_record_t);
+    for (int i = 0; i < count; i++) {
+        length += strlen(strings[i]) + 1;
+    }
+    length = (length + CDC_ALIGN - 1) & ~(size_t)(CDC_ALIGN - 1);
+    // cdc_open made the ring big enough for any record, so none is lost
+    // without its sequence number
+    assert(count <= CDC_MAX_STRINGS && length <= CDC_MAX_RECORD);
+
+    pthread_mutex_lock(&cdc_lock);
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    size_t offset = head % header->capacity;
+    if (offset + length > header->capacity) {
+        // a record never wraps; pad out the rest of the ring instead
+        uint32_t rest = header->capacity - offset;
+        reserve(head, rest);
+        cdc_record_t *pad = (cdc_record_t *)(ring + offset);
+        pad->length = rest;
+        pad->type = CDC_PAD;
+        pad->strings = 0;
+        pad->seq = 0;
+        head += rest;
+        offset = 0;
+    }
+    reserve(head, length);
+    cdc_record_t *record = (cdc_record_t *)(ring + offset);
+    record->length = length;
+    record->type = type;
+    record->strings = count;
+    record->seq = ++seq;
+    char *data = record->data;
+    for (int i = 0; i < count; i++) {
+        size_t bytes = strlen(strings[i]) + 1;
+        memcpy(data, strings[i], bytes);
+        data += bytes;
+    }
+    atomic_store_explicit(&header->head, head + length, memory_order_release);
+    pthread_mutex_unlock(&cdc_lock);
+}
@@ -0,0 +1,100 @@
+/// @file cdc.h
+/// @brief Change data capture: a binary stream of every change to the
+///    network, for replicating it into other systems without parsing
+///    amici's output.
+///
+/// The stream is a ring buffer in a file that amici maps into memory.
+/// Consumers map the same file and read records in place; with the file
+/// in /dev/shm it is a shared memory segment. The file holds a cdc_header_t
+/// followed by the ring. Records are appended at head, a count of bytes
+/// ever written: a record at position p sits at offset p % capacity of the
+/// ring and never wraps, the rest of the ring being filled by a CDC_PAD
+/// record instead. Sequence numbers start at 1 and have no gaps, so a
+/// consumer that falls more than a ring behind sees what it lost.
+///
+/// A consumer reads like a seqlock reader: it loads head, reads the records
+/// before it in place, then loads reserved, the position amici is writing
+/// up to. If reserved - p > capacity, the record at p may have been
+/// overwritten while it was read and must be discarded. tail is where the
+/// oldest record still whole starts.
+///
+/// @author Ryan Nowak rcn8263
+
+#ifndef CDC_H
+#define CDC_H
+
+#include <stdatomic.h>  // _Atomic
+#include <stdbool.h>    // bool
+#include <stdint.h>     // uint64_t
+
+/// The first bytes of a CDC file.
+#define CDC_MAGIC "AMICICDC"
+
+/// Version of the layout, bumped whenever it changes.
+#define CDC_VERSION 1
+
+/// Megabytes of ring unless --cdc-size says otherwise.
+#define DEFAULT_CDC_SIZE 64
+
+/// Records are padded to a multiple of this, the size of a record's
+/// header, so there is always room for a CDC_PAD record at the end of the
+/// ring.
+#define CDC_ALIGN 16
+
+/// The most strings a record holds.
+#define CDC_MAX_STRINGS 3
+
+/// The kinds of record.
+typedef enum {
+    CDC_PAD = 0,                ///< filler to the end of the ring
+    CDC_USER_ADDED = 1,         ///< strings: handle, first name, last name
+    CDC_FRIENDED = 2,           ///< strings: the two handles
+    CDC_UNFRIENDED = 3,         ///< strings: the two handles
+    CDC_RESET = 4,              ///< the network was emptied by init
+} cdc_type_t;
+
+/// The start of a CDC file. The three positions each have a cache line.
+typedef struct cdc_header_s {
+    char magic[8];              ///< CDC_MAGIC, without its NUL
+    uint32_t version;           ///< CDC_VERSION
+    uint32_t header_size;       ///< bytes before the ring
+    uint64_t capacity;          ///< bytes of the ring
+    _Alignas(64) _Atomic uint64_t head;     ///< end of the last record
+    _Alignas(64) _Atomic uint64_t reserved; ///< end of the record written
+    _Alignas(64) _Atomic uint64_t tail;     ///< start of the oldest record
+} cdc_header_t;
+
+/// A record: its header, then its strings, each with its NUL.
+typedef struct cdc_record_s {
+    uint32_t length;            ///< bytes of the record, padding included
+    uint16_t type;              ///< a cdc_type_t
+    uint16_t strings;           ///< number of strings
+    uint64_t seq;               ///< sequence number, or 0 for CDC_PAD
+    char data[];                ///< the strings
+} cdc_record_t;
+
+/// Create the CDC file, replacing any file already there, and start
+/// writing every change to it. A consumer still reading a replaced file
+/// keeps its mapping, and can tell the file was replaced by its inode.
+///
+/// @param path the file
+/// @param megabytes size of the ring
+/// @return false if the file cannot be created, or the ring is too small
+///    for the longest record
+bool cdc_open(const char *path, unsigned megabytes);
+
+/// Stop writing changes and unmap the file, which stays behind.
+void cdc_close(void);
+
+/// Append a record, if a CDC file is open. Changes that depend on one
+/// another are recorded in the order they are made, since each is
+/// recorded while its shards are held.
+///
+/// @pre there are at most CDC_MAX_STRINGS strings, each shorter than
+///    BUFFER_SIZE, so the record fits in the ring
+/// @param type kind of the record
+/// @param count number of strings
+/// @param strings the strings
+void cdc_record(cdc_type_t type, int count, const char **strings);
+
+#endif // CDC_H
@@ -0,0 +1,203 @@
+//
+// file: cdc_tail.c
+//
+// Reader of amici's change data capture file. Prints every record still
+// in the ring, oldest first, one line each:
+//
+//     seq add handle first-name last-name
+//     seq friend handle1 handle2
+//     seq unfriend handle1 handle2
+//     seq init
+//
+// With -f it goes on printing records as amici writes them, and follows
+// amici to a new file when it replaces the old one. Records are read in
+// place from the mapped file; one that amici overwrote while it was being
+// read is dropped, and the records lost are reported on stderr.
+//
+// usage: cdc_tail [-f] cdc-file
+//
+// @author Ryan Nowak rcn8263
+//
+
+#define _DEFAULT_SOURCE  // getopt, nanosleep
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cdc.h"
+
+/// Milliseconds between looks for new records when following.
+#define POLL_MS 10
+
+/// The mapped file.
+static const cdc_header_t *header;
+static const char *ring;
+static size_t mapped;
+static ino_t inode;
+
+/// Map a CDC file.
+///
+/// @param path the file
+/// @return false, with a message written, if it is not a CDC file
+static bool map_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(cdc_header_t)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: not a CDC file\n", path);
+        return false;
+    }
+    header = map;
+    if (memcmp(header->magic, CDC_MAGIC, sizeof(header->magic)) ||
+        header->version != CDC_VERSION ||
+        header->header_size + header->capacity != (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: not a CDC file of version %d\n", path,
+            CDC_VERSION);
+        munmap(map, st.st_size);
+        return false;
+    }
+    ring = (const char *)map + header->header_size;
+    mapped = st.st_size;
+    inode = st.st_ino;
+    return true;
+}
+
+/// Format a record into a line, reading no further than its length.
+///
+/// @param record the record, which may be being overwritten
+/// @param line receives the line
+/// @param size bytes of line
+/// @return false if the record is not well formed
+static bool format(const cdc_record_t *record, char *line, size_t size) {
+    static const char *names[] = {
+        [CDC_USER_ADDED] = "add", [CDC_FRIENDED] = "friend",
+        [CDC_UNFRIENDED] = "unfriend", [CDC_RESET] = "init"
+    };
+    static const int counts[] = {
+        [CDC_USER_ADDED] = 3, [CDC_FRIENDED] = 2,
+        [CDC_UNFRIENDED] = 2, [CDC_RESET] = 0
+    };
+    uint16_t type = record->type;
+    if (type < CDC_USER_ADDED || type > CDC_RESET ||
+        record->strings != counts[type]) {
+        return false;
+    }
+    int n = snprintf(line, size, "%llu %s",
+        (unsigned long long)record->seq, names[type]);
+    const char *s = record->data;
+    const char *end = (const char *)record + record->length;
+    for (int i = 0; i < counts[type]; i++) {
+        const char *nul = memchr(s, '\0', end - s);
+        if (nul == NULL || n >= (int)size) {
+            return false;
+        }
+        n += snprintf(line + n, size - n, " %s", s);
+        s = nul + 1;
+    }
+    return n < (int)size;
+}
+
+/// Print the records from a position up to head.
+///
+/// @param pos where to start, advanced past what is printed
+/// @param last sequence number of the last record printed, advanced
+static void print_records(uint64_t *pos, uint64_t *last) {
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+    uint64_t capacity = header->capacity;
+    char line[4 * 1024];
+    while (*pos < head) {
+        const cdc_record_t *record =
+            (const cdc_record_t *)(ring + *pos % capacity);
+        uint32_t length = record->length;
+        bool formed = length >= sizeof(cdc_record_t) &&
+            length % CDC_ALIGN == 0 && length <= capacity - *pos % capacity;
+        uint16_t type = record->type;
+        uint64_t seq = record->seq;
+        formed = formed && (type == CDC_PAD ||
+            format(record, line, sizeof(line)));
+
+        // the record counts only if amici had not begun overwriting it
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t reserved = atomic_load_explicit(&header->reserved,
+            memory_order_relaxed);
+        if (reserved - *pos > capacity || !formed) {
+            uint64_t tail = atomic_load_explicit(&header->tail,
+                memory_order_acquire);
+            fprintf(stderr, "cdc_tail: records after %llu were overwritten "
+                "before they were read\n", (unsigned long long)*last);
+            *pos = tail;
+            head = atomic_load_explicit(&header->head, memory_order_acquire);
+            *last = 0;
+            continue;
+        }
+        if (type != CDC_PAD) {
+            if (*last != 0 && seq != *last + 1) {
+                fprintf(stderr, "cdc_tail: records %llu to %llu are lost\n",
+                    (unsigned long long)*last + 1,
+                    (unsigned long long)seq - 1);
+            }
+            puts(line);
+            *last = seq;
+        }
+        *pos += length;
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    bool follow = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f")) != -1) {
+        if (opt == 'f') {
+            follow = true;
+        }
+        else {
+            fprintf(stderr, "usage: %s [-f] cdc-file\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "usage: %s [-f] cdc-file\n", argv[0]);
+        return 1;
+    }
+    const char *path = argv[optind];
+    if (!map_file(path)) {
+        return 1;
+    }
+
+    uint64_t pos = atomic_load_explicit(&header->tail, memory_order_acquire);
+    uint64_t last = 0;
+    print_records(&pos, &last);
+    while (follow) {
+        struct timespec pause = { 0, POLL_MS * 1000000L };
+        nanosleep(&pause, NULL);
+        print_records(&pos, &last);
+        // amici replaces the file when it restarts; read the old one out
+        // first, then start on the new one
+        struct stat st;
+        if (stat(path, &st) == 0 && st.st_ino != inode) {
+            munmap((void *)header, mapped);
+            if (!map_file(path)) {
+                return 1;
+            }
+            pos = atomic_load_explicit(&header->tail, memory_order_acquire);
+            last = 0;
+        }
+    }
+    munmap((void *)header, mapped);
+    return 0;
+}
@@ -0,0 +1,294 @@
+//
+// file: diag.c
+//
+// Table diagnostics. The layout of a table is modeled in one sweep over
+// the slots of the model, carrying the keys still looking for a slot from
+// each slot to the next; the only memory needed is a count of the keys
+// whose home is each slot. Hot keys are found with the Space-Saving algorithm (Metwally
+// et al.), which follows a fixed number of keys and is guaranteed to hold
+// every key looked up more than 1/HOT_KEYS of the time.
+//
+// @author Ryan Nowak rcn8263
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "diag.h"
+
+/// The hot key summary, guarded by hot_lock.
+static hot_key_t hot[HOT_KEYS];
+static int hot_count;
+static pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Lookups the calling thread has made since it last offered a key.
+static _Thread_local unsigned hot_skipped;
+
+/// Return the histogram bucket of a length of at least 1.
+static int bucket(size_t length) {
+    if (length <= 1) {
+        return 0;
+    }
+    int b = 64 - __builtin_clzll(length - 1);
+    return b < DIAG_BUCKETS ? b : DIAG_BUCKETS - 1;
+}
+
+size_t diag_capacity(size_t size, size_t *rehashes) {
+    size_t capacity = INITIAL_CAPACITY;
+    size_t grown = 0;
+    // the table grows as soon as an insert brings it to the threshold
+    while ((double)size / capacity >= LOAD_THRESHOLD) {
+        capacity *= RESIZE_FACTOR;
+        grown++;
+    }
+    if (rehashes != NULL) {
+        *rehashes = grown;
+    }
+    return capacity;
+}
+
+/// Sweep the slots once, starting at slot 0 with carry keys already
+/// looking for a slot.
+///
+/// @param home number of keys whose home is each slot
+/// @param capacity number of slots
+/// @param carry keys carried into slot 0
+/// @param empty receives a slot left empty, if there is one
+/// @return the keys carried out of the last slot
+static size_t sweep(const uint32_t *home, size_t capacity, size_t carry,
+    size_t *empty) {
+    for (size_t i = 0; i < capacity; i++) {
+        carry += home[i];
+        if (carry > 0) {
+            carry--;
+        }
+        else {
+            *empty = i;
+        }
+    }
+    return carry;
+}
+
+bool diag_table(const size_t *hashes, size_t sampled, size_t size,
+    table_diag_t *diag) {
+    memset(diag, 0, sizeof(*diag));
+    diag->size = size;
+    diag->capacity = diag_capacity(size, &diag->rehashes);
+    diag->sampled = sampled;
+    // the model is as full as the table, so it too keeps a free slot
+    size_t capacity = diag->capacity;
+    if (sampled < size) {
+        capacity = capacity * sampled / size;
+        capacity = capacity > 0 ? capacity : 1;
+    }
+    diag->slots = capacity;
+    uint32_t *home = calloc(capacity, sizeof(uint32_t));
+    if (home == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < sampled; i++) {
+        home[hashes[i] % capacity]++;
+    }
+
+    // keys carried past the last slot wrap around to slot 0; sweep until
+    // the number carried settles, then every slot's state is the table's
+    size_t carry = 0;
+    size_t settled;
+    size_t empty = 0;
+    do {
+        settled = carry;
+        carry = sweep(home, capacity, settled, &empty);
+    }
+    while (carry != settled);
+
+    // from just after an empty slot nothing is carried in; each slot takes
+    // the waiting key with the earliest home, as keys inserted in home
+    // order would be placed
+    size_t start = (empty + 1) % capacity;
+    size_t front = start;
+    size_t waiting = 0;
+    size_t run = 0;
+    for (size_t n = 0; n < capacity; n++) {
+        size_t slot = (start + n) % capacity;
+        waiting += home[slot];
+        if (waiting == 0) {
+            if (run > 0) {
+                diag->clusters++;
+                diag->cluster_hist[bucket(run)]++;
+                if (run > diag->longest_cluster) {
+                    diag->longest_cluster = run;
+                }
+                // a miss whose home is in the run reads to its end, and
+                // one slot more to find it empty
+                for (size_t probes = 2; probes <= run + 1; probes++) {
+                    diag->miss_hist[bucket(probes)]++;
+                    diag->misses += probes;
+                }
+            }
+            run = 0;
+            diag->miss_hist[0]++;
+            diag->misses++;
+            continue;
+        }
+        while (home[front] == 0) {
+            front = (front + 1) % capacity;
+        }
+        home[front]--;
+        waiting--;
+        run++;
+        size_t probes = (slot + capacity - front) % capacity + 1;
+        diag->probes += probes;
+        diag->probe_hist[bucket(probes)]++;
+        if (probes > diag->longest_probe) {
+            diag->longest_probe = probes;
+        }
+    }
+    free(home);
+    return true;
+}
+
+void diag_add(table_diag_t *total, const table_diag_t *diag) {
+    total->size += diag->size;
+    total->capacity += diag->capacity;
+    total->rehashes += diag->rehashes;
+    total->sampled += diag->sampled;
+    total->slots += diag->slots;
+    total->probes += diag->probes;
+    total->misses += diag->misses;
+    total->clusters += diag->clusters;
+    if (diag->longest_probe > total->longest_probe) {
+        total->longest_probe = diag->longest_probe;
+    }
+    if (diag->longest_cluster > total->longest_cluster) {
+        total->longest_cluster = diag->longest_cluster;
+    }
+    for (int b = 0; b < DIAG_BUCKETS; b++) {
+        total->probe_hist[b] += diag->probe_hist[b];
+        total->miss_hist[b] += diag->miss_hist[b];
+        total->cluster_hist[b] += diag->cluster_hist[b];
+    }
+}
+
+/// Write a histogram as a JSON array of its non-empty buckets, each with
+/// its largest length, or null for the last, open-ended bucket.
+///
+/// @param out stream receiving the JSON
+/// @param hist the histogram
+static void write_hist(FILE *out, const size_t *hist) {
+    bool first = true;
+    fprintf(out, "[");
+    for (int b = 0; b < DIAG_BUCKETS; b++) {
+        if (hist[b] == 0) {
+            continue;
+        }
+        if (b < DIAG_BUCKETS - 1) {
+            fprintf(out, "%s{\"le\": %lu, \"count\": %zu}", first ? "" : ", ",
+                1ul << b, hist[b]);
+        }
+        else {
+            fprintf(out, "%s{\"le\": null, \"count\": %zu}", first ? "" : ", ",
+                hist[b]);
+        }
+        first = false;
+    }
+    fprintf(out, "]");
+}
+
+/// Return a / b, or 0 when b is 0.
+static double ratio(size_t a, size_t b) {
+    return b == 0 ? 0.0 : (double)a / b;
+}
+
+void diag_write_json(FILE *out, const table_diag_t *diag) {
+    fprintf(out, "\"size\": %zu, \"capacity\": %zu, \"load_factor\": %.4f, "
+        "\"rehashes\": %zu, ", diag->size, diag->capacity,
+        ratio(diag->size, diag->capacity), diag->rehashes);
+    fprintf(out, "\"modeled\": {\"sampled_keys\": %zu, \"slots\": %zu, ",
+        diag->sampled, diag->slots);
+    fprintf(out, "\"hit_probes\": {\"mean\": %.3f, \"max\": %zu, "
+        "\"histogram\": ", ratio(diag->probes, diag->sampled),
+        diag->longest_probe);
+    write_hist(out, diag->probe_hist);
+    fprintf(out, "}, \"miss_probes\": {\"mean\": %.3f, \"histogram\": ",
+        ratio(diag->misses, diag->slots));
+    write_hist(out, diag->miss_hist);
+    fprintf(out, "}, \"clusters\": {\"count\": %zu, \"mean\": %.3f, "
+        "\"max\": %zu, \"histogram\": ", diag->clusters,
+        ratio(diag->sampled, diag->clusters), diag->longest_cluster);
+    write_hist(out, diag->cluster_hist);
+    fprintf(out, "}}");
+}
+
+void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        }
+        else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        }
+        else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void diag_sample_key(const char *key) {
+    if (++hot_skipped < HOT_KEY_SAMPLE) {
+        return;
+    }
+    hot_skipped = 0;
+    pthread_mutex_lock(&hot_lock);
+    int least = 0;
+    for (int i = 0; i < hot_count; i++) {
+        if (!strncmp(hot[i].key, key, HOT_KEY_LENGTH)) {
+            hot[i].count++;
+            pthread_mutex_unlock(&hot_lock);
+            return;
+        }
+        if (hot[i].count < hot[least].count) {
+            least = i;
+        }
+    }
+    // a new key takes a free entry, or the place of the least counted
+    // one, inheriting its count as the most it may be overstated by
+    size_t error = 0;
+    if (hot_count < HOT_KEYS) {
+        least = hot_count++;
+    }
+    else {
+        error = hot[least].count;
+    }
+    strncpy(hot[least].key, key, HOT_KEY_LENGTH);
+    hot[least].key[HOT_KEY_LENGTH] = '\0';
+    hot[least].count = error + 1;
+    hot[least].error = error;
+    pthread_mutex_unlock(&hot_lock);
+}
+
+/// Order hot keys by count, highest first, for qsort.
+static int compare_hot(const void *a, const void *b) {
+    size_t x = ((const hot_key_t *)a)->count;
+    size_t y = ((const hot_key_t *)b)->count;
+    return (x < y) - (x > y);
+}
+
+int diag_hot_keys(hot_key_t *keys) {
+    pthread_mutex_lock(&hot_lock);
+    int count = hot_count;
+    memcpy(keys, hot, count * sizeof(hot_key_t));
+    pthread_mutex_unlock(&hot_lock);
+    qsort(keys, count, sizeof(hot_key_t), compare_hot);
+    return count;
+}
+
+void diag_reset_hot_keys(void) {
+    pthread_mutex_lock(&hot_lock);
+    hot_count = 0;
+    pthread_mutex_unlock(&hot_lock);
+}
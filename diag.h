@@ -0,0 +1,122 @@
+/// @file diag.h
+/// @brief Structural diagnostics of hash tables and sampling of the keys
+///    looked up most often, for tuning LOAD_THRESHOLD and the hash function.
+///
+/// A Table does not expose its slots, so a table's layout is modeled from
+/// the hashes of its keys and the growth rules in table.h: a table of
+/// n entries has the capacity its rehashes lead to, and every key sits in
+/// the first free slot at or after its home slot, hash % capacity, as under
+/// linear probing. Which slots are occupied, and so the clusters and the
+/// cost of every failed lookup, do not depend on the order the keys were
+/// inserted in. Successful lookups are measured for keys placed in order of
+/// home slot, the order a rehash inserts them in.
+///
+/// The model is built from a uniform sample of at most DIAG_SAMPLE keys,
+/// placed in a table with as many slots per key as the real one, so its
+/// cost does not grow with the table. A table no bigger than the sample is
+/// modeled from every key, at its own capacity.
+///
+/// @author Ryan Nowak rcn8263
+
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stdbool.h>    // bool
+#include <stddef.h>     // size_t
+#include <stdio.h>      // FILE
+
+#include "table.h"      // INITIAL_CAPACITY, LOAD_THRESHOLD, RESIZE_FACTOR
+
+/// Histograms count lengths in power of two buckets: 1, 2, 3-4, 5-8 and so
+/// on, with everything past the next to last bucket in the last one.
+#define DIAG_BUCKETS 32
+
+/// Most keys of a table its layout is modeled from.
+#define DIAG_SAMPLE 1024
+
+/// Most keys the hot key summary follows.
+#define HOT_KEYS 16
+
+/// One lookup in HOT_KEY_SAMPLE by each thread is offered to the summary.
+#define HOT_KEY_SAMPLE 64
+
+/// Keys longer than this are followed by their first HOT_KEY_LENGTH bytes.
+#define HOT_KEY_LENGTH 63
+
+/// The layout of one table, or of several added together. Everything from
+/// probes on is of the model, not of the table itself.
+typedef struct table_diag_s {
+    size_t size;                        ///< entries
+    size_t capacity;                    ///< slots
+    size_t rehashes;                    ///< times the table has grown
+    size_t sampled;                     ///< keys the model holds
+    size_t slots;                       ///< slots of the model
+    size_t probes;                      ///< slots read by every hit
+    size_t longest_probe;               ///< slots read by the worst hit
+    size_t probe_hist[DIAG_BUCKETS];    ///< slots read per hit
+    size_t misses;                      ///< slots read by a miss at each slot
+    size_t miss_hist[DIAG_BUCKETS];     ///< slots read per miss
+    size_t clusters;                    ///< runs of occupied slots
+    size_t longest_cluster;             ///< slots in the longest run
+    size_t cluster_hist[DIAG_BUCKETS];  ///< slots per run
+} table_diag_t;
+
+/// One key of the hot key summary.
+typedef struct hot_key_s {
+    char key[HOT_KEY_LENGTH + 1];       ///< the key, possibly cut short
+    size_t count;                       ///< sampled lookups, at most
+    size_t error;                       ///< how much count may overstate
+} hot_key_t;
+
+/// Return the capacity a table has once it holds size entries.
+///
+/// @param size number of entries
+/// @param rehashes receives the number of times it has grown, or NULL
+size_t diag_capacity(size_t size, size_t *rehashes);
+
+/// Model the layout of a table from the hashes of a uniform sample of its
+/// keys. Only the hashes are needed, so the table may change once they are
+/// taken.
+///
+/// @param hashes the hash of each key of the sample
+/// @param sampled number of keys in the sample, at most size
+/// @param size number of keys in the table
+/// @param diag receives the layout
+/// @return false if there is no memory for the model
+bool diag_table(const size_t *hashes, size_t sampled, size_t size,
+    table_diag_t *diag);
+
+/// Add the layout of one table into a running total.
+///
+/// @param total the total
+/// @param diag the layout to add
+void diag_add(table_diag_t *total, const table_diag_t *diag);
+
+/// Write the layout as the members of a JSON object, without its braces.
+///
+/// @param out stream receiving the JSON
+/// @param diag the layout
+void diag_write_json(FILE *out, const table_diag_t *diag);
+
+/// Write a C-string as a JSON string.
+///
+/// @param out stream receiving the JSON
+/// @param s the string
+void json_string(FILE *out, const char *s);
+
+/// Offer a looked up key to the hot key summary. Only one call in
+/// HOT_KEY_SAMPLE from each thread is counted.
+///
+/// @param key the key
+void diag_sample_key(const char *key);
+
+/// Copy out the hot key summary, most looked up first.
+///
+/// @param keys receives up to HOT_KEYS keys
+/// @return the number of keys copied
+int diag_hot_keys(hot_key_t *keys);
+
+/// Empty the hot key summary.
+void diag_reset_hot_keys(void);
+
+#endif // DIAG_H
@@ -0,0 +1,1354 @@
+//
+// file: fuzz_amici.c
+//
+// Differential tester for amici. Command lines in the style of File-input
+// are run through execute_command and through a reference model: a plain
+// array of users, each with an array of friends, searched one by one, with
+// none of the shards, tables, Bloom filters, versions, profile caches or
+// name indexes of the real network. The status of every line, and the text
+// it writes to out and to err, must be the same for both; at the first
+// difference the line is reported and the run aborts.
+//
+// Run alone, it tests seeded random streams, alternately with and without
+// Bloom filters. A small pool of handles keeps most commands about known
+// users; a few users are picked for most friendships, so they gather far
+// more friends than the ten amici once had room for, and enough for their
+// profiles to be cached; some handles are too long to be kept in the
+// record; pairs are friended and unfriended over and over, and now and
+// then a user with themselves, which amici must refuse; snapshots are
+// held across changes; and a handful of last names share their prefixes,
+// so find and lastname list several pages. Files named on the command line
+// are replayed instead, each from an empty network, which is how an input
+// the fuzzer found is reproduced. With -t, several threads each run a
+// stream about their own users at once, so under ThreadSanitizer the shard
+// locking is checked too; meanwhile two more threads open, query and
+// release the same few snapshots of those users, so queries race the
+// releases of their own snapshots and the changes that prune versions,
+// and ask for reach estimates, whose refreshes race the changes too.
+//
+// Commands the model cannot predict are not run: export and load, which
+// use files; metrics and diag, which report on amici's internals; and
+// distances and reach beyond one hop, which are estimates. Nor is an init
+// expecting more users than are worth reserving room for.
+//
+// Built with -DAMICI_LIBFUZZER it is instead a libFuzzer target, whose
+// input is a stream of command lines:
+//
+//   clang -g -O1 -fsanitize=fuzzer,address,undefined -DAMICI_LIBFUZZER
+//       -DAMICI_NO_MAIN -pthread fuzz_amici.c amici.c arena.c bloom.c cdc.c
+//       diag.c graph.c metrics.c names.c protocol.c server.c writer.c
+//       table.c hash.c -lm -o fuzz_amici
+//
+// and with -DAMICI_NO_MAIN alone it is the tester described above.
+//
+// usage: fuzz_amici [-s seed] [-n lines] [-r runs] [-t threads] [file...]
+//
+// @author Ryan Nowak rcn8263
+//
+
+#define _GNU_SOURCE  // open_memstream, strtok_r, strdup
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "amici.h"
+#include "graph.h"
+
+/// Words of a command line amici looks at; the rest are only counted.
+#define MAX_WORDS 8
+
+/// Handles each random stream draws from.
+#define POOL_SIZE 60
+
+/// Users most friendships are made with.
+#define HUBS 3
+
+/// Most threads -t runs.
+#define MAX_THREADS 16
+
+/// Snapshots the snapshot threads of -t keep open at most, so that their
+/// queries and releases keep meeting.
+#define RACED_SNAPSHOTS 4
+
+/// Most users an init line may expect. Reserving room for more only
+/// spends the fuzzer's memory.
+#define MAX_EXPECTED 100000
+
+/// A user of the model.
+typedef struct user_s {
+    char *handle;               ///< handle
+    char *first;                ///< first name
+    char *last;                 ///< last name
+    int *friends;               ///< the user's friends, oldest first
+    size_t count;               ///< number of friends
+    size_t capacity;            ///< room in friends
+} user_t;
+
+/// A snapshot of the model: the users there were when it was opened, and
+/// a copy of the friends of each.
+typedef struct view_s {
+    bool open;                  ///< the snapshot is open
+    uint64_t epoch;             ///< epoch the snapshot was opened at
+    int users;                  ///< users there were
+    size_t friendships;         ///< friendships there were
+    int **friends;              ///< the friends each user had
+    size_t *counts;             ///< how many friends each user had
+} view_t;
+
+/// The reference model of the network.
+typedef struct model_s {
+    user_t *users;              ///< every user, in the order added
+    int count;                  ///< number of users
+    int capacity;               ///< room in users
+    size_t friendships;         ///< number of friendships
+    uint64_t epoch;             ///< amici's epoch, advanced by each change
+    view_t views[MAX_SNAPSHOTS]; ///< snapshots, by id
+} model_t;
+
+/// What a command wrote, and its status.
+typedef struct result_s {
+    status_t status;            ///< the status
+    char *out;                  ///< what it wrote to out
+    size_t out_length;
+    char *err;                  ///< what it wrote to err
+    size_t err_length;
+    FILE *out_file;             ///< streams collecting them
+    FILE *err_file;
+} result_t;
+
+/// Report a failure of the model itself, and abort.
+///
+/// @param what what failed
+static void fail(const char *what) {
+    fprintf(stderr, "fuzz_amici: %s\n", what);
+    abort();
+}
+
+/// Grow an array to hold at least one more element.
+///
+/// @param array the array
+/// @param capacity its room, updated
+/// @param size size of an element
+/// @return the array, moved if need be
+static void *grow(void *array, size_t *capacity, size_t size) {
+    size_t room = *capacity ? 2 * *capacity : 16;
+    array = realloc(array, room * size);
+    if (array == NULL) {
+        fail("out of memory");
+    }
+    *capacity = room;
+    return array;
+}
+
+/// Find a user of the model.
+///
+/// @param model the model
+/// @param handle the user's handle
+/// @param limit search the first limit users
+/// @return the user's index, or -1 if there is none
+static int find_user(const model_t *model, const char *handle, int limit) {
+    for (int i = 0; i < limit; i++) {
+        if (!strcmp(model->users[i].handle, handle)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/// Check whether a user has a friend.
+///
+/// @param user the user
+/// @param other index of the friend
+/// @return true if other is one of user's friends
+static bool has_friend(const user_t *user, int other) {
+    for (size_t i = 0; i < user->count; i++) {
+        if (user->friends[i] == other) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Add a friend to the end of a user's friends.
+///
+/// @param user the user
+/// @param other index of the friend
+static void append_friend(user_t *user, int other) {
+    if (user->count == user->capacity) {
+        user->friends = grow(user->friends, &user->capacity, sizeof(int));
+    }
+    user->friends[user->count++] = other;
+}
+
+/// Remove a friend from a user's friends, keeping the order of the rest.
+///
+/// @param user the user
+/// @param other index of the friend
+static void remove_friend(user_t *user, int other) {
+    size_t kept = 0;
+    for (size_t i = 0; i < user->count; i++) {
+        if (user->friends[i] != other) {
+            user->friends[kept++] = user->friends[i];
+        }
+    }
+    user->count = kept;
+}
+
+/// Close a snapshot of the model.
+///
+/// @param view the snapshot
+static void close_view(view_t *view) {
+    if (view->open) {
+        for (int i = 0; i < view->users; i++) {
+            free(view->friends[i]);
+        }
+        free(view->friends);
+        free(view->counts);
+        view->open = false;
+    }
+}
+
+/// Empty the model, closing its snapshots; the epoch goes on.
+///
+/// @param model the model
+static void clear_model(model_t *model) {
+    for (int i = 0; i < model->count; i++) {
+        free(model->users[i].handle);
+        free(model->users[i].first);
+        free(model->users[i].last);
+        free(model->users[i].friends);
+    }
+    model->count = 0;
+    model->friendships = 0;
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        close_view(&model->views[i]);
+    }
+}
+
+/// Check whether every snapshot slot is in use.
+///
+/// @param model the model
+/// @return true if no snapshot can be opened
+static bool views_full(const model_t *model) {
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (!model->views[i].open) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Write a user as amici does: first last ('handle').
+///
+/// @param out stream receiving the user
+/// @param user the user
+static void write_user(FILE *out, const user_t *user) {
+    fprintf(out, "%s %s ('%s')", user->first, user->last, user->handle);
+}
+
+/// Write what size does for a user with a number of friends.
+///
+/// @param out stream receiving the report
+/// @param user the user
+/// @param count number of friends
+static void write_size(FILE *out, const user_t *user, size_t count) {
+    fprintf(out, "User ");
+    write_user(out, user);
+    if (count == 0) {
+        fprintf(out, " has no friends\n");
+    }
+    else if (count == 1) {
+        fprintf(out, " has 1 friend\n");
+    }
+    else {
+        fprintf(out, " has %zu friends\n", count);
+    }
+}
+
+/// Write what print does for a user with the given friends.
+///
+/// @param out stream receiving the report
+/// @param model the model
+/// @param user the user
+/// @param friends indices of the friends, oldest first
+/// @param count number of friends
+static void write_friends(FILE *out, const model_t *model, const user_t *user,
+    const int *friends, size_t count) {
+    write_size(out, user, count);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "\t");
+        write_user(out, &model->users[friends[i]]);
+        fprintf(out, "\n");
+    }
+}
+
+/// Write the statistics line for the given counts.
+///
+/// @param out stream receiving the report
+/// @param people number of users
+/// @param friendships number of friendships
+static void write_stats(FILE *out, size_t people, size_t friendships) {
+    fprintf(out, "Statistics: %zu %s, %zu %s\n", people,
+        people == 1 ? "person" : "people", friendships,
+        friendships == 1 ? "friendship" : "friendships");
+}
+
+/// Compare two users by last name, first name and handle.
+///
+/// @param a a user
+/// @param b a user
+/// @return less than, equal to or greater than 0 as a sorts before, with
+///    or after b
+static int compare_users(const user_t *a, const user_t *b) {
+    int c = strcmp(a->last, b->last);
+    if (c == 0) {
+        c = strcmp(a->first, b->first);
+    }
+    if (c == 0) {
+        c = strcmp(a->handle, b->handle);
+    }
+    return c;
+}
+
+/// Order the users of a model for qsort_r.
+static int order_users(const void *a, const void *b, void *model) {
+    const user_t *users = ((model_t *)model)->users;
+    return compare_users(&users[*(const int *)a], &users[*(const int *)b]);
+}
+
+/// List the users whose last name is, or starts with, a name, by sorting
+/// every user that matches.
+///
+/// @param model the model
+/// @param out stream receiving the list
+/// @param err stream receiving error messages
+/// @param name the last name, or its start
+/// @param prefix list the users whose last names start with name
+/// @param after handle of the user to list the users after, or NULL
+/// @return the status find and lastname give
+static status_t list_names(model_t *model, FILE *out, FILE *err,
+    const char *name, bool prefix, const char *after) {
+    int mark = -1;
+    if (after != NULL) {
+        mark = find_user(model, after, model->count);
+        if (mark < 0) {
+            fprintf(err, "error: '%s' is not a known handle\n", after);
+            return AMICI_EUNKNOWN;
+        }
+    }
+    int *matches = malloc((model->count + 1) * sizeof(int));
+    if (matches == NULL) {
+        fail("out of memory");
+    }
+    int count = 0;
+    for (int i = 0; i < model->count; i++) {
+        const user_t *user = &model->users[i];
+        if ((prefix ? strncmp(user->last, name, strlen(name)) :
+            strcmp(user->last, name)) == 0 &&
+            (mark < 0 || compare_users(user, &model->users[mark]) > 0)) {
+            matches[count++] = i;
+        }
+    }
+    qsort_r(matches, count, sizeof(int), order_users, model);
+
+    if (prefix) {
+        fprintf(out, "Users whose last name starts with '%s':\n", name);
+    }
+    else {
+        fprintf(out, "Users with the last name '%s':\n", name);
+    }
+    for (int i = 0; i < count && i < NAME_PAGE; i++) {
+        fprintf(out, "\t");
+        write_user(out, &model->users[matches[i]]);
+        fprintf(out, "\n");
+    }
+    if (count > NAME_PAGE) {
+        fprintf(out, "\tmore after '%s'\n",
+            model->users[matches[NAME_PAGE - 1]].handle);
+    }
+    if (count == 0) {
+        fprintf(out, "\tnone\n");
+    }
+    free(matches);
+    return AMICI_OK;
+}
+
+/// Open a snapshot of the model, copying the friends of every user.
+///
+/// @param model the model
+/// @param out stream receiving the snapshot's id
+/// @param err stream receiving error messages
+/// @return the status snapshot gives
+static status_t open_view(model_t *model, FILE *out, FILE *err) {
+    int id = 0;
+    while (id < MAX_SNAPSHOTS && model->views[id].open) {
+        id++;
+    }
+    if (id == MAX_SNAPSHOTS) {
+        fprintf(err, "error: all %d snapshots are open\n", MAX_SNAPSHOTS);
+        return AMICI_EBUSY;
+    }
+    view_t *view = &model->views[id];
+    view->users = model->count;
+    view->friendships = model->friendships;
+    view->epoch = model->epoch;
+    view->friends = malloc((model->count + 1) * sizeof(int *));
+    view->counts = malloc((model->count + 1) * sizeof(size_t));
+    if (view->friends == NULL || view->counts == NULL) {
+        fail("out of memory");
+    }
+    for (int i = 0; i < model->count; i++) {
+        const user_t *user = &model->users[i];
+        view->counts[i] = user->count;
+        view->friends[i] = malloc((user->count + 1) * sizeof(int));
+        if (view->friends[i] == NULL) {
+            fail("out of memory");
+        }
+        if (user->count > 0) {
+            memcpy(view->friends[i], user->friends,
+                user->count * sizeof(int));
+        }
+    }
+    view->open = true;
+    fprintf(out, "snapshot %d opened at epoch %lu\n", id,
+        (unsigned long)view->epoch);
+    return AMICI_OK;
+}
+
+/// Find an open snapshot of the model by its id.
+///
+/// @param model the model
+/// @param id the id, as given
+/// @return the snapshot, or NULL if it is not open
+static view_t *find_view(model_t *model, const char *id) {
+    char *end;
+    long i = strtol(id, &end, 10);
+    if (*end != '\0' || i < 0 || i >= MAX_SNAPSHOTS ||
+        !model->views[i].open) {
+        return NULL;
+    }
+    return &model->views[i];
+}
+
+/// Answer a query against a snapshot of the model.
+///
+/// @param model the model
+/// @param out stream receiving the command's output
+/// @param err stream receiving error messages
+/// @param words the words of the command, after the word snapshot
+/// @param count number of words
+/// @return the status the query gives
+static status_t query_view(model_t *model, FILE *out, FILE *err, char **words,
+    int count) {
+    view_t *view = find_view(model, words[0]);
+    if (view == NULL) {
+        fprintf(err, "error: '%s' is not an open snapshot\n", words[0]);
+        return AMICI_EUNKNOWN;
+    }
+    if (count == 2 && !strcmp(words[1], "stats")) {
+        write_stats(out, view->users, view->friendships);
+        return AMICI_OK;
+    }
+    if (count == 3 &&
+        (!strcmp(words[1], "print") || !strcmp(words[1], "size"))) {
+        int i = find_user(model, words[2], view->users);
+        if (i < 0) {
+            fprintf(err, "error: '%s' is not a known handle\n", words[2]);
+            return AMICI_EUNKNOWN;
+        }
+        if (!strcmp(words[1], "print")) {
+            write_friends(out, model, &model->users[i], view->friends[i],
+                view->counts[i]);
+        }
+        else {
+            write_size(out, &model->users[i], view->counts[i]);
+        }
+        return AMICI_OK;
+    }
+    fprintf(err, "error: snapshot command usage: "
+        "[id print handle | id size handle | id stats]\n");
+    return AMICI_EUSAGE;
+}
+
+/// Find the two users a friend or unfriend names, reporting the first
+/// that is not known.
+///
+/// @param model the model
+/// @param err stream receiving error messages
+/// @param words the words of the command
+/// @param found receives the users' indices
+/// @return true if both are known
+static bool find_pair(const model_t *model, FILE *err, char **words,
+    int *found) {
+    for (int i = 0; i < 2; i++) {
+        found[i] = find_user(model, words[i + 1], model->count);
+        if (found[i] < 0) {
+            fprintf(err, "error: '%s' is not a known handle\n",
+                words[i + 1]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Perform a command against the model, as run_command does against the
+/// network.
+///
+/// @param model the model
+/// @param words the words of the command line
+/// @param count number of words, counting those past MAX_WORDS
+/// @param out stream receiving the command's output
+/// @param err stream receiving error messages
+/// @return the command's status
+static status_t run_model(model_t *model, char **words, int count, FILE *out,
+    FILE *err) {
+    if (count == 0) {
+        return AMICI_OK;
+    }
+    const char *name = words[0];
+    int found[2];
+
+    //add
+    if (!strcmp(name, "add")) {
+        if (count != 4) {
+            fprintf(err,
+                "error: add command usage: first-name last-name handle\n");
+            return AMICI_EUSAGE;
+        }
+        if (find_user(model, words[3], model->count) >= 0) {
+            fprintf(err, "error: handle '%s' is already taken. "
+                "Try another handle.\n", words[3]);
+            return AMICI_ETAKEN;
+        }
+        if (model->count == model->capacity) {
+            size_t capacity = model->capacity;
+            model->users = grow(model->users, &capacity, sizeof(user_t));
+            model->capacity = capacity;
+        }
+        user_t *user = &model->users[model->count++];
+        user->first = strdup(words[1]);
+        user->last = strdup(words[2]);
+        user->handle = strdup(words[3]);
+        if (user->first == NULL || user->last == NULL ||
+            user->handle == NULL) {
+            fail("out of memory");
+        }
+        model->epoch++;
+        user->friends = NULL;
+        user->count = 0;
+        user->capacity = 0;
+        return AMICI_OK;
+    }
+    //friend
+    if (!strcmp(name, "friend")) {
+        if (count != 3) {
+            fprintf(err, "error: friend command usage: handle1 handle2\n");
+            return AMICI_EUSAGE;
+        }
+        if (!find_pair(model, err, words, found)) {
+            return AMICI_EUNKNOWN;
+        }
+        if (found[0] == found[1]) {
+            fprintf(err, "error: '%s' can't be their own friend\n",
+                words[1]);
+            return AMICI_EUSAGE;
+        }
+        user_t *user1 = &model->users[found[0]];
+        user_t *user2 = &model->users[found[1]];
+        if (has_friend(user1, found[1])) {
+            fprintf(err, "error: '%s' and '%s' are already friends.\n",
+                user1->handle, user2->handle);
+            return AMICI_EFRIENDS;
+        }
+        model->epoch++;
+        append_friend(user1, found[1]);
+        append_friend(user2, found[0]);
+        model->friendships++;
+        fprintf(out, "%s and %s are now friends\n", user1->handle,
+            user2->handle);
+        return AMICI_OK;
+    }
+    //unfriend
+    if (!strcmp(name, "unfriend")) {
+        if (count != 3) {
+            fprintf(err, "error: unfriend command usage: handle1 handle2\n");
+            return AMICI_EUSAGE;
+        }
+        if (!find_pair(model, err, words, found)) {
+            return AMICI_EUNKNOWN;
+        }
+        user_t *user1 = &model->users[found[0]];
+        user_t *user2 = &model->users[found[1]];
+        if (!has_friend(user1, found[1])) {
+            fprintf(err, "error: '%s' and '%s' are were not friends.\n",
+                user1->handle, user2->handle);
+            return AMICI_ENOTFRIENDS;
+        }
+        model->epoch++;
+        remove_friend(user1, found[1]);
+        remove_friend(user2, found[0]);
+        model->friendships--;
+        fprintf(out, "%s and %s are no longer friends\n", user1->handle,
+            user2->handle);
+        return AMICI_OK;
+    }
+    //print and size
+    if (!strcmp(name, "print") || !strcmp(name, "size")) {
+        if (count != 2) {
+            fprintf(err, "error: %s command usage: handle\n", name);
+            return AMICI_EUSAGE;
+        }
+        int i = find_user(model, words[1], model->count);
+        if (i < 0) {
+            fprintf(err, "error: '%s' is not a known handle\n", words[1]);
+            return AMICI_EUNKNOWN;
+        }
+        user_t *user = &model->users[i];
+        if (!strcmp(name, "print")) {
+            write_friends(out, model, user, user->friends, user->count);
+        }
+        else {
+            write_size(out, user, user->count);
+        }
+        return AMICI_OK;
+    }
+    //find
+    if (!strcmp(name, "find")) {
+        if (count == 2 || count == 3) {
+            return list_names(model, out, err, words[1], true,
+                count == 3 ? words[2] : NULL);
+        }
+        fprintf(err,
+            "error: find command usage: last-name-prefix [after-handle]\n");
+        return AMICI_EUSAGE;
+    }
+    //lastname
+    if (!strcmp(name, "lastname")) {
+        if (count == 2 || count == 3) {
+            return list_names(model, out, err, words[1], false,
+                count == 3 ? words[2] : NULL);
+        }
+        fprintf(err,
+            "error: lastname command usage: last-name [after-handle]\n");
+        return AMICI_EUSAGE;
+    }
+    //stats
+    if (!strcmp(name, "stats")) {
+        if (count != 1) {
+            fprintf(err,
+                "error: stats command usage: No arguments must be given\n");
+            return AMICI_EUSAGE;
+        }
+        write_stats(out, model->count, model->friendships);
+        return AMICI_OK;
+    }
+    //init
+    if (!strcmp(name, "init")) {
+        char *end = NULL;
+        long expected = count == 2 ? strtol(words[1], &end, 10) : 0;
+        if (count != 1 && (count != 2 || *end != '\0' || expected <= 0)) {
+            fprintf(err, "error: init command usage: [expected-users]\n");
+            return AMICI_EUSAGE;
+        }
+        for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+            if (model->views[i].open) {
+                fprintf(err, "error: release all snapshots before init\n");
+                return AMICI_EBUSY;
+            }
+        }
+        clear_model(model);
+        fprintf(out, "system re-initialized");
+        return AMICI_OK;
+    }
+    //reach, over one hop; the model is not asked about more
+    if (!strcmp(name, "reach")) {
+        char *end = NULL;
+        long hops = count == 3 ? strtol(words[2], &end, 10) : 0;
+        if (count != 3 || *end != '\0' || hops < 1 || hops > GRAPH_MAX_HOPS) {
+            fprintf(err, "error: reach command usage: handle hops "
+                "(1 to %d)\n", GRAPH_MAX_HOPS);
+            return AMICI_EUSAGE;
+        }
+        if (views_full(model)) {
+            fprintf(err, "error: all %d snapshots are open\n",
+                MAX_SNAPSHOTS);
+            return AMICI_EBUSY;
+        }
+        int i = find_user(model, words[1], model->count);
+        if (i < 0) {
+            fprintf(err, "error: '%s' is not a known handle\n", words[1]);
+            return AMICI_EUNKNOWN;
+        }
+        size_t friends = model->users[i].count;
+        fprintf(out, "%zu %s within 1 hop of ", friends,
+            friends == 1 ? "user is" : "users are");
+        write_user(out, &model->users[i]);
+        fprintf(out, "\n");
+        return AMICI_OK;
+    }
+    //snapshot
+    if (!strcmp(name, "snapshot")) {
+        if (count == 1) {
+            return open_view(model, out, err);
+        }
+        return query_view(model, out, err, &words[1], count - 1);
+    }
+    //release
+    if (!strcmp(name, "release")) {
+        if (count != 2) {
+            fprintf(err, "error: release command usage: snapshot-id\n");
+            return AMICI_EUSAGE;
+        }
+        view_t *view = find_view(model, words[1]);
+        if (view == NULL) {
+            fprintf(err, "error: '%s' is not an open snapshot\n", words[1]);
+            return AMICI_EUNKNOWN;
+        }
+        fprintf(out, "snapshot %ld released\n",
+            (long)(view - model->views));
+        close_view(view);
+        return AMICI_OK;
+    }
+    //batch; a well formed batch never reaches execute_command
+    if (!strcmp(name, "batch")) {
+        fprintf(err, "error: batch command usage: count (1 to %d)\n",
+            MAX_BATCH);
+        return AMICI_EUSAGE;
+    }
+    //quit is only reported
+    if (!strcmp(name, "quit")) {
+        if (count == 1) {
+            return AMICI_QUIT;
+        }
+        fprintf(err,
+            "error: quit command usage: No arguments must be given\n");
+        return AMICI_EUSAGE;
+    }
+    //anything else is ignored
+    return AMICI_ECOMMAND;
+}
+
+/// Check whether the model can say what a command does.
+///
+/// @param words the words of the command line
+/// @param count number of words
+/// @return false for the commands that are not run, and for an init
+///    expecting too many users
+static bool modelled(char **words, int count) {
+    if (count == 0) {
+        return true;
+    }
+    const char *name = words[0];
+    if (!strcmp(name, "export") || !strcmp(name, "load") ||
+        !strcmp(name, "metrics") || !strcmp(name, "diag") ||
+        !strcmp(name, "distances")) {
+        return false;
+    }
+    if (!strcmp(name, "init") && count == 2) {
+        return strtol(words[1], NULL, 10) <= MAX_EXPECTED;
+    }
+    if (!strcmp(name, "reach") && count == 3) {
+        char *end;
+        long hops = strtol(words[2], &end, 10);
+        return *end != '\0' || hops <= 1 || hops > GRAPH_MAX_HOPS;
+    }
+    return true;
+}
+
+/// Split a command line into words, as amici's parser does.
+///
+/// @param line the line, which is modified
+/// @param words receives the first MAX_WORDS words
+/// @return the number of words, counting those past MAX_WORDS
+static int split_words(char *line, char **words) {
+    char *save;
+    int count = 0;
+    for (char *word = strtok_r(line, " \n", &save); word != NULL;
+        word = strtok_r(NULL, " \n", &save)) {
+        if (count < MAX_WORDS) {
+            words[count] = word;
+        }
+        count++;
+    }
+    return count;
+}
+
+/// Start collecting what a command writes.
+///
+/// @param result receives the streams
+static void begin_result(result_t *result) {
+    result->out_file = open_memstream(&result->out, &result->out_length);
+    result->err_file = open_memstream(&result->err, &result->err_length);
+    if (result->out_file == NULL || result->err_file == NULL) {
+        fail("out of memory");
+    }
+}
+
+/// Finish collecting what a command wrote.
+///
+/// @param result the streams, and what they collected
+static void end_result(result_t *result) {
+    if (fclose(result->out_file) != 0 || fclose(result->err_file) != 0) {
+        fail("out of memory");
+    }
+}
+
+/// Check whether two commands wrote the same and gave the same status.
+///
+/// @param a a result
+/// @param b a result
+/// @return true if they are the same
+static bool same_result(const result_t *a, const result_t *b) {
+    return a->status == b->status && a->out_length == b->out_length &&
+        a->err_length == b->err_length &&
+        !memcmp(a->out, b->out, a->out_length) &&
+        !memcmp(a->err, b->err, a->err_length);
+}
+
+/// Run a command line through amici and through the model, and abort if
+/// they differ.
+///
+/// @param model the model
+/// @param line the command line, ending with a newline
+/// @param number the line's number, for the report
+static void check_line(model_t *model, const char *line, size_t number) {
+    char copy[BUFFER_SIZE];
+    char *words[MAX_WORDS];
+    strcpy(copy, line);
+    int count = split_words(copy, words);
+    if (!modelled(words, count)) {
+        return;
+    }
+
+    result_t real;
+    result_t expected;
+    char command[BUFFER_SIZE];
+    strcpy(command, line);
+    begin_result(&real);
+    real.status = execute_command(command, real.out_file, real.err_file);
+    end_result(&real);
+    if (real.status == AMICI_ENOMEM) {
+        // the model has memory enough, and amici made no change; this is
+        // no difference of behaviour, but the run cannot go on
+        fail("amici ran out of memory");
+    }
+    begin_result(&expected);
+    expected.status = run_model(model, words, count, expected.out_file,
+        expected.err_file);
+    end_result(&expected);
+
+    if (!same_result(&real, &expected)) {
+        fprintf(stderr, "fuzz_amici: line %zu differs from the model: %s"
+            "--- amici, status %d:\n%s%s\n--- model, status %d:\n%s%s\n",
+            number, line, real.status, real.out, real.err,
+            expected.status, expected.out, expected.err);
+        abort();
+    }
+    free(real.out);
+    free(real.err);
+    free(expected.out);
+    free(expected.err);
+}
+
+/// Run a command line through amici, keeping only what it wrote to out.
+///
+/// @param line the command line
+/// @param result receives the status and the output, which the caller
+///    frees
+/// @return the command's status
+static status_t run_quietly(const char *line, result_t *result) {
+    char command[BUFFER_SIZE];
+    strcpy(command, line);
+    begin_result(result);
+    result->status = execute_command(command, result->out_file,
+        result->err_file);
+    end_result(result);
+    free(result->err);
+    return result->status;
+}
+
+/// Empty the network and the model: release every snapshot, init, and
+/// learn the epoch the network is at, which init leaves as it was.
+///
+/// @param model the model
+static void reset(model_t *model) {
+    char line[BUFFER_SIZE];
+    result_t result;
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        snprintf(line, sizeof(line), "release %d\n", i);
+        run_quietly(line, &result);
+        free(result.out);
+    }
+    status_t status = run_quietly("init\n", &result);
+    free(result.out);
+    unsigned long epoch;
+    int id;
+    if (status != AMICI_OK ||
+        run_quietly("snapshot\n", &result) != AMICI_OK ||
+        sscanf(result.out, "snapshot %d opened at epoch %lu", &id,
+        &epoch) != 2) {
+        fail("cannot reset the network");
+    }
+    free(result.out);
+    snprintf(line, sizeof(line), "release %d\n", id);
+    run_quietly(line, &result);
+    free(result.out);
+    clear_model(model);
+    model->epoch = epoch;
+}
+
+/// Run every line of a stream of command lines. Lines too long for amici
+/// to read whole are left out.
+///
+/// @param model the model
+/// @param data the lines
+/// @param size their length in bytes
+static void replay(model_t *model, const char *data, size_t size) {
+    const char *end = data + size;
+    size_t number = 0;
+    while (data < end) {
+        const char *eol = memchr(data, '\n', end - data);
+        size_t length = (eol != NULL ? eol : end) - data;
+        number++;
+        if (length < BUFFER_SIZE - 1) {
+            char line[BUFFER_SIZE];
+            memcpy(line, data, length);
+            line[length] = '\n';
+            line[length + 1] = '\0';
+            check_line(model, line, number);
+        }
+        data += length + (eol != NULL);
+    }
+}
+
+#ifdef AMICI_LIBFUZZER
+
+/// Run one input of the fuzzer, with Bloom filters, from an empty network.
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static model_t model;
+    static bool started = false;
+    if (!started) {
+        bloom_enabled = true;
+        init_table();
+        started = true;
+    }
+    reset(&model);
+    replay(&model, (const char *)data, size);
+    return 0;
+}
+
+#else
+
+/// A random stream of command lines.
+typedef struct stream_s {
+    uint64_t state;             ///< state of the xorshift64* generator
+    char tag[16];               ///< starts every handle and last name
+    bool own;                   ///< only commands about the stream's users
+} stream_t;
+
+/// One thread of -t, with its own users and model.
+typedef struct worker_s {
+    pthread_t thread;           ///< the thread
+    model_t model;              ///< the model of the thread's users
+    stream_t stream;            ///< the thread's command lines
+    size_t lines;               ///< number of lines to run
+} worker_t;
+
+/// Names random users are given, and starts of last names searched for.
+/// Several last names start alike, so searches match many users.
+static const char *first_names[] = { "John", "Edith", "Mr", "Ann", "Zoe" };
+static const char *last_names[] = {
+    "Smith", "Smithers", "Smyth", "Ed", "Jones", "Nowak"
+};
+static const char *prefixes[] = { "S", "Sm", "Smith", "E", "Jo", "X" };
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/// Empty the model and free everything it holds.
+///
+/// @param model the model
+static void free_model(model_t *model) {
+    clear_model(model);
+    free(model->users);
+    model->users = NULL;
+    model->capacity = 0;
+}
+
+/// Return the next number of a stream's generator.
+///
+/// @param stream the stream
+/// @return the number
+static uint64_t next_random(stream_t *stream) {
+    stream->state ^= stream->state >> 12;
+    stream->state ^= stream->state << 25;
+    stream->state ^= stream->state >> 27;
+    return stream->state * 0x2545F4914F6CDD1DULL;
+}
+
+/// Pick a number below a bound.
+///
+/// @param stream the stream
+/// @param bound the bound
+/// @return the number
+static int pick(stream_t *stream, int bound) {
+    return next_random(stream) % bound;
+}
+
+/// Write one of a stream's handles. Every seventh is too long to be kept
+/// in a person's record.
+///
+/// @param stream the stream
+/// @param buffer receives the handle
+/// @param size room in buffer
+static void random_handle(stream_t *stream, char *buffer, size_t size) {
+    // most friendships are with a few users
+    int i = pick(stream, 3) == 0 ? pick(stream, HUBS) :
+        pick(stream, POOL_SIZE);
+    if (i % 7 == 6) {
+        snprintf(buffer, size, "%shandle_too_long_for_the_record_%d",
+            stream->tag, i);
+    }
+    else {
+        snprintf(buffer, size, "%su%d", stream->tag, i);
+    }
+}
+
+/// Write a random command line. A stream that keeps to its own users
+/// leaves out the commands about the whole network.
+///
+/// @param stream the stream
+/// @param model the model, which says which snapshots are open
+/// @param line receives the line
+static void random_line(stream_t *stream, const model_t *model,
+    char *line) {
+    char h1[64];
+    char h2[64];
+    random_handle(stream, h1, sizeof(h1));
+    random_handle(stream, h2, sizeof(h2));
+    const char *tag = stream->tag;
+    int r = pick(stream, 100);
+    if (stream->own && r >= 80 && r < 91) {
+        r = 60;
+    }
+
+    if (r < 15) {
+        sprintf(line, "add %s %s%s %s\n",
+            first_names[pick(stream, COUNT(first_names))], tag,
+            last_names[pick(stream, COUNT(last_names))], h1);
+    }
+    else if (r < 45) {
+        sprintf(line, "friend %s %s\n", h1, h2);
+    }
+    else if (r < 57) {
+        sprintf(line, "unfriend %s %s\n", h1, h2);
+    }
+    else if (r < 67) {
+        sprintf(line, "print %s\n", h1);
+    }
+    else if (r < 72) {
+        sprintf(line, "size %s\n", h1);
+    }
+    else if (r < 75) {
+        sprintf(line, "find %s%s%s%s\n", tag,
+            prefixes[pick(stream, COUNT(prefixes))],
+            pick(stream, 2) ? " " : "", pick(stream, 2) ? h1 : "");
+    }
+    else if (r < 78) {
+        sprintf(line, "lastname %s%s%s%s\n", tag,
+            last_names[pick(stream, COUNT(last_names))],
+            pick(stream, 2) ? " " : "", pick(stream, 2) ? h1 : "");
+    }
+    else if (r < 80) {
+        sprintf(line, "reach %s %d\n", h1, pick(stream, 8) ? 1 : 0);
+    }
+    else if (r < 82) {
+        sprintf(line, "stats\n");
+    }
+    else if (r < 84) {
+        sprintf(line, "snapshot\n");
+    }
+    else if (r < 87) {
+        static const char *queries[] = { "print", "size", "stats" };
+        const char *query = queries[pick(stream, COUNT(queries))];
+        sprintf(line, "snapshot %d %s %s\n", pick(stream, 6), query,
+            strcmp(query, "stats") ? h1 : "");
+    }
+    else if (r < 91) {
+        // mostly a snapshot the model has open, so init is not always busy
+        int id = pick(stream, MAX_SNAPSHOTS);
+        bool open_one = pick(stream, 4) != 0;
+        for (int i = 0; open_one && i < MAX_SNAPSHOTS; i++) {
+            if (model->views[(id + i) % MAX_SNAPSHOTS].open) {
+                id = (id + i) % MAX_SNAPSHOTS;
+                break;
+            }
+        }
+        sprintf(line, "release %d\n", id);
+    }
+    else if (r < 96) {
+        static const char *wrong[] = {
+            "add John Smith", "friend", "unfriend a b c", "print", "size a b",
+            "find", "lastname a b c", "stats now", "reach", "reach a x",
+            "init 0", "init x", "release", "snapshot x stats", "batch 0",
+            "quit now", "nonsense command is ignored", "", "   "
+        };
+        sprintf(line, "%s\n", wrong[pick(stream, COUNT(wrong))]);
+    }
+    else if (!stream->own && pick(stream, 40) == 0) {
+        sprintf(line, pick(stream, 2) ? "init\n" : "init 500\n");
+    }
+    else {
+        sprintf(line, "friend %s %s\n", h2, h1);
+    }
+}
+
+/// Run a random stream of command lines.
+///
+/// @param model the model
+/// @param stream the stream
+/// @param lines number of lines
+static void run_stream(model_t *model, stream_t *stream, size_t lines) {
+    char line[BUFFER_SIZE];
+    for (size_t i = 1; i <= lines; i++) {
+        random_line(stream, model, line);
+        check_line(model, line, i);
+    }
+}
+
+/// Run a worker's stream.
+///
+/// @param arg the worker
+/// @return NULL
+static void *run_worker(void *arg) {
+    worker_t *worker = arg;
+    run_stream(&worker->model, &worker->stream, worker->lines);
+    return NULL;
+}
+
+/// Set once the workers of -t have run their streams.
+static atomic_bool workers_done;
+
+/// Open, query and release snapshots of the workers' users until the
+/// workers are done. What a query writes depends on when it ran, so only
+/// its status is checked; the sanitizers check that a query never reads
+/// a version freed under it, when its snapshot is released meanwhile.
+///
+/// @param arg the stream the thread picks its commands from
+/// @return NULL
+static void *run_snapshots(void *arg) {
+    stream_t *stream = arg;
+    char line[BUFFER_SIZE];
+    result_t result;
+    while (!atomic_load(&workers_done)) {
+        int id = pick(stream, RACED_SNAPSHOTS);
+        int r = pick(stream, 9);
+        if (r == 0) {
+            snprintf(line, sizeof(line), "snapshot\n");
+        }
+        else if (r == 1) {
+            snprintf(line, sizeof(line), "release %d\n", id);
+        }
+        else if (r == 2) {
+            snprintf(line, sizeof(line), "snapshot %d stats\n", id);
+        }
+        else if (r == 8) {
+            // estimates, refreshed in the background as the workers go on
+            snprintf(line, sizeof(line), "reach T%du%d %d\n",
+                pick(stream, MAX_THREADS), pick(stream, HUBS),
+                2 + pick(stream, GRAPH_MAX_HOPS - 1));
+        }
+        else {
+            // the hubs, whose versions change most often
+            snprintf(line, sizeof(line), "snapshot %d %s T%du%d\n", id,
+                r % 2 ? "print" : "size", pick(stream, MAX_THREADS),
+                pick(stream, HUBS));
+        }
+        status_t status = run_quietly(line, &result);
+        if (status != AMICI_OK && status != AMICI_EUNKNOWN &&
+            status != AMICI_EBUSY) {
+            fprintf(stderr, "fuzz_amici: %sgave status %d\n", line, status);
+            abort();
+        }
+        int opened;
+        if (r == 0 && status == AMICI_OK &&
+            sscanf(result.out, "snapshot %d", &opened) == 1 &&
+            opened >= RACED_SNAPSHOTS) {
+            // the workers' reach commands hold the lower slots for now
+            snprintf(line, sizeof(line), "release %d\n", opened);
+            free(result.out);
+            run_quietly(line, &result);
+        }
+        free(result.out);
+    }
+    return NULL;
+}
+
+/// Run several streams at once, each about its own users, and check that
+/// the network holds what all of them did together.
+///
+/// @param threads number of streams
+/// @param seed seed of the first stream
+/// @param lines number of lines of each stream
+static void run_threads(int threads, uint64_t seed, size_t lines) {
+    static worker_t workers[MAX_THREADS];
+    stream_t racers[2];
+    pthread_t racer_threads[2];
+    model_t model = { 0 };
+    reset(&model);
+    atomic_store(&workers_done, false);
+    for (int i = 0; i < 2; i++) {
+        racers[i].state = seed + MAX_THREADS + i;
+        if (pthread_create(&racer_threads[i], NULL, run_snapshots,
+            &racers[i])) {
+            fail("cannot start a thread");
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        worker_t *worker = &workers[i];
+        worker->stream.state = seed + i ? seed + i : 1;
+        snprintf(worker->stream.tag, sizeof(worker->stream.tag), "T%d", i);
+        worker->stream.own = true;
+        worker->lines = lines;
+        worker->model.epoch = model.epoch;
+        if (pthread_create(&worker->thread, NULL, run_worker, worker)) {
+            fail("cannot start a thread");
+        }
+    }
+    size_t people = 0;
+    size_t friendships = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        people += workers[i].model.count;
+        friendships += workers[i].model.friendships;
+        free_model(&workers[i].model);
+    }
+    atomic_store(&workers_done, true);
+    for (int i = 0; i < 2; i++) {
+        pthread_join(racer_threads[i], NULL);
+    }
+
+    result_t real;
+    result_t expected;
+    run_quietly("stats\n", &real);
+    begin_result(&expected);
+    write_stats(expected.out_file, people, friendships);
+    end_result(&expected);
+    if (real.status != AMICI_OK || strcmp(real.out, expected.out)) {
+        fprintf(stderr, "fuzz_amici: the threads together made\n%s"
+            "not\n%s", real.out, expected.out);
+        abort();
+    }
+    free(real.out);
+    free(expected.out);
+    free(expected.err);
+}
+
+/// Read a whole file.
+///
+/// @param path the file
+/// @param size receives its length
+/// @return its contents, or NULL if it cannot be read
+static char *read_file(const char *path, size_t *size) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return NULL;
+    }
+    char *data = NULL;
+    size_t capacity = 0;
+    *size = 0;
+    for (;;) {
+        if (*size == capacity) {
+            data = grow(data, &capacity, 1);
+        }
+        size_t got = fread(data + *size, 1, capacity - *size, in);
+        if (got == 0) {
+            break;
+        }
+        *size += got;
+    }
+    bool ok = !ferror(in);
+    fclose(in);
+    if (!ok) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t seed = 1;
+    size_t lines = 20000;
+    int runs = 10;
+    int threads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:r:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            lines = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s seed] [-n lines] [-r runs] "
+                "[-t threads] [file...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (threads < 0 || threads > MAX_THREADS) {
+        fprintf(stderr, "threads must be from 0 to %d\n", MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+
+    init_table();
+    model_t model = { 0 };
+    int status = EXIT_SUCCESS;
+    if (optind < argc) {
+        for (int i = optind; i < argc && status == EXIT_SUCCESS; i++) {
+            size_t size;
+            char *data = read_file(argv[i], &size);
+            if (data == NULL) {
+                fprintf(stderr, "error: cannot read '%s'\n", argv[i]);
+                status = EXIT_FAILURE;
+                continue;
+            }
+            reset(&model);
+            replay(&model, data, size);
+            printf("%s: same as the model\n", argv[i]);
+            free(data);
+        }
+    }
+    else {
+        for (int run = 0; run < runs; run++) {
+            bloom_enabled = run % 2 == 1;
+            if (threads > 0) {
+                run_threads(threads, seed + run * MAX_THREADS, lines);
+            }
+            else {
+                stream_t stream = { seed + run ? seed + run : 1, "", false };
+                reset(&model);
+                run_stream(&model, &stream, lines);
+            }
+            printf("seed %lu%s: same as the model\n",
+                (unsigned long)(seed + run),
+                bloom_enabled ? ", with Bloom filters" : "");
+        }
+    }
+    free_model(&model);
+    quit();
+    return status;
+}
+
+#endif // AMICI_LIBFUZZER
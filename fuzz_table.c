@@ -0,0 +1,353 @@
+/// \file fuzz_table.c
+/// \brief A fuzz and differential test of the hash table.
+/// A stream of operations is run against a Table with C-string keys, as
+/// amici uses it, and against a reference model: an unsorted array of keys
+/// and values searched one by one. After every operation ht_has and ht_get
+/// must agree with the model, and ht_put must return the value the model
+/// replaced; ht_keys and ht_values must hold exactly the model's entries.
+/// Keys are looked up through fresh copies, so the table must compare them
+/// by content, and are drawn from a small alphabet, so many share a prefix
+/// and enough are added to make the table grow several times.
+///
+/// Run alone it tests seeded random streams, or replays the files named on
+/// the command line. Built with -DAMICI_LIBFUZZER it is instead a libFuzzer
+/// target, whose input is the stream:
+///
+///     clang -g -O1 -fsanitize=fuzzer,address,undefined -DAMICI_LIBFUZZER
+///         fuzz_table.c table.c hash.c -o fuzz_table
+///
+/// A stream is a sequence of operations. Each is a byte choosing the
+/// operation, and for all but a full check a byte giving the key's length
+/// followed by the key's bytes; a key ends early at a NUL byte.
+///
+/// Usage: fuzz_table [-s seed] [-n operations] [-r runs] [file...]
+///
+/// @author Ryan Nowak rcn8263
+
+#define _DEFAULT_SOURCE  // getopt, strdup
+
+#include <stdint.h>  // uint8_t, uint64_t, uintptr_t
+#include <stdio.h>   // printf, fprintf, fopen, fread
+#include <stdlib.h>  // malloc, realloc, free, qsort, abort, EXIT_SUCCESS
+#include <string.h>  // memcpy, strcmp, strdup
+#include <stdbool.h> // bool
+#include <unistd.h>  // getopt
+#include "hash.h"    // str_hash, str_equals, str_long_print
+#include "table.h"   // ht_create, ht_destroy, ht_get, ht_has, ht_keys,
+                     // ht_put, ht_values
+
+/// Longest key a stream can give, not counting its NUL.
+#define MAX_KEY 15
+
+/// The operations of a stream, chosen by a byte modulo OPS.
+enum { OP_PUT, OP_GET, OP_HAS, OP_CHECK, OPS };
+
+/// The reference model: every key put so far, and its value.
+typedef struct {
+    char** keys;
+    uintptr_t* values;
+    size_t count;
+    size_t capacity;
+} model_t;
+
+/// Every key given to the table. Which copy of a key the table keeps when
+/// its value is replaced is up to the table, so all are freed at the end.
+static char** given;
+static size_t given_count;
+static size_t given_capacity;
+
+/// fail reports a difference between the table and the model, and aborts
+/// so a fuzzer records the input.
+/// @param what what differed
+/// @param key the key involved, or NULL
+/// @param step number of the operation, from 0
+static void fail( const char* what, const char* key, size_t step ) {
+    fprintf( stderr, "fuzz_table: %s at operation %zu", what, step);
+    if (key != NULL) {
+        fprintf( stderr, ", key '%s'", key);
+    }
+    fprintf( stderr, "\n");
+    abort();
+}
+
+/// model_find returns the place of a key in the model, or -1.
+/// @param model the model
+/// @param key the key
+static long model_find( const model_t* model, const char* key ) {
+    for (size_t i=0; i<model->count; ++i) {
+        if (strcmp( model->keys[i], key) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/// compare_strings orders C-string pointers for qsort.
+static int compare_strings( const void* a, const void* b ) {
+    return strcmp( *(char* const*)a, *(char* const*)b);
+}
+
+/// compare_values orders values for qsort.
+static int compare_values( const void* a, const void* b ) {
+    uintptr_t x = *(const uintptr_t*)a;
+    uintptr_t y = *(const uintptr_t*)b;
+    return (x > y) - (x < y);
+}
+
+/// check_all compares the table's keys and values with the model's.
+/// @param t the table
+/// @param model the model
+/// @param step number of the operation, from 0
+static void check_all( const Table t, const model_t* model, size_t step ) {
+    size_t n = model->count;
+    char** keys = (char**)ht_keys( t);
+    void** values = ht_values( t);
+    char** expected = malloc( (n + 1) * sizeof(char*));
+    uintptr_t* found = malloc( (n + 1) * sizeof(uintptr_t));
+    uintptr_t* wanted = malloc( (n + 1) * sizeof(uintptr_t));
+    if ((n > 0 && (keys == NULL || values == NULL)) || expected == NULL ||
+        found == NULL || wanted == NULL) {
+        fail( "out of memory", NULL, step);
+    }
+    if (n > 0) {
+        memcpy( expected, model->keys, n * sizeof(char*));
+        qsort( expected, n, sizeof(char*), compare_strings);
+        qsort( keys, n, sizeof(char*), compare_strings);
+        for (size_t i=0; i<n; ++i) {
+            if (strcmp( keys[i], expected[i]) != 0) {
+                fail( "ht_keys differs from the model", expected[i], step);
+            }
+            found[i] = (uintptr_t)values[i];
+        }
+        memcpy( wanted, model->values, n * sizeof(uintptr_t));
+        qsort( found, n, sizeof(uintptr_t), compare_values);
+        qsort( wanted, n, sizeof(uintptr_t), compare_values);
+        if (memcmp( found, wanted, n * sizeof(uintptr_t)) != 0) {
+            fail( "ht_values differs from the model", NULL, step);
+        }
+    }
+    free( keys);
+    free( values);
+    free( expected);
+    free( found);
+    free( wanted);
+}
+
+/// run_stream runs a stream of operations against a new table and a new
+/// model, aborting at the first difference.
+/// @param data the stream
+/// @param size its length in bytes
+/// @return the number of keys in the table at the end
+static size_t run_stream( const uint8_t* data, size_t size ) {
+    Table t = ht_create( str_hash, str_equals, str_long_print, NULL);
+    model_t model = { NULL, NULL, 0, 0 };
+    uintptr_t serial = 0;
+    size_t step = 0;
+    size_t i = 0;
+    while (i < size) {
+        int op = data[i++] % OPS;
+        if (op == OP_CHECK) {
+            check_all( t, &model, step++);
+            continue;
+        }
+        size_t length = i < size ? data[i++] % (MAX_KEY + 1) : 0;
+        length = length < size - i ? length : size - i;
+        char key[MAX_KEY + 1];
+        memcpy( key, data + i, length);
+        key[length] = '\0';
+        i += length;
+
+        long at = model_find( &model, key);
+        if (op == OP_PUT) {
+            char* copy = strdup( key);
+            if (given_count == given_capacity) {
+                given_capacity = given_capacity ? 2 * given_capacity : 64;
+                given = realloc( given, given_capacity * sizeof(char*));
+            }
+            if (at < 0 && model.count == model.capacity) {
+                model.capacity = model.capacity ? 2 * model.capacity : 64;
+                model.keys = realloc( model.keys
+                                    , model.capacity * sizeof(char*));
+                model.values = realloc( model.values
+                                      , model.capacity * sizeof(uintptr_t));
+            }
+            if (copy == NULL || given == NULL || model.keys == NULL ||
+                model.values == NULL) {
+                fail( "out of memory", key, step);
+            }
+            given[given_count++] = copy;
+            // values are never dereferenced, so any non-NULL number will do
+            uintptr_t value = ++serial;
+            void* old = ht_put( t, copy, (void*)value);
+            if (at < 0) {
+                if (old != NULL) {
+                    fail( "ht_put replaced a value of a new key", key, step);
+                }
+                model.keys[model.count] = copy;
+                model.values[model.count++] = value;
+            }
+            else {
+                if ((uintptr_t)old != model.values[at]) {
+                    fail( "ht_put returned the wrong old value", key, step);
+                }
+                model.values[at] = value;
+            }
+        }
+        else if (op == OP_HAS || at < 0) {
+            // ht_get asserts on a missing key, so only ht_has asks for one
+            if (ht_has( t, key) != (at >= 0)) {
+                fail( "ht_has differs from the model", key, step);
+            }
+        }
+        else {
+            if ((uintptr_t)ht_get( t, key) != model.values[at]) {
+                fail( "ht_get differs from the model", key, step);
+            }
+        }
+        step++;
+    }
+    check_all( t, &model, step);
+
+    ht_destroy( t);
+    for (size_t k=0; k<given_count; ++k) {
+        free( given[k]);
+    }
+    given_count = 0;
+    free( model.keys);
+    free( model.values);
+    return model.count;
+}
+
+#ifdef AMICI_LIBFUZZER
+
+/// LLVMFuzzerTestOneInput runs one input of the fuzzer as a stream.
+int LLVMFuzzerTestOneInput( const uint8_t* data, size_t size ) {
+    run_stream( data, size);
+    return 0;
+}
+
+#else
+
+/// Letters random keys are made of; few enough that keys repeat often.
+static const char alphabet[] = "abcd";
+
+/// State of the xorshift64* generator; fixed by the seed for repeatability.
+static uint64_t rng_state;
+
+/// next_random returns the next 64-bit value of the generator.
+static uint64_t next_random( void ) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/// random_stream makes a stream of random operations, mostly puts and
+/// lookups, with a full check now and then.
+/// @param n number of operations
+/// @param size receives the length of the stream
+/// @return the stream, or NULL if there is no memory for it
+static uint8_t* random_stream( size_t n, size_t* size ) {
+    uint8_t* data = malloc( n * (MAX_KEY + 2));
+    size_t i = 0;
+    for (size_t k=0; data != NULL && k<n; ++k) {
+        uint64_t r = next_random();
+        int op = r % 256 == 0 ? OP_CHECK : (r >> 8) % 3;
+        data[i++] = op;
+        if (op == OP_CHECK) {
+            continue;
+        }
+        // short keys mostly, so the same ones come back
+        size_t length = (r >> 16) % 4 == 0 ? (r >> 24) % (MAX_KEY + 1) :
+                        1 + (r >> 24) % 6;
+        data[i++] = length;
+        for (size_t c=0; c<length; ++c) {
+            data[i++] = alphabet[next_random() % (sizeof(alphabet) - 1)];
+        }
+    }
+    *size = i;
+    return data;
+}
+
+/// replay_file runs the stream held in a file.
+/// @param path the file
+/// @return false if the file cannot be read
+static bool replay_file( const char* path ) {
+    FILE* in = fopen( path, "rb");
+    if (in == NULL) {
+        return false;
+    }
+    uint8_t* data = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    for (;;) {
+        if (size == capacity) {
+            capacity = capacity ? 2 * capacity : 4096;
+            uint8_t* grown = realloc( data, capacity);
+            if (grown == NULL) {
+                break;
+            }
+            data = grown;
+        }
+        size_t got = fread( data + size, 1, capacity - size, in);
+        if (got == 0) {
+            break;
+        }
+        size += got;
+    }
+    bool ok = !ferror( in) && (size == 0 || data != NULL);
+    fclose( in);
+    if (ok) {
+        printf( "%s: %zu keys\n", path, run_stream( data, size));
+    }
+    free( data);
+    return ok;
+}
+
+/// Test seeded random streams, or replay the streams held in files.
+/// @param argc command line argument count
+/// @param argv command line arguments
+/// @return EXIT_SUCCESS, or EXIT_FAILURE for bad arguments
+int main( int argc, char* argv[] ) {
+    size_t n = 20000;
+    int runs = 10;
+    uint64_t seed = 1;
+    int opt;
+    while ((opt = getopt( argc, argv, "n:s:r:")) != -1) {
+        switch (opt) {
+        case 'n': n = strtoul( optarg, NULL, 10); break;
+        case 's': seed = strtoul( optarg, NULL, 10); break;
+        case 'r': runs = atoi( optarg); break;
+        default:
+            fprintf( stderr, "usage: %s [-s seed] [-n operations] [-r runs]"
+                     " [file...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc) {
+        for (int i=optind; i<argc; ++i) {
+            if (!replay_file( argv[i])) {
+                fprintf( stderr, "ERROR: cannot read '%s'.\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        return EXIT_SUCCESS;
+    }
+
+    for (int run=0; run<runs; ++run) {
+        rng_state = seed + run ? seed + run : 1;
+        size_t size;
+        uint8_t* data = random_stream( n, &size);
+        if (data == NULL) {
+            fprintf( stderr, "ERROR: out of memory.\n");
+            return EXIT_FAILURE;
+        }
+        printf( "seed %lu: %zu keys\n", (unsigned long)(seed + run)
+              , run_stream( data, size));
+        free( data);
+    }
+    return EXIT_SUCCESS;
+}
+
+#endif // AMICI_LIBFUZZER
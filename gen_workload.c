@@ -0,0 +1,157 @@
+//
+// file: gen_workload.c
+//
+// Reproducible workload generator for amici. Writes a command stream in
+// the File-input format: an add for every user, then friend commands whose
+// endpoints follow a power-law degree distribution (Chung-Lu: each user
+// has a weight falling off as rank^(-1/(exponent-1)), and both ends of an
+// edge are drawn in proportion to weight), then a mix of print, size,
+// friend and unfriend commands aimed the same way, and a closing stats.
+// The same arguments always produce the same stream.
+//
+// usage: gen_workload [-u users] [-d mean-degree] [-x exponent]
+//                     [-p operations] [-s seed]
+//
+// @author Ryan Nowak rcn8263
+//
+
+#define _DEFAULT_SOURCE  // getopt
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/// First and last names are drawn from these; only handles are unique.
+static const char *first_names[] = {
+    "Ada", "Alan", "Barbara", "Dennis", "Edsger", "Frances", "Grace",
+    "John", "Ken", "Margaret", "Niklaus", "Radia", "Tony", "Whitfield"
+};
+static const char *last_names[] = {
+    "Allen", "Backus", "Dijkstra", "Hamilton", "Hoare", "Hopper", "Kay",
+    "Knuth", "Liskov", "Lovelace", "Perlman", "Ritchie", "Thompson", "Wirth"
+};
+
+#define NAMES(a) (sizeof(a) / sizeof(a[0]))
+
+/// State of the xorshift64* generator.
+static uint64_t rng_state;
+
+/// Return the next 64-bit value of the generator.
+static uint64_t next_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/// Return a uniform value in [0, 1).
+static double next_unit(void) {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/// Cumulative user weights, for drawing users in proportion to weight.
+static double *cumulative;
+static size_t users;
+
+/// Draw a user index in proportion to its weight.
+static size_t draw_user(void) {
+    double u = next_unit() * cumulative[users - 1];
+    size_t lo = 0;
+    size_t hi = users - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cumulative[mid] <= u) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/// Draw two different users for a friend or unfriend command.
+///
+/// @param a receives the first user
+/// @param b receives the second user
+static void draw_pair(size_t *a, size_t *b) {
+    *a = draw_user();
+    do {
+        *b = draw_user();
+    }
+    while (*b == *a);
+}
+
+int main(int argc, char *argv[]) {
+    size_t ops = 0;
+    double degree = 10;
+    double exponent = 2.5;
+    uint64_t seed = 1;
+    int opt;
+    users = 1000;
+    while ((opt = getopt(argc, argv, "u:d:x:p:s:")) != -1) {
+        switch (opt) {
+        case 'u': users = strtoul(optarg, NULL, 10); break;
+        case 'd': degree = atof(optarg); break;
+        case 'x': exponent = atof(optarg); break;
+        case 'p': ops = strtoul(optarg, NULL, 10); break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-u users] [-d mean-degree] "
+                "[-x exponent] [-p operations] [-s seed]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (users < 2 || degree < 0 || exponent <= 1) {
+        fprintf(stderr, "error: need users >= 2, mean-degree >= 0 and "
+            "exponent > 1\n");
+        return EXIT_FAILURE;
+    }
+    cumulative = malloc(users * sizeof(double));
+    if (cumulative == NULL) {
+        fprintf(stderr, "error: no memory for %zu users\n", users);
+        return EXIT_FAILURE;
+    }
+    rng_state = seed ? seed : 1;
+
+    double total = 0;
+    for (size_t i = 0; i < users; i++) {
+        total += pow((double)(i + 1), -1.0 / (exponent - 1));
+        cumulative[i] = total;
+    }
+
+    for (size_t i = 0; i < users; i++) {
+        printf("add %s %s u%zu\n", first_names[next_random() % NAMES(first_names)],
+            last_names[next_random() % NAMES(last_names)], i);
+    }
+
+    // repeats of a pair are kept: they exercise the already-friends path
+    size_t edges = (size_t)(users * degree / 2);
+    for (size_t i = 0; i < edges; i++) {
+        size_t a, b;
+        draw_pair(&a, &b);
+        printf("friend u%zu u%zu\n", a, b);
+    }
+
+    // 70% print, 10% size, 15% friend and 5% unfriend
+    for (size_t i = 0; i < ops; i++) {
+        double u = next_unit();
+        size_t a, b;
+        if (u < 0.70) {
+            printf("print u%zu\n", draw_user());
+        }
+        else if (u < 0.80) {
+            printf("size u%zu\n", draw_user());
+        }
+        else {
+            draw_pair(&a, &b);
+            printf("%s u%zu u%zu\n", u < 0.95 ? "friend" : "unfriend", a, b);
+        }
+    }
+    printf("stats\n");
+
+    free(cumulative);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,397 @@
+//
+// file: graph.c
+//
+// HyperANF and sampled breadth-first search over the compact graph. Both
+// split their work over up to GRAPH_THREADS threads: HyperANF gives each
+// thread a range of nodes with about as many edges as the others, and a
+// step ends when every thread has finished its range; the searches are
+// dealt out to threads that each keep their own distances.
+//
+// @author Ryan Nowak rcn8263
+//
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "graph.h"
+#include "metrics.h"
+
+/// Fewest nodes, or searches, worth a thread of their own.
+#define NODES_PER_THREAD 4096
+#define SEARCHES_PER_THREAD 4
+
+/// The HyperLogLog bias correction for HLL_REGISTERS registers.
+#define HLL_ALPHA 0.709
+
+/// Bits of a node's hash that pick its register.
+#define REGISTER_BITS 6
+
+/// 2^-k for every register value k, and m ln(m / V) for V registers still
+/// zero, made once before the first analysis.
+static double inverse_powers[64 + 2];
+static double linear_counts[HLL_REGISTERS + 1];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/// Fill the tables the estimates are made from.
+static void make_tables(void) {
+    double power = 1;
+    for (size_t k = 0; k < sizeof(inverse_powers) / sizeof(double); k++) {
+        inverse_powers[k] = power;
+        power /= 2;
+    }
+    for (int zeros = 1; zeros <= HLL_REGISTERS; zeros++) {
+        linear_counts[zeros] = HLL_REGISTERS *
+            log((double)HLL_REGISTERS / zeros);
+    }
+}
+
+/// The splitmix64 finalizer.
+static uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+/// Estimate the number of nodes a sketch holds. Small counts, where the
+/// raw estimate is biased, are made by linear counting instead.
+static float estimate(const uint8_t *sketch) {
+    double sum = 0;
+    int zeros = 0;
+    for (int r = 0; r < HLL_REGISTERS; r++) {
+        sum += inverse_powers[sketch[r]];
+        zeros += sketch[r] == 0;
+    }
+    double e = HLL_ALPHA * HLL_REGISTERS * HLL_REGISTERS / sum;
+    if (e <= 2.5 * HLL_REGISTERS && zeros > 0) {
+        e = linear_counts[zeros];
+    }
+    return e;
+}
+
+/// Return the number of threads to split work of a size over.
+///
+/// @param work units of work
+/// @param per_thread fewest units worth a thread
+static int thread_count(size_t work, size_t per_thread) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = work / per_thread + 1;
+    if (cpus > 0 && threads > (size_t)cpus) {
+        threads = cpus;
+    }
+    return threads < GRAPH_THREADS ? (int)threads : GRAPH_THREADS;
+}
+
+void graph_init(graph_t *graph) {
+    memset(graph, 0, sizeof(graph_t));
+}
+
+/// Free the arrays a graph holds for each node.
+static void free_node_arrays(graph_t *graph) {
+    size_t nodes = graph->node_capacity;
+    if (nodes > 0) {
+        metrics_freed((nodes + 1) * sizeof(uint64_t), 1);
+        metrics_freed(nodes * GRAPH_MAX_HOPS * sizeof(float), 1);
+        free(graph->start);
+        free(graph->balls);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (graph->sketches[i] != NULL) {
+            metrics_freed(nodes * HLL_REGISTERS, 1);
+            free(graph->sketches[i]);
+        }
+    }
+    graph->start = NULL;
+    graph->balls = NULL;
+    graph->sketches[0] = NULL;
+    graph->sketches[1] = NULL;
+    graph->node_capacity = 0;
+}
+
+void graph_free(graph_t *graph) {
+    free_node_arrays(graph);
+    if (graph->edges != NULL) {
+        metrics_freed(graph->edge_capacity * sizeof(uint32_t), 1);
+        free(graph->edges);
+    }
+    graph_init(graph);
+}
+
+bool graph_reserve(graph_t *graph, uint32_t nodes, uint64_t edges) {
+    graph->nodes = 0;
+    graph->hops = 0;
+    if (nodes > graph->node_capacity || graph->start == NULL) {
+        // leave room for the network to grow before the next time; the
+        // sketches are made again by graph_anf, at the new size
+        uint64_t capacity = (uint64_t)nodes + nodes / 4 + 1;
+        capacity = capacity > UINT32_MAX ? UINT32_MAX : capacity;
+        free_node_arrays(graph);
+        graph->start = malloc((capacity + 1) * sizeof(uint64_t));
+        graph->balls = malloc(capacity * GRAPH_MAX_HOPS * sizeof(float));
+        if (graph->start == NULL || graph->balls == NULL) {
+            free(graph->start);
+            free(graph->balls);
+            graph->start = NULL;
+            graph->balls = NULL;
+            return false;
+        }
+        metrics_allocated((capacity + 1) * sizeof(uint64_t), 1);
+        metrics_allocated(capacity * GRAPH_MAX_HOPS * sizeof(float), 1);
+        graph->node_capacity = capacity;
+    }
+    if (edges > graph->edge_capacity) {
+        uint64_t capacity = edges + edges / 4;
+        if (graph->edges != NULL) {
+            metrics_freed(graph->edge_capacity * sizeof(uint32_t), 1);
+            free(graph->edges);
+        }
+        graph->edge_capacity = 0;
+        graph->edges = malloc(capacity * sizeof(uint32_t));
+        if (graph->edges == NULL) {
+            return false;
+        }
+        metrics_allocated(capacity * sizeof(uint32_t), 1);
+        graph->edge_capacity = capacity;
+    }
+    graph->nodes = nodes;
+    return true;
+}
+
+/// One thread's share of a HyperANF step.
+typedef struct step_s {
+    graph_t *graph;
+    int hops;                   ///< hops the step reaches
+    uint32_t from;              ///< first node of the share
+    uint32_t to;                ///< node after the last
+    bool changed;               ///< some sketch of the share grew
+} step_t;
+
+/// Make the sketches of a share of the nodes for one more hop, and the
+/// estimates from them.
+static void *run_step(void *arg) {
+    step_t *step = arg;
+    graph_t *graph = step->graph;
+    const uint8_t *last = graph->sketches[(step->hops - 1) & 1];
+    uint8_t *next = graph->sketches[step->hops & 1];
+    for (uint32_t v = step->from; v < step->to; v++) {
+        uint8_t sketch[HLL_REGISTERS];
+        memcpy(sketch, last + (size_t)v * HLL_REGISTERS, HLL_REGISTERS);
+        for (uint64_t e = graph->start[v]; e < graph->start[v + 1]; e++) {
+            const uint8_t *other = last +
+                (size_t)graph->edges[e] * HLL_REGISTERS;
+            for (int r = 0; r < HLL_REGISTERS; r++) {
+                sketch[r] = sketch[r] > other[r] ? sketch[r] : other[r];
+            }
+        }
+        uint8_t *mine = next + (size_t)v * HLL_REGISTERS;
+        if (memcmp(sketch, last + (size_t)v * HLL_REGISTERS, HLL_REGISTERS)) {
+            step->changed = true;
+        }
+        memcpy(mine, sketch, HLL_REGISTERS);
+        graph->balls[(size_t)v * GRAPH_MAX_HOPS + step->hops - 1] =
+            estimate(sketch);
+    }
+    return NULL;
+}
+
+/// Return the first node whose nodes and edges before it reach a share of
+/// the graph's, so shares split at it have about as much work.
+static uint32_t split_at(const graph_t *graph, uint64_t work) {
+    uint32_t low = 0;
+    uint32_t high = graph->nodes;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (graph->start[mid] + mid < work) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+bool graph_anf(graph_t *graph) {
+    pthread_once(&tables_once, make_tables);
+    uint32_t nodes = graph->nodes;
+    if (nodes == 0) {
+        graph->hops = GRAPH_MAX_HOPS;
+        return true;
+    }
+    size_t bytes = (size_t)graph->node_capacity * HLL_REGISTERS;
+    for (int i = 0; i < 2; i++) {
+        if (graph->sketches[i] == NULL) {
+            graph->sketches[i] = aligned_alloc(64, bytes);
+            if (graph->sketches[i] == NULL) {
+                return false;
+            }
+            metrics_allocated(bytes, 1);
+        }
+    }
+    for (uint32_t v = 0; v < nodes; v++) {
+        uint8_t *sketch = graph->sketches[0] + (size_t)v * HLL_REGISTERS;
+        memset(sketch, 0, HLL_REGISTERS);
+        uint64_t h = mix(v);
+        uint64_t rest = h << REGISTER_BITS;
+        int rank = rest == 0 ? 64 - REGISTER_BITS + 1 :
+            __builtin_clzll(rest) + 1;
+        sketch[h >> (64 - REGISTER_BITS)] = rank;
+    }
+
+    uint64_t work = graph->start[nodes] + nodes;
+    int threads = thread_count(nodes, NODES_PER_THREAD);
+    step_t steps[GRAPH_THREADS];
+    pthread_t ids[GRAPH_THREADS];
+    int hops = 1;
+    for (; hops <= GRAPH_MAX_HOPS; hops++) {
+        int started = 0;
+        for (int i = 0; i < threads; i++) {
+            steps[i].graph = graph;
+            steps[i].hops = hops;
+            steps[i].from = split_at(graph, work * i / threads);
+            steps[i].to = split_at(graph, work * (i + 1) / threads);
+            steps[i].changed = false;
+            // the last share is run here, as is any a thread is refused for
+            if (i == threads - 1 ||
+                pthread_create(&ids[i], NULL, run_step, &steps[i]) != 0) {
+                run_step(&steps[i]);
+                continue;
+            }
+            started |= 1 << i;
+        }
+        bool changed = false;
+        for (int i = 0; i < threads; i++) {
+            if (started & (1 << i)) {
+                pthread_join(ids[i], NULL);
+            }
+            changed |= steps[i].changed;
+        }
+        if (!changed) {
+            break;
+        }
+    }
+    // once no ball grows, none ever will
+    for (int h = hops + 1; h <= GRAPH_MAX_HOPS; h++) {
+        for (uint32_t v = 0; v < nodes; v++) {
+            float *balls = graph->balls + (size_t)v * GRAPH_MAX_HOPS;
+            balls[h - 1] = balls[hops - 1];
+        }
+    }
+    graph->hops = GRAPH_MAX_HOPS;
+    return true;
+}
+
+double graph_ball(const graph_t *graph, uint32_t node, int hops) {
+    return graph->balls[(size_t)node * GRAPH_MAX_HOPS + hops - 1];
+}
+
+/// One thread's share of the searches.
+typedef struct search_s {
+    const graph_t *graph;
+    const uint32_t *sources;
+    size_t count;               ///< number of sources
+    size_t first;               ///< the first source of the share
+    size_t stride;              ///< sources between those of the share
+    uint32_t *distance;         ///< distance of each node, or UINT32_MAX
+    uint32_t *queue;            ///< nodes found, in the order found
+    distances_t found;
+} search_t;
+
+/// Search from each source of a share, in turn.
+static void *run_searches(void *arg) {
+    search_t *search = arg;
+    const graph_t *graph = search->graph;
+    uint32_t *distance = search->distance;
+    uint32_t *queue = search->queue;
+    for (size_t s = search->first; s < search->count; s += search->stride) {
+        uint32_t head = 0;
+        uint32_t tail = 0;
+        distance[search->sources[s]] = 0;
+        queue[tail++] = search->sources[s];
+        while (head < tail) {
+            uint32_t v = queue[head++];
+            uint32_t d = distance[v] + 1;
+            for (uint64_t e = graph->start[v]; e < graph->start[v + 1]; e++) {
+                uint32_t u = graph->edges[e];
+                if (distance[u] == UINT32_MAX) {
+                    distance[u] = d;
+                    queue[tail++] = u;
+                    search->found.pairs++;
+                    search->found.total += d;
+                    if (d > search->found.longest) {
+                        search->found.longest = d;
+                    }
+                }
+            }
+        }
+        // only the nodes found need their distances cleared
+        for (uint32_t i = 0; i < tail; i++) {
+            distance[queue[i]] = UINT32_MAX;
+        }
+    }
+    return NULL;
+}
+
+bool graph_distances(const graph_t *graph, const uint32_t *sources,
+    size_t count, distances_t *found) {
+    memset(found, 0, sizeof(distances_t));
+    int threads = thread_count(count, SEARCHES_PER_THREAD);
+    search_t searches[GRAPH_THREADS];
+    pthread_t ids[GRAPH_THREADS];
+    size_t bytes = (size_t)graph->nodes * sizeof(uint32_t);
+    int ready = 0;
+    for (; ready < threads; ready++) {
+        search_t *search = &searches[ready];
+        search->distance = malloc(bytes);
+        search->queue = malloc(bytes);
+        if (search->distance == NULL || search->queue == NULL) {
+            free(search->distance);
+            free(search->queue);
+            break;
+        }
+        memset(search->distance, 0xFF, bytes);
+        search->graph = graph;
+        search->sources = sources;
+        search->count = count;
+        search->first = ready;
+        search->stride = threads;
+        memset(&search->found, 0, sizeof(distances_t));
+    }
+    if (ready < threads) {
+        while (ready > 0) {
+            ready--;
+            free(searches[ready].distance);
+            free(searches[ready].queue);
+        }
+        return false;
+    }
+
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (i == threads - 1 ||
+            pthread_create(&ids[i], NULL, run_searches, &searches[i]) != 0) {
+            run_searches(&searches[i]);
+            continue;
+        }
+        started |= 1 << i;
+    }
+    for (int i = 0; i < threads; i++) {
+        if (started & (1 << i)) {
+            pthread_join(ids[i], NULL);
+        }
+        found->pairs += searches[i].found.pairs;
+        found->total += searches[i].found.total;
+        if (searches[i].found.longest > found->longest) {
+            found->longest = searches[i].found.longest;
+        }
+        free(searches[i].distance);
+        free(searches[i].queue);
+    }
+    return true;
+}
@@ -0,0 +1,106 @@
+/// @file graph.h
+/// @brief A compact copy of the friendship graph for analytics that would
+///    be too slow over the network itself: approximate neighbourhood sizes
+///    by HyperANF, and distances by breadth-first search from a sample of
+///    users.
+///
+/// The graph is held in compressed sparse row form: the neighbours of
+/// node i are edges[start[i]] up to edges[start[i + 1]]. Nodes are
+/// numbered from 0 by the owner, who fills start and edges directly after
+/// graph_reserve.
+///
+/// HyperANF gives every node a HyperLogLog sketch of the nodes within t
+/// hops of it. At t = 0 the sketch holds the node alone; the sketch for
+/// t + 1 is the union of the node's own and its neighbours' sketches for
+/// t, a byte-wise maximum. Each step costs one pass over the edges,
+/// however many nodes a ball holds, and the steps are split over threads.
+/// The estimates for every number of hops are kept, so answering a query
+/// afterwards is a lookup. The sketches and arrays are kept between runs,
+/// and only grow.
+///
+/// A graph is not thread safe; its owner serializes the use of it.
+///
+/// @author Ryan Nowak rcn8263
+
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <stdbool.h>    // bool
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint32_t, uint64_t
+
+/// Registers of a HyperLogLog sketch, a byte each: a cache line per node,
+/// and a standard error of about 13%.
+#define HLL_REGISTERS 64
+
+/// The most hops neighbourhood sizes are estimated for.
+#define GRAPH_MAX_HOPS 8
+
+/// The most threads an analysis runs on.
+#define GRAPH_THREADS 8
+
+/// A graph, and what has been worked out about it.
+typedef struct graph_s {
+    uint32_t nodes;             ///< number of nodes
+    uint64_t *start;            ///< where each node's neighbours start
+    uint32_t *edges;            ///< the neighbours of every node
+    int hops;                   ///< hops the estimates are made for, or 0
+    float *balls;               ///< nodes within 1 to GRAPH_MAX_HOPS hops
+    uint8_t *sketches[2];       ///< one sketch per node, for t and t + 1
+    uint32_t node_capacity;     ///< nodes the arrays have room for
+    uint64_t edge_capacity;     ///< edges edges has room for
+} graph_t;
+
+/// What a sample of breadth-first searches found.
+typedef struct distances_s {
+    uint64_t pairs;             ///< pairs of a source and a node it reaches
+    uint64_t total;             ///< sum of their distances
+    uint32_t longest;           ///< longest of their distances
+} distances_t;
+
+/// Make an empty graph. A zeroed graph is empty too.
+///
+/// @param graph the graph
+void graph_init(graph_t *graph);
+
+/// Free everything a graph holds, leaving it empty.
+///
+/// @param graph the graph
+void graph_free(graph_t *graph);
+
+/// Make room for a graph of a size, forgetting the graph held before and
+/// what was worked out about it. The caller then fills start, with
+/// nodes + 1 entries, and edges.
+///
+/// @param graph the graph
+/// @param nodes number of nodes
+/// @param edges number of edges, counting each direction
+/// @return false if there is no memory for it
+bool graph_reserve(graph_t *graph, uint32_t nodes, uint64_t edges);
+
+/// Estimate the number of nodes within each number of hops of every node,
+/// up to GRAPH_MAX_HOPS. Once no ball grows any more, the rest are known.
+///
+/// @param graph the graph
+/// @return false if there is no memory for the sketches
+bool graph_anf(graph_t *graph);
+
+/// Return the estimated number of nodes within a number of hops of a node,
+/// itself included, after graph_anf.
+///
+/// @param graph the graph
+/// @param node the node
+/// @param hops from 1 to GRAPH_MAX_HOPS
+double graph_ball(const graph_t *graph, uint32_t node, int hops);
+
+/// Find the distance from each of a set of nodes to every node it reaches.
+///
+/// @param graph the graph
+/// @param sources the nodes searched from
+/// @param count number of sources
+/// @param found receives what the searches found
+/// @return false if there is no memory for the searches
+bool graph_distances(const graph_t *graph, const uint32_t *sources,
+    size_t count, distances_t *found);
+
+#endif // GRAPH_H
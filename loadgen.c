@@ -0,0 +1,381 @@
+//
+// file: loadgen.c
+//
+// Load generator for amici's server mode. Each client thread connects to
+// the server's socket and replays the commands of a File-input style file,
+// sending one request and waiting for its whole response before sending
+// another. Every request is sent as a batch, a lone command line as a
+// batch of one, so that each response comes framed with its length and
+// the end of one is never guessed from its text. At the end the total
+// throughput and the latency distribution of all the requests are
+// reported, as text or with -j as a JSON object.
+//
+// usage: loadgen [-j] socket-path command-file [clients [rounds]]
+//
+// It is linked with protocol.c, for the batch framing the server uses.
+//
+// @author Ryan Nowak rcn8263
+//
+
+#define _DEFAULT_SOURCE  // clock_gettime
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "amici.h"
+
+/// A request: a batch header and the batch's lines.
+typedef struct request_s {
+    char *text;                 ///< the request, as sent
+    int commands;               ///< responses the server sends to it
+} request_t;
+
+/// Bytes read from the server and not yet used.
+typedef struct reader_s {
+    int fd;                     ///< the connected socket
+    size_t next;                ///< first byte of buf not yet used
+    size_t end;                 ///< end of the bytes in buf
+    char buf[4096];
+} reader_t;
+
+/// Work and results of one client thread.
+typedef struct client_s {
+    pthread_t thread;           ///< the thread running the client
+    size_t sent;                ///< requests answered so far
+    double *latency;            ///< microseconds taken by each request
+    bool failed;                ///< lost its connection to the server
+} client_t;
+
+static const char *socket_path;
+static request_t *requests;     ///< the requests to send, without quit
+static size_t request_count;
+static int rounds = 1;
+
+/// Return the current time in microseconds from a fixed point.
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/// Take bytes the server sent, reading more as they are needed.
+///
+/// @param in the reader
+/// @param to receives the bytes, or NULL to skip them
+/// @param count number of bytes
+/// @return false if the connection was lost first
+static bool take(reader_t *in, char *to, size_t count) {
+    while (count > 0) {
+        if (in->next == in->end) {
+            ssize_t n = read(in->fd, in->buf, sizeof(in->buf));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            in->next = 0;
+            in->end = n;
+        }
+        size_t part = in->end - in->next;
+        part = part < count ? part : count;
+        if (to != NULL) {
+            memcpy(to, in->buf + in->next, part);
+            to += part;
+        }
+        in->next += part;
+        count -= part;
+    }
+    return true;
+}
+
+/// Read the prompt the server sends when it is ready for a request.
+///
+/// @param in the reader
+/// @return false if the connection was lost, or something else came
+static bool await_prompt(reader_t *in) {
+    char prompt[sizeof(PROMPT) - 1];
+    return take(in, prompt, sizeof(prompt)) &&
+        !memcmp(prompt, PROMPT, sizeof(prompt));
+}
+
+/// Read the framed responses to a request, and the prompt after them.
+/// Each is a line "status length" followed by length bytes of output.
+///
+/// @param in the reader
+/// @param commands number of responses
+/// @return false if the connection was lost, or a response was not framed
+static bool await_responses(reader_t *in, int commands) {
+    for (int i = 0; i < commands; i++) {
+        char header[32];
+        size_t at = 0;
+        do {
+            if (at == sizeof(header) - 1 || !take(in, &header[at], 1)) {
+                return false;
+            }
+        }
+        while (header[at++] != '\n');
+        header[at] = '\0';
+        int status;
+        long length;
+        if (sscanf(header, "%d %ld", &status, &length) != 2 || length < 0 ||
+            !take(in, NULL, length)) {
+            return false;
+        }
+    }
+    return await_prompt(in);
+}
+
+/// Client thread: connect and replay every command rounds times.
+///
+/// @param arg the client_t to fill in
+static void *run_client(void *arg) {
+    client_t *client = arg;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    reader_t in = { .fd = fd };
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        !await_prompt(&in)) {
+        client->failed = true;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < request_count; i++) {
+            size_t len = strlen(requests[i].text);
+            double start = now_us();
+            if (send(fd, requests[i].text, len, MSG_NOSIGNAL) !=
+                (ssize_t)len || !await_responses(&in, requests[i].commands)) {
+                client->failed = true;
+                close(fd);
+                return NULL;
+            }
+            client->latency[client->sent++] = now_us() - start;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/// Order two latencies for qsort.
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/// Free the requests read from the command file.
+static void free_requests(void) {
+    for (size_t i = 0; i < request_count; i++) {
+        free(requests[i].text);
+    }
+    free(requests);
+}
+
+/// Append a line to a request, ending it with a newline.
+///
+/// @param request the request so far, or NULL
+/// @param line the line to add
+/// @return the longer request, or NULL, with request freed, if there is
+///    no memory for it
+static char *append_line(char *request, const char *line) {
+    size_t have = request ? strlen(request) : 0;
+    size_t len = strlen(line);
+    char *longer = realloc(request, have + len + 2);
+    if (longer == NULL) {
+        free(request);
+        return NULL;
+    }
+    memcpy(longer + have, line, len + 1);
+    if (len == 0 || line[len - 1] != '\n') {
+        strcpy(longer + have + len, "\n");
+    }
+    return longer;
+}
+
+/// Check whether a line is the quit command, whose only word is quit, as
+/// amici's parser reads it.
+///
+/// @param line the line
+/// @return true if it is
+static bool is_quit(const char *line) {
+    char word[sizeof("quit") + 1];
+    char extra;
+    return sscanf(line, "%5s %c", word, &extra) == 1 && !strcmp(word, "quit");
+}
+
+/// Read the command file into requests, leaving out quit so that every
+/// client stays connected for all of its rounds. A batch header and the
+/// lines of its batch form one request, since the server answers only
+/// once all of them have arrived; any other line is a batch of one. A
+/// batch the file cuts short is sent with the lines it has.
+///
+/// @param path the file to read
+/// @return false, with errno set, if it could not be read or there is no
+///    memory for it
+static bool read_commands(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+    char in[BUFFER_SIZE];
+    size_t cap = 0;
+    bool ok = true;
+    while (ok && fgets(in, BUFFER_SIZE, f) != NULL) {
+        int count = batch_size(in);
+        char *body = NULL;
+        int commands = 0;
+        if (count == 0 && !is_quit(in)) {
+            body = append_line(NULL, in);
+            commands = body != NULL;
+            ok = body != NULL;
+        }
+        while (ok && count-- > 0 && fgets(in, BUFFER_SIZE, f) != NULL) {
+            if (!is_quit(in)) {
+                body = append_line(body, in);
+                commands += body != NULL;
+                ok = body != NULL;
+            }
+        }
+        if (commands == 0) {
+            continue;
+        }
+        char header[sizeof("batch ") + 11];
+        snprintf(header, sizeof(header), "batch %d\n", commands);
+        char *text = ok ? append_line(NULL, header) : NULL;
+        text = text != NULL ? append_line(text, body) : NULL;
+        free(body);
+        if (text != NULL && request_count == cap) {
+            cap = cap ? cap * 2 : 64;
+            request_t *more = realloc(requests, cap * sizeof(request_t));
+            if (more == NULL) {
+                free(text);
+                text = NULL;
+            }
+            requests = more != NULL ? more : requests;
+        }
+        ok = text != NULL;
+        if (ok) {
+            requests[request_count].text = text;
+            requests[request_count++].commands = commands;
+        }
+    }
+    ok = ok && !ferror(f);
+    int error = errno;
+    fclose(f);
+    errno = error;
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    bool json = argc > 1 && !strcmp(argv[1], "-j");
+    if (json) {
+        argv++;
+        argc--;
+    }
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "usage: %s [-j] socket-path command-file "
+            "[clients [rounds]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    socket_path = argv[1];
+    int clients = argc > 3 ? atoi(argv[3]) : 1;
+    rounds = argc > 4 ? atoi(argv[4]) : 1;
+    if (clients < 1 || rounds < 1) {
+        fprintf(stderr, "error: clients and rounds must be positive\n");
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    client_t *client = NULL;
+    double *latency = NULL;
+    if (!read_commands(argv[2])) {
+        fprintf(stderr, "error: cannot read '%s': %s\n", argv[2],
+            strerror(errno));
+        status = EXIT_FAILURE;
+    }
+    size_t per_client = request_count * rounds;
+    if (status == EXIT_SUCCESS) {
+        client = calloc(clients, sizeof(client_t));
+        latency = malloc((per_client * clients + 1) * sizeof(double));
+        if (client == NULL || latency == NULL) {
+            fprintf(stderr, "error: out of memory for %d clients\n", clients);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    double start = now_us();
+    int started = 0;
+    while (status == EXIT_SUCCESS && started < clients) {
+        client[started].latency = latency + started * per_client;
+        if (pthread_create(&client[started].thread, NULL, run_client,
+            &client[started]) != 0) {
+            fprintf(stderr, "error: cannot start client %d\n", started + 1);
+            status = EXIT_FAILURE;
+        }
+        else {
+            started++;
+        }
+    }
+    size_t total = 0;
+    int failed = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(client[i].thread, NULL);
+        // gather each client's latencies into one run at the front
+        memmove(latency + total, client[i].latency,
+            client[i].sent * sizeof(double));
+        total += client[i].sent;
+        failed += client[i].failed;
+    }
+    double seconds = (now_us() - start) / 1e6;
+    if (status != EXIT_SUCCESS) {
+        free_requests();
+        free(latency);
+        free(client);
+        return status;
+    }
+
+    qsort(latency, total, sizeof(double), compare_double);
+    const double pct[] = { 50, 90, 99, 99.9 };
+    double throughput = seconds > 0 ? total / seconds : 0.0;
+    if (json) {
+        printf("{\"clients\": %d, \"requests\": %zu, "
+            "\"failed_clients\": %d, \"seconds\": %.6f, "
+            "\"requests_per_s\": %.1f, \"latency_us\": {",
+            clients, total, failed, seconds, throughput);
+        for (size_t i = 0; total > 0 && i < sizeof(pct) / sizeof(pct[0]); i++) {
+            size_t at = (size_t)(pct[i] / 100 * (total - 1));
+            printf("\"p%g\": %.1f, ", pct[i], latency[at]);
+        }
+        printf("\"max\": %.1f}}\n", total > 0 ? latency[total - 1] : 0.0);
+    }
+    else {
+        printf("clients: %d, requests: %zu, failed clients: %d\n",
+            clients, total, failed);
+        printf("elapsed: %.3f s, throughput: %.0f requests/s\n",
+            seconds, throughput);
+        if (total > 0) {
+            printf("latency (us):");
+            for (size_t i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+                size_t at = (size_t)(pct[i] / 100 * (total - 1));
+                printf(" p%g %.1f", pct[i], latency[at]);
+            }
+            printf(" max %.1f\n", latency[total - 1]);
+        }
+    }
+
+    free_requests();
+    free(latency);
+    free(client);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
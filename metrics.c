@@ -0,0 +1,544 @@
+//
+// file: metrics.c
+//
+// Instrumentation for amici. Command latencies go into log-linear
+// histograms in the manner of HdrHistogram: values below 16 ns each have a
+// bucket, and every power of two above that is split into 16 buckets, so a
+// recorded latency is known to within 1/16 of its value from 16 ns up to
+// about 18 minutes, in under 5 KB per kind of command. Reading the clock
+// costs more than all the counting, so only the first command of each kind
+// in every LATENCY_SAMPLE that a thread runs is timed; the counts are
+// exact.
+//
+// Each thread records into a recorder of its own, made the first time it
+// records and kept for the life of the process. With one writer per
+// recorder, counting is a plain load and store with no locked instruction;
+// the accesses are relaxed atomics only so that readers, who sum every
+// recorder, never see a torn value. A reader may see a command that is
+// still being recorded only partly counted.
+//
+// @author Ryan Nowak rcn8263
+//
+
+#define _DEFAULT_SOURCE  // strdup
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+/// Sub-buckets per power of two are 2^LATENCY_SUB_BITS.
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+
+/// Latencies of 2^LATENCY_MAX_BITS ns or more count in the last bucket.
+#define LATENCY_MAX_BITS 40
+
+#define LATENCY_BUCKETS \
+    ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+/// One command of a kind in LATENCY_SAMPLE is timed; a power of two.
+#define LATENCY_SAMPLE 4
+
+/// The powers of two of nanoseconds reported as Prometheus histogram
+/// bucket bounds: about 1 us up to about 1 s.
+#define LE_FIRST_BITS 10
+#define LE_LAST_BITS 30
+
+/// Scan lengths go in power of two buckets: 0, 1, 2-3, 4-7 and so on,
+/// with everything from 2^(SCAN_BUCKETS-2) up in the last one.
+#define SCAN_BUCKETS 22
+
+/// Names of the kinds of command, as they appear in the metrics.
+static const char *command_names[METRIC_COMMANDS] = {
+    [METRIC_ADD] = "add",
+    [METRIC_FRIEND] = "friend",
+    [METRIC_UNFRIEND] = "unfriend",
+    [METRIC_PRINT] = "print",
+    [METRIC_SIZE] = "size",
+    [METRIC_STATS] = "stats",
+    [METRIC_FIND] = "find",
+    [METRIC_LASTNAME] = "lastname",
+    [METRIC_INIT] = "init",
+    [METRIC_LOAD] = "load",
+    [METRIC_EXPORT] = "export",
+    [METRIC_REACH] = "reach",
+    [METRIC_DISTANCES] = "distances",
+    [METRIC_SNAPSHOT] = "snapshot",
+    [METRIC_RELEASE] = "release",
+    [METRIC_METRICS] = "metrics",
+    [METRIC_DIAG] = "diag",
+    [METRIC_BATCH] = "batch",
+    [METRIC_QUIT] = "quit",
+    [METRIC_OTHER] = "other",
+};
+
+/// Names of the Bloom filters, as they appear in the metrics.
+static const char *bloom_names[BLOOM_FILTERS] = {
+    [BLOOM_HANDLES] = "handles",
+    [BLOOM_EDGES] = "edges",
+};
+
+/// Outcomes of a Bloom filter check.
+enum { BLOOM_REJECTED, BLOOM_FALSE_POSITIVE, BLOOM_PRESENT, BLOOM_OUTCOMES };
+
+/// Names of the outcomes, as they appear in the metrics.
+static const char *outcome_names[BLOOM_OUTCOMES] = {
+    [BLOOM_REJECTED] = "rejected",
+    [BLOOM_FALSE_POSITIVE] = "false_positive",
+    [BLOOM_PRESENT] = "present",
+};
+
+/// What one recorder has recorded about one kind of command.
+typedef struct command_metrics_s {
+    _Atomic uint64_t commands;      ///< commands performed
+    _Atomic uint64_t errors;        ///< commands that failed
+    _Atomic uint64_t table_ops;     ///< hash table operations made
+    _Atomic uint64_t sum_ns;        ///< total latency
+    _Atomic uint64_t latency[LATENCY_BUCKETS];  ///< latency histogram
+} command_metrics_t;
+
+/// Everything recorded by one thread.
+typedef struct recorder_s {
+    command_metrics_t command[METRIC_COMMANDS];
+    _Atomic uint64_t scans[SCAN_BUCKETS];   ///< adjacency scan lengths
+    _Atomic uint64_t scanned;               ///< entries read by all scans
+    _Atomic uint64_t allocated;             ///< bytes taken
+    _Atomic uint64_t released;              ///< bytes given back
+    _Atomic uint64_t allocations;           ///< blocks taken
+    _Atomic uint64_t frees;                 ///< blocks given back
+    _Atomic uint64_t bloom[BLOOM_FILTERS][BLOOM_OUTCOMES]; ///< checks
+    struct recorder_s *next;                ///< recorder made before it
+} recorder_t;
+
+/// Every recorder, newest first. Recorders are only ever pushed.
+static _Atomic(recorder_t *) recorders;
+
+/// The calling thread's recorder, once it has one.
+static _Thread_local recorder_t *my_recorder;
+
+/// Table operations counted for the current thread's command so far.
+static _Thread_local uint64_t pending_ops;
+
+/// State of the dump thread.
+static pthread_t dump_thread;
+static bool dumping;
+static bool dump_stop;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_wake = PTHREAD_COND_INITIALIZER;
+static char *dump_path;
+static char *dump_temp;
+static int dump_interval;
+
+/// Return the calling thread's recorder, making it on first use.
+///
+/// @return the recorder, or NULL if there is no memory for one
+static recorder_t *recorder(void) {
+    if (my_recorder == NULL) {
+        recorder_t *r = calloc(1, sizeof(recorder_t));
+        if (r == NULL) {
+            return NULL;
+        }
+        r->next = atomic_load_explicit(&recorders, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&recorders, &r->next,
+            r, memory_order_release, memory_order_relaxed)) {
+        }
+        my_recorder = r;
+    }
+    return my_recorder;
+}
+
+/// Add to a counter of the calling thread's recorder, which no other
+/// thread writes.
+static inline void count(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+/// Return the latency bucket a value in nanoseconds belongs to.
+static int latency_bucket(uint64_t ns) {
+    if (ns < LATENCY_SUB) {
+        return (int)ns;
+    }
+    if (ns >> LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    int bits = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (bits - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1);
+    return (bits - LATENCY_SUB_BITS + 1) * LATENCY_SUB + sub;
+}
+
+/// Return the smallest value in nanoseconds of a latency bucket.
+static uint64_t bucket_low(int bucket) {
+    if (bucket < LATENCY_SUB) {
+        return (uint64_t)bucket;
+    }
+    int bits = bucket / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket % LATENCY_SUB;
+    return (LATENCY_SUB + sub) << (bits - LATENCY_SUB_BITS);
+}
+
+/// Return the scan bucket a scan length belongs to.
+static int scan_bucket(size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    int bucket = 64 - __builtin_clzll(length);
+    return bucket < SCAN_BUCKETS ? bucket : SCAN_BUCKETS - 1;
+}
+
+metric_command_t metrics_command(const char *name) {
+    // the first letters pick the only name it can be; one compare checks it
+    metric_command_t kind;
+    switch (name[0]) {
+    case 'a': kind = METRIC_ADD; break;
+    case 'b': kind = METRIC_BATCH; break;
+    case 'd':
+        kind = name[1] == 'i' && name[2] == 's' ? METRIC_DISTANCES : 
+            METRIC_DIAG;
+        break;
+    case 'e': kind = METRIC_EXPORT; break;
+    case 'f': kind = name[1] == 'i' ? METRIC_FIND : METRIC_FRIEND; break;
+    case 'i': kind = METRIC_INIT; break;
+    case 'l': kind = name[1] == 'a' ? METRIC_LASTNAME : METRIC_LOAD; break;
+    case 'm': kind = METRIC_METRICS; break;
+    case 'p': kind = METRIC_PRINT; break;
+    case 'q': kind = METRIC_QUIT; break;
+    case 'r':
+        kind = name[1] == 'e' && name[2] == 'a' ? METRIC_REACH : 
+            METRIC_RELEASE;
+        break;
+    case 'u': kind = METRIC_UNFRIEND; break;
+    case 's':
+        kind = name[1] == 'i' ? METRIC_SIZE :
+            name[1] == 'n' ? METRIC_SNAPSHOT : METRIC_STATS;
+        break;
+    default: return METRIC_OTHER;
+    }
+    return strcmp(name, command_names[kind]) ? METRIC_OTHER : kind;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+uint64_t metrics_start(metric_command_t command) {
+    recorder_t *r = recorder();
+    if (r == NULL || (atomic_load_explicit(&r->command[command].commands,
+        memory_order_relaxed) & (LATENCY_SAMPLE - 1)) != 0) {
+        return 0;
+    }
+    return metrics_now();
+}
+
+void metrics_record(metric_command_t command, status_t status, uint64_t start) {
+    recorder_t *r = recorder();
+    if (r == NULL) {
+        return;
+    }
+    command_metrics_t *m = &r->command[command];
+    count(&m->commands, 1);
+    if (start != 0) {
+        uint64_t ns = metrics_now() - start;
+        count(&m->latency[latency_bucket(ns)], 1);
+        count(&m->sum_ns, ns);
+    }
+    if (pending_ops != 0) {
+        count(&m->table_ops, pending_ops);
+        pending_ops = 0;
+    }
+    if (status != AMICI_OK && status != AMICI_QUIT &&
+        status != AMICI_ECOMMAND) {
+        count(&m->errors, 1);
+    }
+}
+
+void metrics_table_ops(unsigned ops) {
+    pending_ops += ops;
+}
+
+void metrics_scan(size_t length) {
+    recorder_t *r = recorder();
+    if (r != NULL) {
+        count(&r->scans[scan_bucket(length)], 1);
+        count(&r->scanned, length);
+    }
+}
+
+void metrics_bloom(metric_bloom_t filter, bool passed, bool present) {
+    recorder_t *r = recorder();
+    if (r != NULL) {
+        count(&r->bloom[filter][!passed ? BLOOM_REJECTED :
+            present ? BLOOM_PRESENT : BLOOM_FALSE_POSITIVE], 1);
+    }
+}
+
+void metrics_allocated(size_t bytes, unsigned blocks) {
+    recorder_t *r = recorder();
+    if (r != NULL) {
+        count(&r->allocated, bytes);
+        count(&r->allocations, blocks);
+    }
+}
+
+void metrics_freed(size_t bytes, unsigned blocks) {
+    recorder_t *r = recorder();
+    if (r != NULL) {
+        count(&r->released, bytes);
+        count(&r->frees, blocks);
+    }
+}
+
+/// Return the sum of one counter over every recorder.
+///
+/// @param offset offset of the counter within recorder_t
+static uint64_t total(size_t offset) {
+    uint64_t sum = 0;
+    recorder_t *r = atomic_load_explicit(&recorders, memory_order_acquire);
+    for (; r != NULL; r = r->next) {
+        sum += atomic_load_explicit(
+            (_Atomic uint64_t *)((char *)r + offset), memory_order_relaxed);
+    }
+    return sum;
+}
+
+#define TOTAL(field) total(offsetof(recorder_t, field))
+
+/// Write the histogram and quantiles of one kind of command.
+///
+/// @param out stream receiving the metrics
+/// @param name the kind's name
+/// @param latency the kind's histogram, summed over the recorders
+/// @param n number of latencies recorded
+/// @param sum_ns their total
+/// @param summary write the quantiles instead of the histogram
+static void write_latency(FILE *out, const char *name,
+    const uint64_t *latency, uint64_t n, uint64_t sum_ns, bool summary) {
+    if (summary) {
+        const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        int bucket = 0;
+        uint64_t seen = latency[0];
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            uint64_t rank = (uint64_t)(quantiles[q] * n + 0.5);
+            rank = rank < 1 ? 1 : rank;
+            while (seen < rank && bucket < LATENCY_BUCKETS - 1) {
+                seen += latency[++bucket];
+            }
+            // like HdrHistogram, report the highest value of the bucket
+            fprintf(out, "amici_command_latency_seconds"
+                "{command=\"%s\",quantile=\"%g\"} %.9f\n", name,
+                quantiles[q], (bucket_low(bucket + 1) - 1) / 1e9);
+        }
+        fprintf(out, "amici_command_latency_seconds_sum{command=\"%s\"} "
+            "%.9f\n", name, sum_ns / 1e9);
+        fprintf(out, "amici_command_latency_seconds_count{command=\"%s\"} "
+            "%lu\n", name, (unsigned long)n);
+        return;
+    }
+    // bounds are powers of two, which bucket boundaries always fall on
+    uint64_t below = 0;
+    int bucket = 0;
+    for (int bits = LE_FIRST_BITS; bits <= LE_LAST_BITS; bits++) {
+        for (; bucket_low(bucket) < ((uint64_t)1 << bits); bucket++) {
+            below += latency[bucket];
+        }
+        fprintf(out, "amici_command_duration_seconds_bucket"
+            "{command=\"%s\",le=\"%g\"} %lu\n", name,
+            ((uint64_t)1 << bits) / 1e9, (unsigned long)below);
+    }
+    fprintf(out, "amici_command_duration_seconds_bucket"
+        "{command=\"%s\",le=\"+Inf\"} %lu\n", name, (unsigned long)n);
+    fprintf(out, "amici_command_duration_seconds_sum{command=\"%s\"} %.9f\n",
+        name, sum_ns / 1e9);
+    fprintf(out, "amici_command_duration_seconds_count{command=\"%s\"} %lu\n",
+        name, (unsigned long)n);
+}
+
+void metrics_write(FILE *out) {
+    static uint64_t latency[METRIC_COMMANDS][LATENCY_BUCKETS];
+    static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t timed[METRIC_COMMANDS];
+    uint64_t sum_ns[METRIC_COMMANDS];
+
+    // the histograms are too big for a worker's stack; one writer at a time
+    pthread_mutex_lock(&write_lock);
+    for (int c = 0; c < METRIC_COMMANDS; c++) {
+        timed[c] = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            latency[c][b] = TOTAL(command[c].latency[b]);
+            timed[c] += latency[c][b];
+        }
+        sum_ns[c] = TOTAL(command[c].sum_ns);
+    }
+
+    fprintf(out, "# HELP amici_commands_total Commands performed.\n"
+        "# TYPE amici_commands_total counter\n");
+    for (int c = 0; c < METRIC_COMMANDS; c++) {
+        fprintf(out, "amici_commands_total{command=\"%s\"} %lu\n",
+            command_names[c], (unsigned long)TOTAL(command[c].commands));
+    }
+    fprintf(out, "# HELP amici_command_errors_total Commands that failed.\n"
+        "# TYPE amici_command_errors_total counter\n");
+    for (int c = 0; c < METRIC_COMMANDS; c++) {
+        fprintf(out, "amici_command_errors_total{command=\"%s\"} %lu\n",
+            command_names[c], (unsigned long)TOTAL(command[c].errors));
+    }
+    fprintf(out, "# HELP amici_table_ops_total Hash table lookups and "
+        "inserts made by commands.\n"
+        "# TYPE amici_table_ops_total counter\n");
+    for (int c = 0; c < METRIC_COMMANDS; c++) {
+        fprintf(out, "amici_table_ops_total{command=\"%s\"} %lu\n",
+            command_names[c], (unsigned long)TOTAL(command[c].table_ops));
+    }
+
+    // kinds never timed are left out of the latency distributions
+    fprintf(out, "# HELP amici_command_duration_seconds Latency of the "
+        "commands timed, one in %d of each kind.\n", LATENCY_SAMPLE);
+    fprintf(out, 
+        "# TYPE amici_command_duration_seconds histogram\n");
+    for (int c = 0; c < METRIC_COMMANDS; c++) {
+        if (timed[c] > 0) {
+            write_latency(out, command_names[c], latency[c], timed[c],
+                sum_ns[c], false);
+        }
+    }
+    fprintf(out, "# HELP amici_command_latency_seconds Latency quantiles "
+        "of the commands timed.\n"
+        "# TYPE amici_command_latency_seconds summary\n");
+    for (int c = 0; c < METRIC_COMMANDS; c++) {
+        if (timed[c] > 0) {
+            write_latency(out, command_names[c], latency[c], timed[c],
+                sum_ns[c], true);
+        }
+    }
+    pthread_mutex_unlock(&write_lock);
+
+    fprintf(out, "# HELP amici_adjacency_scan_length Friends read by each "
+        "scan of a user's friends.\n"
+        "# TYPE amici_adjacency_scan_length histogram\n");
+    uint64_t scans = 0;
+    for (int b = 0; b < SCAN_BUCKETS - 1; b++) {
+        scans += TOTAL(scans[b]);
+        fprintf(out, "amici_adjacency_scan_length_bucket{le=\"%lu\"} %lu\n",
+            ((unsigned long)1 << b) - 1, (unsigned long)scans);
+    }
+    scans += TOTAL(scans[SCAN_BUCKETS - 1]);
+    fprintf(out, "amici_adjacency_scan_length_bucket{le=\"+Inf\"} %lu\n"
+        "amici_adjacency_scan_length_sum %lu\n"
+        "amici_adjacency_scan_length_count %lu\n", (unsigned long)scans,
+        (unsigned long)TOTAL(scanned), (unsigned long)scans);
+
+    // bytes may be taken by one thread and given back by another
+    int64_t allocated = (int64_t)(TOTAL(allocated) - TOTAL(released));
+    fprintf(out, "# HELP amici_allocated_bytes Bytes of users, names and "
+        "friend lists held from the allocator.\n"
+        "# TYPE amici_allocated_bytes gauge\n"
+        "amici_allocated_bytes %ld\n", (long)allocated);
+    fprintf(out, "# HELP amici_allocations_total Blocks taken from the "
+        "allocator.\n"
+        "# TYPE amici_allocations_total counter\n"
+        "amici_allocations_total %lu\n", (unsigned long)TOTAL(allocations));
+    fprintf(out, "# HELP amici_frees_total Blocks given back to the "
+        "allocator.\n"
+        "# TYPE amici_frees_total counter\n"
+        "amici_frees_total %lu\n", (unsigned long)TOTAL(frees));
+
+    fprintf(out, "# HELP amici_bloom_checks_total Lookups checked against "
+        "a Bloom filter, by what the filter said and what was found.\n"
+        "# TYPE amici_bloom_checks_total counter\n");
+    uint64_t checks[BLOOM_FILTERS][BLOOM_OUTCOMES];
+    for (int f = 0; f < BLOOM_FILTERS; f++) {
+        for (int o = 0; o < BLOOM_OUTCOMES; o++) {
+            checks[f][o] = TOTAL(bloom[f][o]);
+            fprintf(out, "amici_bloom_checks_total{filter=\"%s\","
+                "result=\"%s\"} %lu\n", bloom_names[f], outcome_names[o],
+                (unsigned long)checks[f][o]);
+        }
+    }
+    fprintf(out, "# HELP amici_bloom_false_positive_ratio Share of the "
+        "absent keys checked that a Bloom filter let through.\n"
+        "# TYPE amici_bloom_false_positive_ratio gauge\n");
+    for (int f = 0; f < BLOOM_FILTERS; f++) {
+        uint64_t absent = checks[f][BLOOM_REJECTED] +
+            checks[f][BLOOM_FALSE_POSITIVE];
+        fprintf(out, "amici_bloom_false_positive_ratio{filter=\"%s\"} %g\n",
+            bloom_names[f], absent == 0 ? 0.0 :
+            (double)checks[f][BLOOM_FALSE_POSITIVE] / absent);
+    }
+}
+
+/// Write the metrics file once, through a file renamed over it.
+///
+/// @param failing whether the previous dump failed, to report only changes
+/// @return whether this dump failed
+static bool dump(bool failing) {
+    FILE *f = fopen(dump_temp, "w");
+    if (f != NULL) {
+        metrics_write(f);
+        if (fclose(f) == 0 && rename(dump_temp, dump_path) == 0) {
+            return false;
+        }
+    }
+    if (!failing) {
+        fprintf(stderr, "error: cannot write metrics to '%s': %s\n",
+            dump_path, strerror(errno));
+    }
+    return true;
+}
+
+/// Dump thread: rewrite the metrics file every interval until stopped.
+static void *run_dump(void *arg) {
+    (void)arg;
+    bool failing = false;
+    pthread_mutex_lock(&dump_lock);
+    while (!dump_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += dump_interval;
+        while (!dump_stop &&
+            pthread_cond_timedwait(&dump_wake, &dump_lock, &until) == 0) {
+        }
+        pthread_mutex_unlock(&dump_lock);
+        failing = dump(failing);
+        pthread_mutex_lock(&dump_lock);
+    }
+    pthread_mutex_unlock(&dump_lock);
+    return NULL;
+}
+
+bool metrics_start_dump(const char *path, int interval) {
+    dump_path = strdup(path);
+    dump_temp = malloc(strlen(path) + sizeof(".tmp"));
+    if (dump_path == NULL || dump_temp == NULL) {
+        free(dump_path);
+        free(dump_temp);
+        return false;
+    }
+    strcpy(dump_temp, path);
+    strcat(dump_temp, ".tmp");
+    dump_interval = interval;
+    dump_stop = false;
+    dumping = pthread_create(&dump_thread, NULL, run_dump, NULL) == 0;
+    return dumping;
+}
+
+void metrics_stop_dump(void) {
+    if (!dumping) {
+        return;
+    }
+    pthread_mutex_lock(&dump_lock);
+    dump_stop = true;
+    pthread_cond_signal(&dump_wake);
+    pthread_mutex_unlock(&dump_lock);
+    pthread_join(dump_thread, NULL);
+    dumping = false;
+    free(dump_path);
+    free(dump_temp);
+}
@@ -0,0 +1,127 @@
+/// @file metrics.h
+/// @brief Low-overhead instrumentation of amici: per-command counters and
+///    latency histograms, table operations per command, adjacency scan
+///    lengths and the bytes amici holds from the allocator. Everything is
+///    exposed in the Prometheus text format, by the metrics command and by
+///    an optional periodic dump to a file.
+///
+/// Recording never takes a lock. Each thread adds into counters only it
+/// writes, and readers sum the counters of every thread.
+///
+/// @author Ryan Nowak rcn8263
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>    // bool
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include <stdio.h>      // FILE
+
+#include "amici.h"      // status_t
+
+/// The kinds of command measured separately.
+typedef enum {
+    METRIC_ADD,
+    METRIC_FRIEND,
+    METRIC_UNFRIEND,
+    METRIC_PRINT,
+    METRIC_SIZE,
+    METRIC_STATS,
+    METRIC_FIND,
+    METRIC_LASTNAME,
+    METRIC_INIT,
+    METRIC_LOAD,
+    METRIC_EXPORT,
+    METRIC_REACH,
+    METRIC_DISTANCES,
+    METRIC_SNAPSHOT,
+    METRIC_RELEASE,
+    METRIC_METRICS,
+    METRIC_DIAG,
+    METRIC_BATCH,               ///< a whole batch, as well as its commands
+    METRIC_QUIT,
+    METRIC_OTHER,               ///< anything that is not a command
+    METRIC_COMMANDS             ///< number of kinds
+} metric_command_t;
+
+/// The Bloom filters whose checks are counted.
+typedef enum {
+    BLOOM_HANDLES,              ///< handles of the users
+    BLOOM_EDGES,                ///< friendships
+    BLOOM_FILTERS               ///< number of filters
+} metric_bloom_t;
+
+/// Seconds between dumps to the metrics file unless told otherwise.
+#define DEFAULT_METRICS_INTERVAL 10
+
+/// Return the kind of command named by the first word of a command line.
+///
+/// @param name the command's name
+metric_command_t metrics_command(const char *name);
+
+/// Return a monotonic timestamp in nanoseconds.
+uint64_t metrics_now(void);
+
+/// Begin a command of the given kind: return the time it starts if it is
+/// one of those whose latency is sampled, or 0 if it is not.
+///
+/// @param command the kind of command
+uint64_t metrics_start(metric_command_t command);
+
+/// Record one command: its latency if it was sampled, whether it failed,
+/// and the table operations the calling thread counted since its last
+/// record.
+///
+/// @param command the kind of command
+/// @param status the command's status
+/// @param start what metrics_start returned when the command began
+void metrics_record(metric_command_t command, status_t status, uint64_t start);
+
+/// Count hash table operations made by the calling thread's command.
+///
+/// @param ops number of ht_has, ht_get and ht_put calls made
+void metrics_table_ops(unsigned ops);
+
+/// Record a scan over the friends of a user.
+///
+/// @param length number of entries read
+void metrics_scan(size_t length);
+
+/// Record a check of a Bloom filter, once what it stood for is known.
+///
+/// @param filter the filter
+/// @param passed the filter said the key may be there
+/// @param present the key was there
+void metrics_bloom(metric_bloom_t filter, bool passed, bool present);
+
+/// Count blocks amici has taken from the allocator.
+///
+/// @param bytes the bytes asked for
+/// @param blocks number of blocks they were taken in
+void metrics_allocated(size_t bytes, unsigned blocks);
+
+/// Count blocks amici has given back to the allocator.
+///
+/// @param bytes the bytes given back
+/// @param blocks number of blocks they were in
+void metrics_freed(size_t bytes, unsigned blocks);
+
+/// Write every metric in the Prometheus text exposition format.
+///
+/// @param out stream receiving the metrics
+void metrics_write(FILE *out);
+
+/// Start a thread that rewrites the metrics file every interval seconds.
+/// Each dump is written beside the file and renamed over it, so readers
+/// never see a partial dump.
+///
+/// @param path the metrics file
+/// @param interval seconds between dumps, at least 1
+/// @return false if the thread could not be started
+bool metrics_start_dump(const char *path, int interval);
+
+/// Write a last dump and stop the dump thread, if one was started.
+void metrics_stop_dump(void);
+
+#endif // METRICS_H
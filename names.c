@@ -0,0 +1,551 @@
+//
+// file: names.c
+//
+// The name index, a B+-tree. An inner node with n keys has n + 1
+// children, and its key i is the first value under child i + 1, so a
+// search goes down to the child after every key that is not past it.
+// A node that overflows on insert splits in two about its middle, and
+// the root, when it splits, gets a new root above it. The nodes an insert
+// splits into are all allocated before it changes anything, so an insert
+// there is no memory for leaves the index as it was. An index built
+// from its values all at once is laid out level by level from the leaves
+// up, every node as full as it goes.
+//
+// @author Ryan Nowak rcn8263
+//
+
+#define _GNU_SOURCE  // qsort_r
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "names.h"
+
+/// Words of the start of a name kept beside each value.
+#define KEY_WORDS 3
+
+/// Bytes of a key.
+#define KEY_BYTES (KEY_WORDS * sizeof(uint64_t))
+
+struct names_node_s {
+    int count;                          ///< values, or keys, in the node
+    names_node_t *next;                 ///< the next leaf, in a leaf
+    uint64_t key[NAMES_FANOUT][KEY_WORDS]; ///< start of each one's name
+    void *value[NAMES_FANOUT];          ///< the values, or the keys
+    names_node_t *child[];              ///< count + 1 children, if inner
+};
+
+/// A value with the start of its name, on its way into a node.
+typedef struct slot_s {
+    uint64_t key[KEY_WORDS];
+    void *value;
+} slot_t;
+
+/// Bytes of a leaf and of an inner node.
+#define LEAF_BYTES sizeof(names_node_t)
+#define INNER_BYTES (sizeof(names_node_t) + \
+    (NAMES_FANOUT + 1) * sizeof(names_node_t *))
+
+/// Make the key of a name: the first bytes of its last name, first name
+/// and handle, each with its NUL, as numbers with the first byte highest.
+/// NUL sorts before every other byte, so keys that differ compare the way
+/// their names do.
+static void key_of(const name_t *name, uint64_t *key) {
+    const char *parts[] = { name->last, name->first, name->handle };
+    int part = 0;
+    const char *s = parts[0];
+    for (int w = 0; w < KEY_WORDS; w++) {
+        uint64_t word = 0;
+        for (int i = 0; i < 8; i++) {
+            unsigned char c = 0;
+            if (part < 3) {
+                c = *s++;
+                if (c == '\0' && ++part < 3) {
+                    s = parts[part];
+                }
+            }
+            word = word << 8 | c;
+        }
+        key[w] = word;
+    }
+}
+
+/// Make an empty node.
+static names_node_t *new_node(bool inner) {
+    size_t bytes = inner ? INNER_BYTES : LEAF_BYTES;
+    names_node_t *node = malloc(bytes);
+    if (node != NULL) {
+        node->count = 0;
+        node->next = NULL;
+        metrics_allocated(bytes, 1);
+    }
+    return node;
+}
+
+/// Compare a name against the value at a place in a node. Only names
+/// whose keys are the same are read from the value.
+static int compare_at(const names_t *names, const uint64_t *key,
+    const name_t *name, const names_node_t *node, int i) {
+    for (int w = 0; w < KEY_WORDS; w++) {
+        if (key[w] != node->key[i][w]) {
+            return key[w] < node->key[i][w] ? -1 : 1;
+        }
+    }
+    name_t other;
+    names->name_of(node->value[i], &other);
+    return names_compare(name, &other);
+}
+
+/// Return the first place in a node whose value comes after a name, or,
+/// unless after is set, is the name itself.
+static int search(const names_t *names, const names_node_t *node,
+    const uint64_t *key, const name_t *name, bool after) {
+    int low = 0;
+    int high = node->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        int c = compare_at(names, key, name, node, mid);
+        if (c > 0 || (after && c == 0)) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/// The nodes an insert splits into, allocated before it starts.
+typedef struct spares_s {
+    names_node_t *leaf;         ///< for the leaf, or NULL
+    names_node_t *inner;        ///< for inner nodes, linked through next
+} spares_t;
+
+/// Free a node, but not its children.
+static void free_node(names_node_t *node, bool inner) {
+    metrics_freed(inner ? INNER_BYTES : LEAF_BYTES, 1);
+    free(node);
+}
+
+/// Take an inner node from the spares.
+static names_node_t *take_inner(spares_t *spares) {
+    names_node_t *node = spares->inner;
+    spares->inner = node->next;
+    node->next = NULL;
+    return node;
+}
+
+/// Allocate the nodes inserting a name will split into: one for each of
+/// the full nodes at the bottom of its path, which split in turn from the
+/// leaf up, and a new root if they reach the root.
+///
+/// @param names the index, which is not empty
+/// @param name the name
+/// @param key the start of the name
+/// @param spares receives the nodes
+/// @return false, allocating none, if there is no memory for them
+static bool make_spares(const names_t *names, const name_t *name,
+    const uint64_t *key, spares_t *spares) {
+    int splits = 0;
+    const names_node_t *node = names->root;
+    for (int height = names->height; ; height--) {
+        splits = node->count == NAMES_FANOUT ? splits + 1 : 0;
+        if (height == 0) {
+            break;
+        }
+        node = node->child[search(names, node, key, name, true)];
+    }
+    spares->leaf = NULL;
+    spares->inner = NULL;
+    if (splits == 0) {
+        return true;
+    }
+    spares->leaf = new_node(false);
+    bool made = spares->leaf != NULL;
+    int inner = splits - 1 + (splits == names->height + 1);
+    for (int n = 0; made && n < inner; n++) {
+        names_node_t *spare = new_node(true);
+        made = spare != NULL;
+        if (made) {
+            spare->next = spares->inner;
+            spares->inner = spare;
+        }
+    }
+    if (!made) {
+        if (spares->leaf != NULL) {
+            free_node(spares->leaf, false);
+        }
+        while (spares->inner != NULL) {
+            free_node(take_inner(spares), true);
+        }
+    }
+    return made;
+}
+
+/// Put a slot at a place in a leaf, splitting the leaf if it is full.
+///
+/// @param leaf the leaf
+/// @param i the place
+/// @param slot the value
+/// @param spares the nodes to split into
+/// @param right receives the new leaf after this one, if it split
+static void put_leaf(names_node_t *leaf, int i, const slot_t *slot,
+    spares_t *spares, names_node_t **right) {
+    if (leaf->count < NAMES_FANOUT) {
+        int rest = leaf->count - i;
+        memmove(leaf->key[i + 1], leaf->key[i], rest * KEY_BYTES);
+        memmove(&leaf->value[i + 1], &leaf->value[i], rest * sizeof(void *));
+        memcpy(leaf->key[i], slot->key, KEY_BYTES);
+        leaf->value[i] = slot->value;
+        leaf->count++;
+        return;
+    }
+    names_node_t *half = spares->leaf;
+    spares->leaf = NULL;
+    uint64_t key[NAMES_FANOUT + 1][KEY_WORDS];
+    void *value[NAMES_FANOUT + 1];
+    memcpy(key, leaf->key, i * KEY_BYTES);
+    memcpy(value, leaf->value, i * sizeof(void *));
+    memcpy(key[i], slot->key, KEY_BYTES);
+    value[i] = slot->value;
+    memcpy(key[i + 1], leaf->key[i], (NAMES_FANOUT - i) * KEY_BYTES);
+    memcpy(&value[i + 1], &leaf->value[i], (NAMES_FANOUT - i) * sizeof(void *));
+
+    int left = (NAMES_FANOUT + 1) / 2;
+    leaf->count = left;
+    memcpy(leaf->key, key, left * KEY_BYTES);
+    memcpy(leaf->value, value, left * sizeof(void *));
+    half->count = NAMES_FANOUT + 1 - left;
+    memcpy(half->key, key[left], half->count * KEY_BYTES);
+    memcpy(half->value, &value[left], half->count * sizeof(void *));
+    half->next = leaf->next;
+    leaf->next = half;
+    *right = half;
+}
+
+/// Put a key and the child after it at a place in an inner node, splitting
+/// the node if it is full.
+///
+/// @param node the node
+/// @param i the key's place
+/// @param slot the key
+/// @param child the child, which goes at place i + 1
+/// @param spares the nodes to split into
+/// @param right receives the new node after this one, if it split
+/// @param up receives the key between the two, if it split
+static void put_inner(names_node_t *node, int i, const slot_t *slot,
+    names_node_t *child, spares_t *spares, names_node_t **right,
+    slot_t *up) {
+    if (node->count < NAMES_FANOUT) {
+        int rest = node->count - i;
+        memmove(node->key[i + 1], node->key[i], rest * KEY_BYTES);
+        memmove(&node->value[i + 1], &node->value[i], rest * sizeof(void *));
+        memmove(&node->child[i + 2], &node->child[i + 1],
+            rest * sizeof(names_node_t *));
+        memcpy(node->key[i], slot->key, KEY_BYTES);
+        node->value[i] = slot->value;
+        node->child[i + 1] = child;
+        node->count++;
+        return;
+    }
+    names_node_t *half = take_inner(spares);
+    uint64_t key[NAMES_FANOUT + 1][KEY_WORDS];
+    void *value[NAMES_FANOUT + 1];
+    names_node_t *children[NAMES_FANOUT + 2];
+    memcpy(key, node->key, i * KEY_BYTES);
+    memcpy(value, node->value, i * sizeof(void *));
+    memcpy(children, node->child, (i + 1) * sizeof(names_node_t *));
+    memcpy(key[i], slot->key, KEY_BYTES);
+    value[i] = slot->value;
+    children[i + 1] = child;
+    memcpy(key[i + 1], node->key[i], (NAMES_FANOUT - i) * KEY_BYTES);
+    memcpy(&value[i + 1], &node->value[i], (NAMES_FANOUT - i) * sizeof(void *));
+    memcpy(&children[i + 2], &node->child[i + 1],
+        (NAMES_FANOUT - i) * sizeof(names_node_t *));
+
+    // the middle key moves up; it is the first value under the new node
+    int left = (NAMES_FANOUT + 1) / 2;
+    node->count = left;
+    memcpy(node->key, key, left * KEY_BYTES);
+    memcpy(node->value, value, left * sizeof(void *));
+    memcpy(node->child, children, (left + 1) * sizeof(names_node_t *));
+    half->count = NAMES_FANOUT - left;
+    memcpy(half->key, key[left + 1], half->count * KEY_BYTES);
+    memcpy(half->value, &value[left + 1], half->count * sizeof(void *));
+    memcpy(half->child, &children[left + 1],
+        (half->count + 1) * sizeof(names_node_t *));
+    memcpy(up->key, key[left], KEY_BYTES);
+    up->value = value[left];
+    *right = half;
+}
+
+/// Insert a value into the subtree under a node.
+///
+/// @param names the index
+/// @param node root of the subtree
+/// @param height levels of inner nodes from the node down
+/// @param name the value's name
+/// @param slot the value
+/// @param spares the nodes to split into
+/// @param right receives the new node after this one, if it split
+/// @param up receives the first value under the new node, if it split
+static void insert_under(names_t *names, names_node_t *node, int height,
+    const name_t *name, const slot_t *slot, spares_t *spares,
+    names_node_t **right, slot_t *up) {
+    int i = search(names, node, slot->key, name, true);
+    if (height == 0) {
+        put_leaf(node, i, slot, spares, right);
+        if (*right != NULL) {
+            memcpy(up->key, (*right)->key[0], KEY_BYTES);
+            up->value = (*right)->value[0];
+        }
+        return;
+    }
+    names_node_t *split = NULL;
+    slot_t key;
+    insert_under(names, node->child[i], height - 1, name, slot, spares,
+        &split, &key);
+    if (split != NULL) {
+        put_inner(node, i, &key, split, spares, right, up);
+    }
+}
+
+void names_init(names_t *names, name_of_t name_of) {
+    names->root = NULL;
+    names->height = 0;
+    names->count = 0;
+    names->name_of = name_of;
+}
+
+/// Free the subtree under a node.
+static void free_under(names_node_t *node, int height) {
+    if (height > 0) {
+        for (int i = 0; i <= node->count; i++) {
+            free_under(node->child[i], height - 1);
+        }
+    }
+    free_node(node, height > 0);
+}
+
+void names_free(names_t *names) {
+    if (names->root != NULL) {
+        free_under(names->root, names->height);
+    }
+    names->root = NULL;
+    names->height = 0;
+    names->count = 0;
+}
+
+/// Compare two slots by the names of their values.
+static int compare_slots(const void *a, const void *b, void *names) {
+    const slot_t *x = a;
+    const slot_t *y = b;
+    for (int w = 0; w < KEY_WORDS; w++) {
+        if (x->key[w] != y->key[w]) {
+            return x->key[w] < y->key[w] ? -1 : 1;
+        }
+    }
+    name_t name1;
+    name_t name2;
+    ((const names_t *)names)->name_of(x->value, &name1);
+    ((const names_t *)names)->name_of(y->value, &name2);
+    return names_compare(&name1, &name2);
+}
+
+/// Make the nodes of a level over the level below, each with an even
+/// share of the nodes below as children.
+///
+/// @param below the nodes below, in order
+/// @param firsts the first slot under each node below
+/// @param count number of nodes below, more than one
+/// @param made receives the number of nodes made
+/// @return the nodes, in order, or NULL if there is no memory for them
+static names_node_t **build_level(names_node_t **below, slot_t *firsts,
+    size_t count, size_t *made) {
+    size_t nodes = (count + NAMES_FANOUT) / (NAMES_FANOUT + 1);
+    names_node_t **level = malloc(nodes * sizeof(names_node_t *));
+    if (level == NULL) {
+        return NULL;
+    }
+    for (size_t n = 0; n < nodes; n++) {
+        size_t start = n * count / nodes;
+        size_t end = (n + 1) * count / nodes;
+        names_node_t *node = new_node(true);
+        if (node == NULL) {
+            while (n > 0) {
+                free_node(level[--n], true);
+            }
+            free(level);
+            return NULL;
+        }
+        node->count = end - start - 1;
+        for (size_t i = start; i < end; i++) {
+            node->child[i - start] = below[i];
+            if (i > start) {
+                memcpy(node->key[i - start - 1], firsts[i].key, KEY_BYTES);
+                node->value[i - start - 1] = firsts[i].value;
+            }
+        }
+        // the first slot under the node is the first under its first child
+        firsts[n] = firsts[start];
+        level[n] = node;
+    }
+    *made = nodes;
+    return level;
+}
+
+bool names_build(names_t *names, void **values, size_t count) {
+    names_free(names);
+    if (count == 0) {
+        return true;
+    }
+    slot_t *slots = malloc(count * sizeof(slot_t));
+    size_t leaves = (count + NAMES_FANOUT - 1) / NAMES_FANOUT;
+    names_node_t **level = malloc(leaves * sizeof(names_node_t *));
+    slot_t *firsts = malloc(leaves * sizeof(slot_t));
+    if (slots == NULL || level == NULL || firsts == NULL) {
+        free(slots);
+        free(level);
+        free(firsts);
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        name_t name;
+        names->name_of(values[i], &name);
+        key_of(&name, slots[i].key);
+        slots[i].value = values[i];
+    }
+    qsort_r(slots, count, sizeof(slot_t), compare_slots, names);
+
+    bool built = true;
+    for (size_t n = 0; n < leaves; n++) {
+        size_t start = n * count / leaves;
+        size_t end = (n + 1) * count / leaves;
+        names_node_t *leaf = new_node(false);
+        if (leaf == NULL) {
+            built = false;
+            leaves = n;
+            break;
+        }
+        leaf->count = end - start;
+        for (size_t i = start; i < end; i++) {
+            memcpy(leaf->key[i - start], slots[i].key, KEY_BYTES);
+            leaf->value[i - start] = slots[i].value;
+        }
+        if (n > 0) {
+            level[n - 1]->next = leaf;
+        }
+        firsts[n] = slots[start];
+        level[n] = leaf;
+    }
+    free(slots);
+
+    size_t nodes = leaves;
+    int height = 0;
+    while (built && nodes > 1) {
+        size_t made;
+        names_node_t **above = build_level(level, firsts, nodes, &made);
+        if (above == NULL) {
+            built = false;
+            break;
+        }
+        free(level);
+        level = above;
+        nodes = made;
+        height++;
+    }
+    if (built) {
+        names->root = level[0];
+        names->height = height;
+        names->count = count;
+    }
+    else {
+        for (size_t n = 0; n < nodes; n++) {
+            free_under(level[n], height);
+        }
+    }
+    free(level);
+    free(firsts);
+    return built;
+}
+
+bool names_insert(names_t *names, void *value) {
+    name_t name;
+    names->name_of(value, &name);
+    slot_t slot;
+    key_of(&name, slot.key);
+    slot.value = value;
+    if (names->root == NULL) {
+        names->root = new_node(false);
+        if (names->root == NULL) {
+            return false;
+        }
+    }
+    spares_t spares;
+    if (!make_spares(names, &name, slot.key, &spares)) {
+        return false;
+    }
+    names_node_t *right = NULL;
+    slot_t up;
+    insert_under(names, names->root, names->height, &name, &slot, &spares,
+        &right, &up);
+    if (right != NULL) {
+        names_node_t *root = take_inner(&spares);
+        root->count = 1;
+        memcpy(root->key[0], up.key, KEY_BYTES);
+        root->value[0] = up.value;
+        root->child[0] = names->root;
+        root->child[1] = right;
+        names->root = root;
+        names->height++;
+    }
+    names->count++;
+    return true;
+}
+
+void names_seek(const names_t *names, const name_t *from, bool after,
+    names_cursor_t *cursor) {
+    cursor->leaf = NULL;
+    cursor->index = 0;
+    const names_node_t *node = names->root;
+    if (node == NULL) {
+        return;
+    }
+    uint64_t key[KEY_WORDS];
+    key_of(from, key);
+    for (int height = names->height; height > 0; height--) {
+        node = node->child[search(names, node, key, from, true)];
+    }
+    int i = search(names, node, key, from, after);
+    if (i == node->count) {
+        node = node->next;
+        i = 0;
+    }
+    cursor->leaf = node;
+    cursor->index = i;
+}
+
+void *names_next(names_cursor_t *cursor) {
+    if (cursor->leaf == NULL) {
+        return NULL;
+    }
+    void *value = cursor->leaf->value[cursor->index++];
+    if (cursor->index == cursor->leaf->count) {
+        cursor->leaf = cursor->leaf->next;
+        cursor->index = 0;
+    }
+    return value;
+}
+
+int names_compare(const name_t *a, const name_t *b) {
+    int c = strcmp(a->last, b->last);
+    if (c == 0) {
+        c = strcmp(a->first, b->first);
+    }
+    if (c == 0) {
+        c = strcmp(a->handle, b->handle);
+    }
+    return c;
+}
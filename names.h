@@ -0,0 +1,108 @@
+/// @file names.h
+/// @brief An ordered index of users by last name, first name and handle:
+///    a B+-tree that finds every user whose last name is, or starts with,
+///    a given string, in name order, a page at a time.
+///
+/// The tree holds pointers to values it knows nothing about, and asks its
+/// owner for the name of a value when it must compare two. Beside each
+/// pointer it keeps the first 24 bytes of the name, last name first, so
+/// most comparisons are decided within the node without reading the value
+/// at all, even among the many users who share a last name. The
+/// leaves are linked in order, so a scan walks them without going back up
+/// the tree. Values are never removed: the index lives as long as the
+/// network it indexes, and is freed whole.
+///
+/// An index is not thread safe; each is guarded by its owner's lock.
+///
+/// @author Ryan Nowak rcn8263
+
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <stdbool.h>    // bool
+#include <stddef.h>     // size_t
+
+/// Values held by each node. A leaf then fills about sixteen cache lines.
+#define NAMES_FANOUT 32
+
+/// The name of a value, in the order names sort by. No two values may
+/// have the same name; handles are unique, so names are.
+typedef struct name_s {
+    const char *last;           ///< last name
+    const char *first;          ///< first name
+    const char *handle;         ///< handle
+} name_t;
+
+/// Get the name of a value held by an index.
+typedef void (*name_of_t)(const void *value, name_t *name);
+
+typedef struct names_node_s names_node_t;
+
+/// An index. A zeroed index is not usable until names_init.
+typedef struct names_s {
+    names_node_t *root;         ///< the root, or NULL if the index is empty
+    int height;                 ///< levels of inner nodes above the leaves
+    size_t count;               ///< number of values
+    name_of_t name_of;          ///< the names of the values
+} names_t;
+
+/// A position in an index, between two values.
+typedef struct names_cursor_s {
+    const names_node_t *leaf;   ///< leaf of the next value, or NULL at the end
+    int index;                  ///< the next value's place in its leaf
+} names_cursor_t;
+
+/// Make an empty index.
+///
+/// @param names the index
+/// @param name_of gets the name of a value
+void names_init(names_t *names, name_of_t name_of);
+
+/// Free every node of an index, leaving it empty. The values are the
+/// owner's.
+///
+/// @param names the index
+void names_free(names_t *names);
+
+/// Make an index hold exactly the given values, replacing what it held.
+/// Building an index from every value at once is much quicker than adding
+/// them one by one, and packs its nodes full.
+///
+/// @param names the index
+/// @param values the values, no two with the same name
+/// @param count number of values
+/// @return false if there is no memory for it, leaving the index empty
+bool names_build(names_t *names, void **values, size_t count);
+
+/// Add a value.
+///
+/// @param names the index
+/// @param value the value, whose name is not in the index yet
+/// @return false if there is no memory for it, leaving the index as it was
+bool names_insert(names_t *names, void *value);
+
+/// Position a cursor at the first value whose name comes after a name,
+/// or is the name itself.
+///
+/// @param names the index
+/// @param from the name, which need not be in the index
+/// @param after skip a value with the name itself
+/// @param cursor receives the position
+void names_seek(const names_t *names, const name_t *from, bool after,
+    names_cursor_t *cursor);
+
+/// Step a cursor past the next value.
+///
+/// @param cursor the position
+/// @return the value, or NULL at the end of the index
+void *names_next(names_cursor_t *cursor);
+
+/// Compare two names in the order of an index.
+///
+/// @param a a name
+/// @param b a name
+/// @return less than, equal to or greater than 0 as a sorts before, with
+///    or after b
+int names_compare(const name_t *a, const name_t *b);
+
+#endif // NAMES_H
@@ -0,0 +1,24 @@
+//
+// file: protocol.c
+//
+// The framing of amici's line protocol, kept apart from the network so
+// that its clients, such as loadgen, parse it exactly as the server does.
+//
+// @author Ryan Nowak rcn8263
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "amici.h"
+
+int batch_size(const char *line) {
+    char word[sizeof("batch")];
+    int count;
+    char extra;
+    if (sscanf(line, "%5s %d %c", word, &count, &extra) != 2 ||
+        strcmp(word, "batch") || count < 1 || count > MAX_BATCH) {
+        return 0;
+    }
+    return count;
+}
@@ -0,0 +1,612 @@
+//
+// file: server.c
+//
+// Multi-client server mode for amici. One event loop thread owns the
+// listening socket and every client connection; it reads command lines into
+// per-connection queues and writes responses from per-connection output
+// buffers. Commands themselves run on a pool of worker threads. A connection
+// has at most one command (or one batch of commands) with a worker at a
+// time, so each client sees its responses in the order it sent them.
+//
+// @author Ryan Nowak rcn8263
+//
+
+#define _GNU_SOURCE  // accept4, open_memstream
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "amici.h"
+#include "server.h"
+
+/// One command line waiting to be run for a connection.
+typedef struct line_s {
+    struct line_s *next;        ///< next line sent by the client
+    char text[];                ///< the NUL terminated line
+} line_t;
+
+typedef struct conn_s {
+    int fd;                     ///< the client's socket
+    char in[BUFFER_SIZE];       ///< start of a line not yet complete
+    size_t in_len;              ///< bytes in in
+    line_t *head;               ///< oldest line not yet run
+    line_t *tail;               ///< newest line not yet run
+    int queued;                 ///< number of lines not yet run
+    line_t *job;                ///< lines being run by a worker, or NULL
+    bool batch;                 ///< job is a batch header and its lines
+    char *result;               ///< output of job once it has run
+    size_t result_len;          ///< bytes in result
+    status_t status;            ///< the status of job
+    char *out;                  ///< response bytes not yet written
+    size_t out_off;             ///< index of the first unwritten byte
+    size_t out_len;             ///< end of the unwritten bytes
+    size_t out_cap;             ///< allocated size of out
+    bool eof;                   ///< client sent its last line
+    bool quitting;              ///< close once the output is written
+    bool closed;                ///< released; freed after this loop pass
+    bool watched;               ///< fd is in the epoll set
+    struct conn_s *next;        ///< link in the work or done queue
+    struct conn_s *prev_conn;   ///< previous open connection
+    struct conn_s *next_conn;   ///< next open connection
+} conn_t;
+
+/// Marks for the epoll events that are not client connections.
+static int listen_mark;
+static int wake_mark;
+static int signal_mark;
+
+static int epoll_fd = -1;
+static int wake_fd = -1;
+
+/// Every open connection, so they can be released on shutdown.
+static conn_t *conns;
+
+/// Connections released during the current pass of the event loop. They
+/// are freed at the end of the pass, since a later event in the same batch
+/// may still name them.
+static conn_t *closed_conns;
+
+/// Connections whose job waits for a worker, oldest first.
+static conn_t *work_head;
+static conn_t *work_tail;
+static bool stopping;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+
+/// Connections whose job a worker has finished, for the event loop.
+static conn_t *done_head;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Run the connection's job, capturing everything it writes followed by
+/// the next prompt.
+///
+/// @param c connection whose job is set
+static void run_job(conn_t *c) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if (f == NULL) {
+        c->result = NULL;
+        c->result_len = 0;
+        c->status = AMICI_QUIT;
+        return;
+    }
+    if (c->batch) {
+        // off the worker's stack, as a batch may hold MAX_BATCH lines
+        int count = 0;
+        for (line_t *line = c->job->next; line != NULL; line = line->next) {
+            count++;
+        }
+        char **lines = malloc((count > 0 ? count : 1) * sizeof(char *));
+        if (lines == NULL) {
+            fprintf(f, "error: out of memory for batch\n");
+            c->status = AMICI_ENOMEM;
+        }
+        else if (count == 0) {
+            // the client closed right after the header
+            fprintf(f, "error: batch ended before its first command\n");
+            c->status = AMICI_EUSAGE;
+        }
+        else {
+            count = 0;
+            for (line_t *line = c->job->next; line != NULL;
+                line = line->next) {
+                lines[count++] = line->text;
+            }
+            c->status = execute_batch(lines, count, f);
+        }
+        free(lines);
+    }
+    else {
+        c->status = execute_command(c->job->text, f, f);
+    }
+    if (c->status != AMICI_QUIT) {
+        fputs(PROMPT, f);
+    }
+    fclose(f);
+    c->result = buf;
+    c->result_len = len;
+}
+
+/// Worker thread: run jobs from the work queue until the server stops and
+/// the queue is empty, handing each finished connection back to the loop.
+///
+/// @param arg unused
+static void *worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&work_lock);
+        while (work_head == NULL && !stopping) {
+            pthread_cond_wait(&work_ready, &work_lock);
+        }
+        conn_t *c = work_head;
+        if (c == NULL) {
+            pthread_mutex_unlock(&work_lock);
+            return NULL;
+        }
+        work_head = c->next;
+        if (work_head == NULL) {
+            work_tail = NULL;
+        }
+        pthread_mutex_unlock(&work_lock);
+
+        run_job(c);
+
+        pthread_mutex_lock(&done_lock);
+        c->next = done_head;
+        done_head = c;
+        pthread_mutex_unlock(&done_lock);
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            // the counter is already nonzero, so the loop will wake anyway
+        }
+    }
+}
+
+/// Append bytes to the connection's output buffer.
+///
+/// @param c the connection
+/// @param data the bytes to send
+/// @param len number of bytes
+/// @return false if there is no memory for them
+static bool append_out(conn_t *c, const char *data, size_t len) {
+    if (c->out_off > 0 && c->out_off == c->out_len) {
+        c->out_off = c->out_len = 0;
+    }
+    if (c->out_len + len > c->out_cap) {
+        if (c->out_off > 0) {
+            memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+            c->out_len -= c->out_off;
+            c->out_off = 0;
+        }
+        size_t cap = c->out_cap ? c->out_cap : BUFFER_SIZE;
+        while (c->out_len + len > cap) {
+            cap *= 2;
+        }
+        char *out = realloc(c->out, cap);
+        if (out == NULL) {
+            return false;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return true;
+}
+
+/// Write as much pending output as the socket takes without blocking.
+/// A client that cannot be written to is told nothing more.
+///
+/// @param c the connection
+static void flush_out(conn_t *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+            MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out_off += n;
+        }
+        else if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        else {
+            c->out_off = c->out_len = 0;
+            c->eof = c->quitting = true;
+            return;
+        }
+    }
+}
+
+/// Free a list of lines.
+///
+/// @param line the first line of the list
+static void free_lines(line_t *line) {
+    while (line != NULL) {
+        line_t *next = line->next;
+        free(line);
+        line = next;
+    }
+}
+
+/// Hand the connection's next line, or its next batch once all of the
+/// batch's lines have arrived, to the workers. Nothing is handed over while
+/// a job is running or the client is behind on reading its responses.
+///
+/// @param c the connection
+static void submit(conn_t *c) {
+    if (c->job != NULL || c->head == NULL || c->quitting ||
+        c->out_len - c->out_off >= OUT_HIGH_WATER) {
+        return;
+    }
+    // a batch cut short by the end of input runs with the lines it has
+    int take = 1;
+    int count = batch_size(c->head->text);
+    if (count > 0) {
+        if (c->queued - 1 < count && !c->eof) {
+            return;
+        }
+        take += count < c->queued - 1 ? count : c->queued - 1;
+    }
+    c->batch = count > 0;
+    c->job = c->head;
+    line_t *last = c->head;
+    for (int i = 1; i < take; i++) {
+        last = last->next;
+    }
+    c->head = last->next;
+    last->next = NULL;
+    c->queued -= take;
+    if (c->head == NULL) {
+        c->tail = NULL;
+    }
+    pthread_mutex_lock(&work_lock);
+    c->next = NULL;
+    if (work_tail == NULL) {
+        work_head = c;
+    }
+    else {
+        work_tail->next = c;
+    }
+    work_tail = c;
+    pthread_cond_signal(&work_ready);
+    pthread_mutex_unlock(&work_lock);
+}
+
+/// Queue the partial line held in the connection's input buffer.
+///
+/// @param c the connection
+/// @return false if there is no memory for the line
+static bool queue_line(conn_t *c) {
+    line_t *line = malloc(sizeof(line_t) + c->in_len + 1);
+    if (line == NULL) {
+        return false;
+    }
+    memcpy(line->text, c->in, c->in_len);
+    line->text[c->in_len] = '\0';
+    line->next = NULL;
+    if (c->tail == NULL) {
+        c->head = line;
+    }
+    else {
+        c->tail->next = line;
+    }
+    c->tail = line;
+    c->queued++;
+    c->in_len = 0;
+    return true;
+}
+
+/// Read everything the client has sent, splitting it into lines the same
+/// way fgets does for the interactive program.
+///
+/// @param c the connection
+static void read_input(conn_t *c) {
+    char buf[4096];
+    while (!c->eof && c->queued <= MAX_BATCH) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            c->eof = true;
+            if (c->in_len > 0 && !queue_line(c)) {
+                c->quitting = true;
+            }
+            return;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            c->in[c->in_len++] = buf[i];
+            if ((buf[i] == '\n' || c->in_len == BUFFER_SIZE - 1) &&
+                !queue_line(c)) {
+                c->eof = c->quitting = true;
+                return;
+            }
+        }
+    }
+}
+
+/// Close the connection and release everything it holds except the
+/// connection itself, which goes on the closed list.
+///
+/// @param c the connection, which must not have a job with a worker
+static void release(conn_t *c) {
+    if (c->watched) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    close(c->fd);
+    free_lines(c->head);
+    free_lines(c->job);
+    free(c->result);
+    free(c->out);
+    c->closed = true;
+    if (c->prev_conn != NULL) {
+        c->prev_conn->next_conn = c->next_conn;
+    }
+    else {
+        conns = c->next_conn;
+    }
+    if (c->next_conn != NULL) {
+        c->next_conn->prev_conn = c->prev_conn;
+    }
+    c->next = closed_conns;
+    closed_conns = c;
+}
+
+/// Free the connections released during this pass of the event loop.
+static void free_closed(void) {
+    while (closed_conns != NULL) {
+        conn_t *c = closed_conns;
+        closed_conns = c->next;
+        free(c);
+    }
+}
+
+/// Bring the connection up to date after something happened to it: start
+/// its next line, write what output it can, and either close it or wait for
+/// whatever it needs next.
+///
+/// @param c the connection
+static void progress(conn_t *c) {
+    flush_out(c);
+    submit(c);
+    bool pending = c->out_off < c->out_len;
+    if (c->job == NULL && !pending &&
+        (c->quitting || (c->eof && c->head == NULL))) {
+        release(c);
+        return;
+    }
+    // input waits while a whole batch is already queued; a connection
+    // waiting only on its worker leaves the epoll set, since a hung up
+    // socket would otherwise be reported on every pass
+    struct epoll_event ev = { .data.ptr = c };
+    if (!c->eof && c->queued <= MAX_BATCH) {
+        ev.events |= EPOLLIN;
+    }
+    if (pending) {
+        ev.events |= EPOLLOUT;
+    }
+    if (ev.events == 0) {
+        if (c->watched) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+            c->watched = false;
+        }
+    }
+    else {
+        epoll_ctl(epoll_fd, c->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+            c->fd, &ev);
+        c->watched = true;
+    }
+}
+
+/// Accept every waiting client and send each the first prompt.
+///
+/// @param listen_fd the listening socket
+static void accept_clients(int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "error: accept: %s\n", strerror(errno));
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        conn_t *c = calloc(1, sizeof(conn_t));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->next_conn = conns;
+        if (conns != NULL) {
+            conns->prev_conn = c;
+        }
+        conns = c;
+        if (!append_out(c, PROMPT, strlen(PROMPT))) {
+            c->quitting = true;
+        }
+        progress(c);
+    }
+}
+
+/// Take back every connection the workers have finished with and pass its
+/// output on to the client.
+static void finish_jobs(void) {
+    uint64_t count;
+    if (read(wake_fd, &count, sizeof(count)) < 0) {
+        // nothing to drain; the done queue is checked regardless
+    }
+    pthread_mutex_lock(&done_lock);
+    conn_t *c = done_head;
+    done_head = NULL;
+    pthread_mutex_unlock(&done_lock);
+    while (c != NULL) {
+        conn_t *next = c->next;
+        free_lines(c->job);
+        c->job = NULL;
+        if (c->result == NULL || c->status == AMICI_QUIT ||
+            !append_out(c, c->result, c->result_len)) {
+            c->quitting = true;
+        }
+        free(c->result);
+        c->result = NULL;
+        progress(c);
+        c = next;
+    }
+}
+
+/// Create the listening socket at path.
+///
+/// @param path file system path of the socket
+/// @return the socket, or -1 after reporting an error
+static int open_listener(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "error: socket: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "error: cannot listen on '%s': %s\n", path,
+            strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// Add fd to the epoll set for input, tagged with mark.
+///
+/// @param fd descriptor to watch
+/// @param mark tag reported with its events
+/// @return whether it was added
+static bool watch(int fd, int *mark) {
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.ptr = mark;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+int serve(const char *path, int threads) {
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+
+    // workers inherit this mask, so only the signalfd sees these signals
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = open_listener(path);
+    if (listen_fd < 0) {
+        return EXIT_FAILURE;
+    }
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || wake_fd < 0 || epoll_fd < 0 ||
+        !watch(listen_fd, &listen_mark) || !watch(wake_fd, &wake_mark) ||
+        !watch(signal_fd, &signal_mark)) {
+        fprintf(stderr, "error: cannot start event loop: %s\n",
+            strerror(errno));
+        close(listen_fd);
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+    stopping = false;
+    while (workers != NULL && started < threads &&
+        pthread_create(&workers[started], NULL, worker, NULL) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "error: cannot start worker threads\n");
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    bool running = started > 0;
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "error: epoll_wait: %s\n", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *mark = events[i].data.ptr;
+            if (mark == &listen_mark) {
+                accept_clients(listen_fd);
+            }
+            else if (mark == &wake_mark) {
+                finish_jobs();
+            }
+            else if (mark == &signal_mark) {
+                running = false;
+            }
+            else if (!((conn_t *)mark)->closed) {
+                conn_t *c = mark;
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    c->out_off = c->out_len = 0;
+                    c->eof = c->quitting = true;
+                }
+                else if (events[i].events & EPOLLIN) {
+                    read_input(c);
+                }
+                progress(c);
+            }
+        }
+        free_closed();
+    }
+
+    // let the workers finish what they hold, then drop every client
+    pthread_mutex_lock(&work_lock);
+    stopping = true;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&work_lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    done_head = NULL;
+    while (conns != NULL) {
+        release(conns);
+    }
+    free_closed();
+    close(listen_fd);
+    close(signal_fd);
+    close(wake_fd);
+    close(epoll_fd);
+    unlink(path);
+    return started > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,34 @@
+/// @file server.h
+/// @brief Multi-client server mode for amici over a Unix-domain socket.
+///
+/// Each client speaks the same line protocol as the interactive program:
+/// it is sent the prompt, writes one command line, and receives the
+/// command's output (and error messages) followed by the next prompt.
+/// A client may instead send a batch (see batch_size in amici.h) and
+/// receive one framed response per command, then the next prompt.
+/// Commands are run by a pool of worker threads; one event loop thread owns
+/// every socket, so all writes to a client happen in order from that thread.
+/// The files of export and load are kept inside the directory given by
+/// --export-dir, and refused without one.
+///
+/// @author Ryan Nowak rcn8263
+
+#ifndef SERVER_H
+#define SERVER_H
+
+/// Most bytes of responses held for one client before the server stops
+/// running its commands until the client reads them.
+#define OUT_HIGH_WATER (1 << 20)
+
+/// Most connections waited on by one call to epoll_wait.
+#define MAX_EVENTS 64
+
+/// Serve the network on a Unix-domain socket until SIGINT or SIGTERM.
+/// Any existing file at path is replaced.
+///
+/// @param path file system path of the socket
+/// @param threads number of worker threads; 0 uses one per online CPU
+/// @return EXIT_SUCCESS after a clean shutdown, EXIT_FAILURE on setup error
+int serve(const char *path, int threads);
+
+#endif // SERVER_H
@@ -0,0 +1,71 @@
+/// @file writer.h
+/// @brief Streaming of large files through a few fixed-size buffers, for
+///    writing the network to disk without holding it in memory. Any
+///    feature that writes the network to a file goes through a writer.
+///
+/// Full buffers are written in the background by a pool of I/O threads,
+/// while the caller serializes into the next buffer on its own thread.
+/// The file is opened for direct I/O when the file system allows it, so a
+/// dump bigger than memory does not push everything else out of the page
+/// cache; otherwise it is written through the page cache as usual.
+///
+/// A writer is used by one thread at a time.
+///
+/// @author Ryan Nowak rcn8263
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>    // bool
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+
+/// Bytes of each of a writer's buffers, a multiple of the block size
+/// direct I/O needs.
+#define WRITER_BUFFER (1024 * 1024)
+
+/// Buffers of a writer: one being filled while the others are written.
+#define WRITER_BUFFERS 2
+
+/// I/O threads shared by every writer.
+#define WRITER_THREADS 4
+
+typedef struct writer_s writer_t;
+
+/// Create or truncate a file and open a writer on it.
+///
+/// @param path the file
+/// @return the writer, or NULL with errno set if the file cannot be opened
+///    or there is no memory for the buffer
+writer_t *writer_open(const char *path);
+
+/// Append bytes to the file. The caller waits only when the buffer it
+/// fills next is still being written. Once a write fails, nothing more is
+/// written and writer_close reports the failure.
+///
+/// @param writer the writer
+/// @param data the bytes
+/// @param bytes number of bytes
+/// @return false if a write of the file is known to have failed
+bool writer_write(writer_t *writer, const void *data, size_t bytes);
+
+/// Append a C-string to the file, without its NUL.
+///
+/// @param writer the writer
+/// @param s the C-string
+/// @return false if a write of the file is known to have failed
+bool writer_string(writer_t *writer, const char *s);
+
+/// Return the number of bytes appended so far.
+///
+/// @param writer the writer
+uint64_t writer_length(const writer_t *writer);
+
+/// Write out whatever is buffered, wait for every write, close the file
+/// and free the writer.
+///
+/// @param writer the writer
+/// @return false, with errno set, if any write to the file failed
+bool writer_close(writer_t *writer);
+
+#endif // WRITER_H